@@ -1,58 +1,98 @@
+#include <errno.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <pthread.h>
 #include <getopt.h>
 
 #include "sredis.h"
+#include "sredis_mock.h"
+#include "xerror.h"
 
 #define REDIS_HOST      "127.0.0.1"
 #define REDIS_PORT      6379
 
+#define KEY_MAX         64
+
+int debug_mode = 0;
+
 char *redis_host;
 int redis_port = REDIS_PORT;
 
 struct timeval redis_ctimeout = { 5, 0 };
 struct timeval redis_otimeout = { 30, 0 };
 
-int redis_repeat_count = 100;
+int nthreads = 4;
+int nconnections = 1;
+int pipeline_depth = 1;
+long key_space = 100000;
+int value_min = 32;
+int value_max = 32;
+int read_ratio = 80;            /* percentage of GET */
+int duration = 10;              /* seconds; ignored if repeat_count > 0 */
+long repeat_count = 0;          /* requests per thread */
+int use_mock = 0;               /* against the in-process mock server */
 
 struct option long_opts[] = {
   { "host", required_argument, 0, 'h' },
   { "port", required_argument, 0, 'p' },
   { "ctimeout", required_argument, 0, 'C' },
   { "otimeout", required_argument, 0, 'O' },
+  { "threads", required_argument, 0, 't' },
+  { "connections", required_argument, 0, 'c' },
+  { "pipeline", required_argument, 0, 'P' },
+  { "keys", required_argument, 0, 'k' },
+  { "value-size", required_argument, 0, 'd' },
+  { "read-ratio", required_argument, 0, 'R' },
+  { "duration", required_argument, 0, 'T' },
   { "repeat", required_argument, 0, 'r' },
+  { "mock", no_argument, 0, 'M' },
+  { "help", no_argument, 0, 'H' },
   { NULL, 0, NULL, 0, },
 };
 
+REDIS **connections;
+char *value_buf;                /* VALUE_MAX 'x's */
 
-REDIS *redis;
-
-static long diff_timespec(const struct timespec *now,
-                          const struct timespec *old);
-
-static void *thread_main(void *arg);
+struct child {
+  pthread_t thread;
+  REDIS *redis;
+  unsigned seed;
 
+  unsigned long long requests;
+  unsigned long long errors;
+  struct redis_histogram latency;       /* of each request */
+};
 
-pthread_t *child_threads;
-size_t nchild_threads;
-size_t nchild_ready;
+struct child *children;
 
 pthread_mutex_t cond_mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+int nchild_ready;
 int child_go = 0;
+volatile int child_stop = 0;
+
+static void usage(void);
+static void *thread_main(void *arg);
+static unsigned long long now_ns(void);
+static void report(double elapsed);
+
 
 int
 main(int argc, char *argv[])
 {
+  unsigned long long begin, end;
+  REDIS_MOCK *mock = NULL;
   int i;
 
   redis_host = strdup(REDIS_HOST);
 
   while (1) {
-    int opt = getopt_long(argc, argv, "h:p:C:O:", long_opts, NULL);
+    int opt = getopt_long(argc, argv, "h:p:C:O:t:c:P:k:d:R:T:r:MH",
+                          long_opts, NULL);
     if (opt == -1)
       break;
     switch (opt) {
@@ -69,80 +109,262 @@ main(int argc, char *argv[])
     case 'O':
       redis_otimeout.tv_sec = atoi(optarg);
       break;
+    case 't':
+      nthreads = atoi(optarg);
+      break;
+    case 'c':
+      nconnections = atoi(optarg);
+      break;
+    case 'P':
+      pipeline_depth = atoi(optarg);
+      break;
+    case 'k':
+      key_space = atol(optarg);
+      break;
+    case 'd':
+      if (sscanf(optarg, "%d:%d", &value_min, &value_max) != 2)
+        value_min = value_max = atoi(optarg);
+      break;
+    case 'R':
+      read_ratio = atoi(optarg);
+      break;
+    case 'T':
+      duration = atoi(optarg);
+      break;
     case 'r':
-      redis_repeat_count = atoi(optarg);
+      repeat_count = atol(optarg);
+      break;
+    case 'M':
+      use_mock = 1;
       break;
+    case 'H':
+      usage();
+      return 0;
+    default:
+      usage();
+      return 1;
     }
   }
 
-  argc -= optind;
-  argv -= optind;
+  if (nthreads <= 0 || nconnections <= 0 || pipeline_depth <= 0 ||
+      key_space <= 0 || value_min < 0 || value_max < value_min ||
+      read_ratio < 0 || read_ratio > 100 ||
+      (repeat_count <= 0 && duration <= 0))
+    xerror(1, 0, "invalid argument(s); try --help");
+
+  value_buf = malloc(value_max + 1);
+  if (!value_buf)
+    xerror(1, errno, "can't allocate memory");
+  memset(value_buf, 'x', value_max);
+  value_buf[value_max] = '\0';
+
+  if (use_mock) {
+    mock = redis_mock_new(NULL, 0);
+    if (!mock)
+      xerror(1, errno, "can't start the mock server");
+    free(redis_host);
+    redis_host = strdup("127.0.0.1");
+    redis_port = redis_mock_port(mock);
+  }
 
-  for (i = 0; i < nchild_threads; i++) {
-    pthread_create(&child_threads[i], thread_main, argv[0]);
+  connections = calloc(nconnections, sizeof(*connections));
+  if (!connections)
+    xerror(1, errno, "can't allocate memory");
+  for (i = 0; i < nconnections; i++) {
+    connections[i] = redis_open(redis_host, redis_port,
+                                &redis_ctimeout, &redis_otimeout);
+    if (!connections[i])
+      xerror(1, 0, "can't open redis");
   }
 
-  while (1) {
-    int ready = __sync_fetch_and_add(&nchild_ready, 0);
-    if (ready >= nchild_threads)
-      break;
+  children = calloc(nthreads, sizeof(*children));
+  if (!children)
+    xerror(1, errno, "can't allocate memory");
+
+  for (i = 0; i < nthreads; i++) {
+    int ret;
 
-    fprintf(stderr, "%d thread(s) ready\n", ready);
-    usleep(100);
+    children[i].redis = connections[i % nconnections];
+    children[i].seed = (unsigned)time(NULL) + i;
+    ret = pthread_create(&children[i].thread, NULL, thread_main, &children[i]);
+    if (ret)
+      xerror(1, ret, "pthread_create() failed");
   }
 
   pthread_mutex_lock(&cond_mutex);
+  while (nchild_ready < nthreads)
+    pthread_cond_wait(&cond, &cond_mutex);
+  child_go = 1;
   pthread_cond_broadcast(&cond);
+  pthread_mutex_unlock(&cond_mutex);
 
-  {
-    int i;
-    long retval;
+  begin = now_ns();
 
-    for (i = 0; i < nchild_threads; i++) {
-      pthread_join(child_threads[i], (void **)&retval);
-    }
+  if (repeat_count <= 0) {
+    sleep(duration);
+    child_stop = 1;
   }
 
-  //redis = redis_open(redis_host, redis_port, &redis_ctimeout, &redis_otimeout);
-
+  for (i = 0; i < nthreads; i++)
+    pthread_join(children[i].thread, NULL);
 
+  end = now_ns();
 
+  report((end - begin) / 1e9);
 
-  redis_close(redis);
+  for (i = 0; i < nconnections; i++)
+    redis_close(connections[i]);
+  free(connections);
+  redis_mock_close(mock);
+  free(children);
+  free(value_buf);
+  free(redis_host);
   return 0;
 }
 
 
-static long
-diff_timespec(const struct timespec *now, const struct timespec *old)
+static void
+usage(void)
 {
-  long d;
+  printf("usage: sredis-benchmark [OPTION...]\n\n"
+         "  -h, --host=HOST           redis host (default: %s)\n"
+         "  -p, --port=PORT           redis port (default: %d)\n"
+         "  -C, --ctimeout=SEC        connection timeout\n"
+         "  -O, --otimeout=SEC        operation timeout\n"
+         "  -t, --threads=N           number of threads (default: %d)\n"
+         "  -c, --connections=N       number of REDIS, shared by the "
+         "threads (default: %d)\n"
+         "  -P, --pipeline=N          requests per round trip (default: %d)\n"
+         "  -k, --keys=N              size of the key space (default: %ld)\n"
+         "  -d, --value-size=MIN[:MAX]  size of the values (default: %d)\n"
+         "  -R, --read-ratio=PERCENT  percentage of GET (default: %d)\n"
+         "  -T, --duration=SEC        duration of the run (default: %d)\n"
+         "  -r, --repeat=N            requests per thread, instead of -T\n"
+         "  -M, --mock                run against an in-process mock server\n",
+         REDIS_HOST, REDIS_PORT, nthreads, nconnections, pipeline_depth,
+         key_space, value_min, read_ratio, duration);
+}
+
 
-  d = (now->tv_nsec - old->tv_nsec) / 1000000;
-  d += (now->tv_sec - old->tv_sec) * 1000;
+static unsigned long long
+now_ns(void)
+{
+  struct timespec ts;
 
-  return d;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/* Append one random request to the pipeline of REDIS. */
+static int
+append_request(struct child *child)
+{
+  char key[KEY_MAX];
+  int len, roll;
+
+  snprintf(key, sizeof(key), "sredis-bench:%ld",
+           (long)(rand_r(&child->seed) % key_space));
+
+  roll = rand_r(&child->seed) % 100;
+  if (roll < read_ratio)
+    return redis_append_unlocked(child->redis, "GET %s", key);
+
+  len = value_min + (value_max > value_min
+                     ? rand_r(&child->seed) % (value_max - value_min + 1) : 0);
+  return redis_append_unlocked(child->redis, "SET %s %s", key,
+                               value_buf + (value_max - len));
 }
 
 
 static void *
 thread_main(void *arg)
 {
-  struct timespec tm_begin, tm_end;
+  struct child *child = (struct child *)arg;
+  unsigned long long start, elapsed;
   redisReply *reply;
-  int i;
+  long n = 0;
+  size_t i, replied;
 
   pthread_mutex_lock(&cond_mutex);
-  pthread_cond_wait(&cond, &cond_mutex);
-
-  clock_gettime(CLOCK_MONOTONIC, &tm_begin);
-
-  for (i = 0; i < redis_repeat_count; i++) {
-    reply = redis_command(redis, (const char *)arg);
+  nchild_ready++;
+  pthread_cond_broadcast(&cond);
+  while (!child_go)
+    pthread_cond_wait(&cond, &cond_mutex);
+  pthread_mutex_unlock(&cond_mutex);
+
+  while (!child_stop && (repeat_count <= 0 || n < repeat_count)) {
+    start = now_ns();
+
+    /* The REDIS may be shared by other threads. */
+    redis_lock(child->redis);
+    for (i = 0; i < (size_t)pipeline_depth; i++) {
+      if (append_request(child) != REDIS_OK)
+        break;
+    }
+    reply = redis_exec_unlocked(child->redis);
+    redis_unlock(child->redis);
+
+    elapsed = now_ns() - start;
+
+    /* A failed append or a reconnect may leave some requests without
+     * a reply; they count as errors, and not as requests. */
+    replied = reply ? reply->elements : 0;
+    child->errors += pipeline_depth - replied;
+    for (i = 0; i < replied; i++) {
+      if (redis_iserror(reply->element[i]))
+        child->errors++;
+      redis_histogram_add(&child->latency, elapsed);
+    }
     redis_free(reply);
+
+    child->requests += replied;
+    n += pipeline_depth;
   }
 
-  clock_gettime(CLOCK_MONOTONIC, &tm_end);
+  return NULL;
+}
+
+
+static void
+report(double elapsed)
+{
+  struct redis_histogram *h;
+  unsigned long long requests = 0, errors = 0;
+  int i, j;
+
+  h = calloc(1, sizeof(*h));
+  if (!h)
+    xerror(1, errno, "can't allocate memory");
+
+  for (i = 0; i < nthreads; i++) {
+    struct redis_histogram *c = &children[i].latency;
+
+    requests += children[i].requests;
+    errors += children[i].errors;
+
+    h->count += c->count;
+    h->sum += c->sum;
+    if (c->max > h->max)
+      h->max = c->max;
+    for (j = 0; j < REDIS_HIST_BUCKETS; j++)
+      h->buckets[j] += c->buckets[j];
+  }
 
-  return (void *)diff_timespec(&tm_end, &tm_begin);
+  printf("threads %d, connections %d, pipeline %d, keys %ld, "
+         "value %d..%d bytes, GET %d%%\n",
+         nthreads, nconnections, pipeline_depth, key_space,
+         value_min, value_max, read_ratio);
+  printf("requests    %llu (%llu errors) in %.3f s\n",
+         requests, errors, elapsed);
+  printf("throughput  %.0f requests/s\n", requests / elapsed);
+  printf("latency     avg %.1f us, p50 %.1f us, p99 %.1f us, "
+         "p99.9 %.1f us, max %.1f us\n",
+         h->count ? (double)h->sum / h->count / 1000.0 : 0.0,
+         redis_histogram_value(h, 50.0) / 1000.0,
+         redis_histogram_value(h, 99.0) / 1000.0,
+         redis_histogram_value(h, 99.9) / 1000.0,
+         h->max / 1000.0);
+
+  free(h);
 }
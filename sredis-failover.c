@@ -0,0 +1,449 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <pthread.h>
+#include <getopt.h>
+
+#include "sredis.h"
+#include "sredis_mock.h"
+#include "xerror.h"
+
+/*
+ * Measure how long writes are unavailable while the master fails
+ * over to the replica.
+ *
+ * Every thread runs SET in a loop with its own REDIS, which knows
+ * both endpoints.  After the warm-up, the master is either killed or
+ * demoted to a replica of the old replica, which is promoted.  Then
+ * the threads keep writing until all of them succeed again (or the
+ * deadline passes).
+ *
+ * Without --master and --replica, two in-process mock servers are
+ * used.  With real servers, "kill" sends SHUTDOWN NOSAVE to the
+ * master, so do not point this to anything you care about.
+ */
+
+#define KEY_MAX         64
+
+enum { FAILOVER_KILL, FAILOVER_DEMOTE };
+
+int debug_mode = 0;
+
+char *master_host;
+int master_port;
+char *replica_host;
+int replica_port;
+
+struct timeval redis_ctimeout = { 1, 0 };
+struct timeval redis_otimeout = { 1, 0 };
+
+int nthreads = 4;
+int failover_mode = FAILOVER_KILL;
+int warmup = 2;                 /* seconds before the failover */
+int deadline = 10;              /* seconds to wait for the recovery */
+long gate_ms = 0;               /* fail if a thread stalls longer */
+
+struct option long_opts[] = {
+  { "master", required_argument, 0, 'm' },
+  { "replica", required_argument, 0, 's' },
+  { "ctimeout", required_argument, 0, 'C' },
+  { "otimeout", required_argument, 0, 'O' },
+  { "threads", required_argument, 0, 't' },
+  { "mode", required_argument, 0, 'f' },
+  { "warmup", required_argument, 0, 'w' },
+  { "deadline", required_argument, 0, 'T' },
+  { "gate", required_argument, 0, 'g' },
+  { "help", no_argument, 0, 'H' },
+  { NULL, 0, NULL, 0, },
+};
+
+REDIS_MOCK *mock_master, *mock_replica;
+
+struct child {
+  pthread_t thread;
+  int index;
+  REDIS *redis;
+
+  unsigned long long requests;
+  unsigned long long failures;          /* after the failover */
+  unsigned long long first_ok;          /* first success started after
+                                         * the failover, or 0 */
+  unsigned long long stall;             /* longest gap of successes */
+};
+
+struct child *children;
+
+volatile unsigned long long failover_at = 0;
+volatile int child_stop = 0;
+
+static void usage(void);
+static void *thread_main(void *arg);
+static unsigned long long now_ns(void);
+static int parse_endpoint(const char *s, char **host, int *port);
+static int failover(void);
+static int report(void);
+
+
+int
+main(int argc, char *argv[])
+{
+  unsigned long long start;
+  int i, ret, done;
+
+  while (1) {
+    int opt = getopt_long(argc, argv, "m:s:C:O:t:f:w:T:g:H", long_opts, NULL);
+    if (opt == -1)
+      break;
+    switch (opt) {
+    case 'm':
+      if (parse_endpoint(optarg, &master_host, &master_port) == -1)
+        xerror(1, 0, "invalid endpoint: %s", optarg);
+      break;
+    case 's':
+      if (parse_endpoint(optarg, &replica_host, &replica_port) == -1)
+        xerror(1, 0, "invalid endpoint: %s", optarg);
+      break;
+    case 'C':
+      redis_ctimeout.tv_sec = atoi(optarg) / 1000;
+      redis_ctimeout.tv_usec = atoi(optarg) % 1000 * 1000;
+      break;
+    case 'O':
+      redis_otimeout.tv_sec = atoi(optarg) / 1000;
+      redis_otimeout.tv_usec = atoi(optarg) % 1000 * 1000;
+      break;
+    case 't':
+      nthreads = atoi(optarg);
+      break;
+    case 'f':
+      if (strcmp(optarg, "kill") == 0)
+        failover_mode = FAILOVER_KILL;
+      else if (strcmp(optarg, "demote") == 0)
+        failover_mode = FAILOVER_DEMOTE;
+      else
+        xerror(1, 0, "unknown failover mode: %s", optarg);
+      break;
+    case 'w':
+      warmup = atoi(optarg);
+      break;
+    case 'T':
+      deadline = atoi(optarg);
+      break;
+    case 'g':
+      gate_ms = atol(optarg);
+      break;
+    case 'H':
+      usage();
+      return 0;
+    default:
+      usage();
+      return 1;
+    }
+  }
+
+  if (nthreads <= 0 || warmup < 0 || deadline <= 0 ||
+      !master_host != !replica_host)
+    xerror(1, 0, "invalid argument(s); try --help");
+
+  if (!master_host) {
+    mock_master = redis_mock_new(NULL, 0);
+    mock_replica = redis_mock_new(NULL, 0);
+    if (!mock_master || !mock_replica)
+      xerror(1, errno, "can't start the mock servers");
+    master_host = strdup("127.0.0.1");
+    master_port = redis_mock_port(mock_master);
+    replica_host = strdup("127.0.0.1");
+    replica_port = redis_mock_port(mock_replica);
+    redis_mock_set_master(mock_replica, master_host, master_port);
+  }
+
+  children = calloc(nthreads, sizeof(*children));
+  if (!children)
+    xerror(1, errno, "can't allocate memory");
+
+  for (i = 0; i < nthreads; i++) {
+    REDIS *redis = redis_open(master_host, master_port,
+                              &redis_ctimeout, &redis_otimeout);
+    if (!redis)
+      xerror(1, 0, "can't open redis");
+    if (redis_host_add(redis, replica_host, replica_port,
+                       &redis_ctimeout, &redis_otimeout) < 0)
+      xerror(1, 0, "can't add the replica");
+
+    children[i].index = i;
+    children[i].redis = redis;
+    ret = pthread_create(&children[i].thread, NULL, thread_main, &children[i]);
+    if (ret)
+      xerror(1, ret, "pthread_create() failed");
+  }
+
+  sleep(warmup);
+
+  failover_at = now_ns();
+  if (failover() == -1)
+    xerror(0, 0, "failover did not complete; measuring anyway");
+
+  /* Wait until every thread wrote successfully to the new master. */
+  start = now_ns();
+  do {
+    usleep(10000);
+    for (i = 0, done = 1; i < nthreads; i++) {
+      if (!__sync_add_and_fetch(&children[i].first_ok, 0))
+        done = 0;
+    }
+  } while (!done && now_ns() - start < deadline * 1000000000ULL);
+
+  /* Keep the load a little longer, so that late stalls show up. */
+  usleep(100000);
+  child_stop = 1;
+
+  for (i = 0; i < nthreads; i++)
+    pthread_join(children[i].thread, NULL);
+
+  ret = report();
+
+  for (i = 0; i < nthreads; i++)
+    redis_close(children[i].redis);
+  free(children);
+  redis_mock_close(mock_master);
+  redis_mock_close(mock_replica);
+  free(master_host);
+  free(replica_host);
+  return ret;
+}
+
+
+static void
+usage(void)
+{
+  printf("usage: sredis-failover [OPTION...]\n\n"
+         "  -m, --master=HOST:PORT    the master (default: a mock server)\n"
+         "  -s, --replica=HOST:PORT   its replica (default: a mock server)\n"
+         "  -C, --ctimeout=MSEC       connection timeout (default: %ld)\n"
+         "  -O, --otimeout=MSEC       operation timeout (default: %ld)\n"
+         "  -t, --threads=N           number of writers (default: %d)\n"
+         "  -f, --mode=kill|demote    how the master fails (default: kill)\n"
+         "  -w, --warmup=SEC          load before the failover (default: %d)\n"
+         "  -T, --deadline=SEC        wait for the recovery (default: %d)\n"
+         "  -g, --gate=MSEC           exit with 1 if writes were unavailable\n"
+         "                            longer than MSEC in any thread\n",
+         (long)(redis_ctimeout.tv_sec * 1000 + redis_ctimeout.tv_usec / 1000),
+         (long)(redis_otimeout.tv_sec * 1000 + redis_otimeout.tv_usec / 1000),
+         nthreads, warmup, deadline);
+}
+
+
+static unsigned long long
+now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+static int
+parse_endpoint(const char *s, char **host, int *port)
+{
+  const char *colon = strrchr(s, ':');
+
+  if (!colon || colon == s || atoi(colon + 1) <= 0)
+    return -1;
+  free(*host);
+  *host = strndup(s, colon - s);
+  *port = atoi(colon + 1);
+  return *host ? 0 : -1;
+}
+
+
+/*
+ * Send a command to a real server, bypassing sredis.
+ */
+static int
+admin_command(const char *host, int port, const char *command)
+{
+  redisContext *ctx = redisConnectWithTimeout(host, port, redis_ctimeout);
+  redisReply *reply;
+  int ret = 0;
+
+  if (!ctx || ctx->err) {
+    xerror(0, 0, "can't connect to %s:%d", host, port);
+    redisFree(ctx);
+    return -1;
+  }
+
+  reply = redisCommand(ctx, command);
+  if (reply && reply->type == REDIS_REPLY_ERROR) {
+    xerror(0, 0, "%s:%d: %s: %s", host, port, command, reply->str);
+    ret = -1;
+  }
+  /* SHUTDOWN does not answer; a NULL reply is expected. */
+  if (reply)
+    freeReplyObject(reply);
+  redisFree(ctx);
+  return ret;
+}
+
+
+static int
+failover(void)
+{
+  char command[512];
+
+  if (mock_master) {
+    if (failover_mode == FAILOVER_KILL) {
+      if (redis_mock_stop(mock_master) == -1)
+        return -1;
+    }
+    else
+      redis_mock_set_master(mock_master, replica_host, replica_port);
+    redis_mock_set_master(mock_replica, NULL, 0);
+    return 0;
+  }
+
+  if (failover_mode == FAILOVER_KILL &&
+      admin_command(master_host, master_port, "SHUTDOWN NOSAVE") == -1)
+    return -1;
+  if (admin_command(replica_host, replica_port, "REPLICAOF NO ONE") == -1)
+    return -1;
+  if (failover_mode == FAILOVER_DEMOTE) {
+    snprintf(command, sizeof(command), "REPLICAOF %s %d",
+             replica_host, replica_port);
+    if (admin_command(master_host, master_port, command) == -1)
+      return -1;
+  }
+  return 0;
+}
+
+
+static void *
+thread_main(void *arg)
+{
+  struct child *child = (struct child *)arg;
+  unsigned long long start, end, last_ok;
+  char key[KEY_MAX];
+  redisReply *reply;
+  int ok;
+
+  snprintf(key, sizeof(key), "sredis-failover:%d", child->index);
+  last_ok = now_ns();
+
+  while (!child_stop) {
+    start = now_ns();
+    reply = redis_command(child->redis, "SET %s %llu", key, child->requests);
+    end = now_ns();
+    ok = (reply && reply->type != REDIS_REPLY_ERROR);
+    redis_free(reply);
+
+    child->requests++;
+    if (failover_at && start >= failover_at) {
+      if (!ok)
+        child->failures++;
+      else if (!child->first_ok)
+        __sync_bool_compare_and_swap(&child->first_ok, 0, end);
+    }
+    if (ok) {
+      if (end - last_ok > child->stall)
+        child->stall = end - last_ok;
+      last_ok = end;
+    }
+    else
+      usleep(1000);             /* do not spin on a refused connection */
+  }
+
+  return NULL;
+}
+
+
+static int
+compare_ull(const void *a, const void *b)
+{
+  unsigned long long x = *(const unsigned long long *)a;
+  unsigned long long y = *(const unsigned long long *)b;
+
+  return (x > y) - (x < y);
+}
+
+
+static int
+report(void)
+{
+  struct redis_stats_snapshot snap;
+  unsigned long long counters[REDIS_COUNTER_MAX] = { 0, };
+  unsigned long long *stalls, requests = 0, failures = 0;
+  unsigned long long ttfs_min = 0, ttfs_max = 0, ttfs;
+  int i, j, recovered = 0, ret = 0;
+
+  stalls = calloc(nthreads, sizeof(*stalls));
+  if (!stalls)
+    xerror(1, errno, "can't allocate memory");
+
+  printf("mode %s, threads %d, master %s:%d, replica %s:%d%s\n",
+         failover_mode == FAILOVER_KILL ? "kill" : "demote", nthreads,
+         master_host, master_port, replica_host, replica_port,
+         mock_master ? " (mock)" : "");
+
+  for (i = 0; i < nthreads; i++) {
+    struct child *c = &children[i];
+
+    if (redis_stats_snapshot(c->redis, &snap) == 0) {
+      for (j = 0; j < REDIS_COUNTER_MAX; j++)
+        counters[j] += snap.counters[j];
+      redis_stats_snapshot_free(&snap);
+    }
+
+    requests += c->requests;
+    failures += c->failures;
+    stalls[i] = c->stall;
+
+    if (c->first_ok) {
+      ttfs = c->first_ok - failover_at;
+      if (!recovered++ || ttfs < ttfs_min)
+        ttfs_min = ttfs;
+      if (ttfs > ttfs_max)
+        ttfs_max = ttfs;
+      printf("thread %3d  first success %9.3f ms, stall %9.3f ms, "
+             "%llu failures\n", i, ttfs / 1e6, c->stall / 1e6, c->failures);
+    }
+    else
+      printf("thread %3d  never recovered, stall %9.3f ms, %llu failures\n",
+             i, c->stall / 1e6, c->failures);
+  }
+
+  qsort(stalls, nthreads, sizeof(*stalls), compare_ull);
+
+  printf("requests              %llu (%llu failed after the failover)\n",
+         requests, failures);
+  if (recovered)
+    printf("time to first success min %.3f ms, max %.3f ms "
+           "(%d of %d threads)\n",
+           ttfs_min / 1e6, ttfs_max / 1e6, recovered, nthreads);
+  else
+    printf("time to first success never\n");
+  printf("stall                 min %.3f ms, p50 %.3f ms, p90 %.3f ms, "
+         "max %.3f ms\n",
+         stalls[0] / 1e6, stalls[nthreads / 2] / 1e6,
+         stalls[nthreads * 9 / 10] / 1e6, stalls[nthreads - 1] / 1e6);
+  printf("reconnects            %llu (%llu connect failures, %llu failovers, "
+         "%llu -READONLY, %llu timeouts)\n",
+         counters[REDIS_COUNTER_RECONNECTS],
+         counters[REDIS_COUNTER_CONNECT_FAILURES],
+         counters[REDIS_COUNTER_FAILOVERS],
+         counters[REDIS_COUNTER_READONLY],
+         counters[REDIS_COUNTER_TIMEOUTS]);
+
+  if (recovered < nthreads)
+    ret = 1;
+  else if (gate_ms > 0 && stalls[nthreads - 1] > gate_ms * 1000000ULL) {
+    xerror(0, 0, "writes stalled %.3f ms, longer than %ld ms",
+           stalls[nthreads - 1] / 1e6, gate_ms);
+    ret = 1;
+  }
+
+  free(stalls);
+  return ret;
+}
@@ -0,0 +1,599 @@
+#define _GNU_SOURCE     1       /* asprintf(3) */
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+
+#include <getopt.h>
+
+#include "sredis.h"
+#include "sredis_private.h"
+#include "xerror.h"
+
+/*
+ * Micro-benchmarks of the client-side CPU costs.
+ *
+ * Nothing here talks to a server.  The REDIS used by the exec and INFO
+ * benchmarks is connected to one end of a socketpair(2); the replies
+ * are fed to its reader in advance, and what it sends is discarded
+ * from the other end outside of the measurement.
+ *
+ * Allocations are counted by wrapping malloc(3) and friends, which
+ * needs glibc; elsewhere allocs/op is shown as "-".
+ */
+
+int debug_mode = 0;
+
+long scale = 1;                 /* multiplies the iterations */
+const char *filter;             /* run only the benchmarks containing it */
+
+struct option long_opts[] = {
+  { "scale", required_argument, 0, 's' },
+  { "filter", required_argument, 0, 'f' },
+  { "help", no_argument, 0, 'H' },
+  { NULL, 0, NULL, 0, },
+};
+
+#ifdef __GLIBC__
+#define HAVE_ALLOC_COUNT        1
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+/* The benchmarks are single-threaded. */
+static unsigned long long nallocs;
+
+void *
+malloc(size_t size)
+{
+  nallocs++;
+  return __libc_malloc(size);
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+  nallocs++;
+  return __libc_calloc(nmemb, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+  nallocs++;
+  return __libc_realloc(ptr, size);
+}
+#else
+static unsigned long long nallocs;
+#endif  /* __GLIBC__ */
+
+/* accumulated by measure_start() and measure_stop() */
+static unsigned long long measured_ns, measured_allocs;
+static unsigned long long mark_ns, mark_allocs;
+
+static REDIS *offline;          /* see offline_open() */
+static int offline_peer = -1;
+
+static unsigned long long
+now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+static inline void
+measure_start(void)
+{
+  mark_allocs = nallocs;
+  mark_ns = now_ns();
+}
+
+
+static inline void
+measure_stop(void)
+{
+  measured_ns += now_ns() - mark_ns;
+  measured_allocs += nallocs - mark_allocs;
+}
+
+
+/*
+ * Create a REDIS whose connection goes nowhere; see the top of this
+ * file.
+ */
+static REDIS *
+offline_open(void)
+{
+  int sv[2];
+  REDIS *redis;
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1)
+    xerror(1, errno, "socketpair() failed");
+  if (fcntl(sv[1], F_SETFL, fcntl(sv[1], F_GETFL) | O_NONBLOCK) == -1)
+    xerror(1, errno, "fcntl() failed");
+
+  redis = redis_new();
+  if (!redis)
+    xerror(1, errno, "can't allocate REDIS");
+  redis->ctx = redisConnectFd(sv[0]);
+  if (!redis->ctx || redis->ctx->err)
+    xerror(1, 0, "redisConnectFd() failed");
+
+  offline_peer = sv[1];
+  return redis;
+}
+
+
+/* Discard what OFFLINE has sent so far. */
+static void
+offline_drain(void)
+{
+  char buf[16384];
+
+  while (read(offline_peer, buf, sizeof(buf)) > 0)
+    ;
+}
+
+
+static void
+offline_feed(const char *buf, size_t len)
+{
+  if (redisReaderFeed(offline->ctx->reader, buf, len) != REDIS_OK)
+    xerror(1, 0, "redisReaderFeed() failed");
+}
+
+
+/*
+ * Build the RESP array of N bulk strings into a malloc(3)ed buffer.
+ * If DEPTH is greater than 1, each element is an array of the depth
+ * DEPTH - 1 instead.
+ */
+static size_t
+build_array(char **out, int n, int depth)
+{
+  char *buf = NULL;
+  size_t len = 0;
+  FILE *fp = open_memstream(&buf, &len);
+  int i;
+
+  if (!fp)
+    xerror(1, errno, "open_memstream() failed");
+
+  fprintf(fp, "*%d\r\n", n);
+  for (i = 0; i < n; i++) {
+    if (depth > 1) {
+      char *sub;
+      size_t sublen = build_array(&sub, n, depth - 1);
+
+      fwrite(sub, 1, sublen, fp);
+      free(sub);
+    }
+    else
+      fprintf(fp, "$10\r\nvalue-%04d\r\n", i % 10000);
+  }
+  fclose(fp);
+
+  *out = buf;
+  return len;
+}
+
+
+static void
+bench_format(long n)
+{
+  const char *key = "sredis:bench:key:0001";
+  const char *value = "0123456789abcdef";
+  char *cmd;
+  long i;
+
+  measure_start();
+  for (i = 0; i < n; i++) {
+    if (redisFormatCommand(&cmd, "SET %s %s", key, value) < 0)
+      xerror(1, 0, "redisFormatCommand() failed");
+    redisFreeCommand(cmd);
+  }
+  measure_stop();
+}
+
+
+static void
+bench_format_argv(long n)
+{
+  const char *argv[] = { "SET", "sredis:bench:key:0001", "0123456789abcdef" };
+  char *cmd;
+  long i;
+
+  measure_start();
+  for (i = 0; i < n; i++) {
+    if (redisFormatCommandArgv(&cmd, 3, argv, NULL) < 0)
+      xerror(1, 0, "redisFormatCommandArgv() failed");
+    redisFreeCommand(cmd);
+  }
+  measure_stop();
+}
+
+
+static void
+bench_exec(long n)
+{
+  static const char reply[] = "$16\r\n0123456789abcdef\r\n";
+  redisReply *r;
+  long i;
+  int j;
+
+  for (i = 0; i < n; i++) {
+    measure_start();
+    for (j = 0; j < 16; j++) {
+      redis_append_unlocked(offline, "GET sredis:bench:%d", j);
+      offline_feed(reply, sizeof(reply) - 1);
+    }
+    r = redis_exec_unlocked(offline);
+    if (!r || r->elements != 16)
+      xerror(1, 0, "redis_exec_unlocked() failed");
+    redis_free(r);
+    measure_stop();
+    offline_drain();
+  }
+}
+
+
+static void
+bench_exec_flat(long n)
+{
+  static const char reply[] = "$16\r\n0123456789abcdef\r\n";
+  REDIS_FLAT *r;
+  long i;
+  int j;
+
+  for (i = 0; i < n; i++) {
+    measure_start();
+    for (j = 0; j < 16; j++) {
+      redis_append_unlocked(offline, "GET sredis:bench:%d", j);
+      offline_feed(reply, sizeof(reply) - 1);
+    }
+    r = redis_exec_flat_unlocked(offline);
+    if (!r || redis_flat_count(r) != 16)
+      xerror(1, 0, "redis_exec_flat_unlocked() failed");
+    redis_flat_free(r);
+    measure_stop();
+    offline_drain();
+  }
+}
+
+
+static void
+count_bulk(void *data, int type, const char *str, size_t len)
+{
+  (void)type;
+  (void)str;
+  (void)len;
+  (*(int *)data)++;
+}
+
+
+/*
+ * read (and free) an array of 1000 as a tree, flat (1), raw (2), or
+ * through callbacks (3)
+ */
+static void
+bench_command_array(long n, int how)
+{
+  static const struct redis_parse_handler handler = {
+    .on_bulk = count_bulk,
+  };
+  char *buf;
+  size_t len = build_array(&buf, 1000, 1);
+  redisReply *reply;
+  REDIS_FLAT *r;
+  REDIS_RAW *raw;
+  int bulks;
+  long i;
+
+  for (i = 0; i < n; i++) {
+    measure_start();
+    offline_feed(buf, len);
+    if (how == 3) {
+      bulks = 0;
+      if (redis_command_parse(offline, &handler, &bulks,
+                              "LRANGE sredis:bench 0 -1") != 0 ||
+          bulks != 1000)
+        xerror(1, 0, "redis_command_parse() failed");
+    }
+    else if (how == 2) {
+      raw = redis_command_raw(offline, "LRANGE sredis:bench 0 -1");
+      if (!raw || redis_raw_type(raw) != REDIS_REPLY_ARRAY)
+        xerror(1, 0, "redis_command_raw() failed");
+      redis_raw_free(raw);
+    }
+    else if (how == 1) {
+      r = redis_command_flat(offline, "LRANGE sredis:bench 0 -1");
+      if (!r || redis_flat_count(r) != 1000)
+        xerror(1, 0, "redis_command_flat() failed");
+      redis_flat_free(r);
+    }
+    else {
+      reply = redis_command(offline, "LRANGE sredis:bench 0 -1");
+      if (!reply || reply->elements != 1000)
+        xerror(1, 0, "redis_command() failed");
+      redis_free(reply);
+    }
+    measure_stop();
+    offline_drain();
+  }
+  free(buf);
+}
+
+
+static void
+bench_command_tree(long n)
+{
+  bench_command_array(n, 0);
+}
+
+
+static void
+bench_command_flat(long n)
+{
+  bench_command_array(n, 1);
+}
+
+
+static void
+bench_command_raw(long n)
+{
+  bench_command_array(n, 2);
+}
+
+
+static void
+bench_command_parse(long n)
+{
+  bench_command_array(n, 3);
+}
+
+
+static void
+bench_parse(long n, int elements, int depth, int free_only)
+{
+  redisReader *reader = redisReaderCreate();
+  void *reply;
+  char *buf;
+  size_t len = build_array(&buf, elements, depth);
+  long i;
+
+  if (!reader)
+    xerror(1, 0, "redisReaderCreate() failed");
+
+  for (i = 0; i < n; i++) {
+    if (!free_only)
+      measure_start();
+    if (redisReaderFeed(reader, buf, len) != REDIS_OK ||
+        redisReaderGetReply(reader, &reply) != REDIS_OK || !reply)
+      xerror(1, 0, "can't parse the reply");
+    if (!free_only)
+      measure_stop();
+
+    if (free_only)
+      measure_start();
+    freeReplyObject(reply);
+    if (free_only)
+      measure_stop();
+  }
+
+  redisReaderFree(reader);
+  free(buf);
+}
+
+
+static void
+bench_parse_array(long n)
+{
+  bench_parse(n, 1000, 1, 0);
+}
+
+
+static void
+bench_free_array(long n)
+{
+  bench_parse(n, 1000, 1, 1);
+}
+
+
+static void
+bench_free_nested(long n)
+{
+  bench_parse(n, 10, 3, 1);
+}
+
+
+static void
+bench_reply_integer(long n, int type, const char *str)
+{
+  redisReply reply;
+  long long sum = 0;
+  long i;
+
+  memset(&reply, 0, sizeof(reply));
+  reply.type = type;
+  reply.integer = 12345;
+  reply.str = (char *)str;
+  reply.len = str ? strlen(str) : 0;
+
+  measure_start();
+  for (i = 0; i < n; i++)
+    sum += redis_reply_integer(&reply);
+  measure_stop();
+
+  if (sum == 42)                /* keep the loop */
+    putchar('\0');
+}
+
+
+static void
+bench_reply_integer_int(long n)
+{
+  bench_reply_integer(n, REDIS_REPLY_INTEGER, NULL);
+}
+
+
+static void
+bench_reply_integer_str(long n)
+{
+  bench_reply_integer(n, REDIS_REPLY_STRING, "1234567890");
+}
+
+
+static void
+bench_reply_integer_sci(long n)
+{
+  bench_reply_integer(n, REDIS_REPLY_STRING, "3.2414214213422e+16");
+}
+
+
+static int
+info_handler(REDIS *redis, char *section, char *field, char *value,
+             void *data)
+{
+  (void)redis;
+  (void)section;
+  (void)field;
+  (void)value;
+  (*(int *)data)++;
+  return 1;
+}
+
+
+static void
+bench_parse_info(long n)
+{
+  char *info = NULL, *reply;
+  size_t info_len = 0;
+  FILE *fp = open_memstream(&info, &info_len);
+  int i, fields, len;
+
+  if (!fp)
+    xerror(1, errno, "open_memstream() failed");
+
+  /* About the size of INFO of a real server. */
+  fprintf(fp, "# Server\r\nredis_version:7.2.4\r\nredis_mode:standalone\r\n"
+          "os:Linux 6.1.0 x86_64\r\narch_bits:64\r\ntcp_port:6379\r\n\r\n");
+  fprintf(fp, "# Replication\r\nrole:slave\r\nmaster_host:10.0.0.1\r\n"
+          "master_port:6379\r\nmaster_link_status:up\r\n\r\n");
+  for (i = 0; i < 120; i++)
+    fprintf(fp, "%sfield_%03d:%d\r\n", i % 20 ? "" : "# Section\r\n", i, i);
+  fclose(fp);
+
+  len = asprintf(&reply, "$%zu\r\n%s\r\n", info_len, info);
+  if (len < 0)
+    xerror(1, errno, "asprintf() failed");
+
+  for (i = 0; i < n; i++) {
+    fields = 0;
+    measure_start();
+    offline_feed(reply, len);
+    if (redis_parse_info(offline, info_handler, &fields) < 0 || fields == 0)
+      xerror(1, 0, "redis_parse_info() failed");
+    measure_stop();
+    offline_drain();
+  }
+
+  free(reply);
+  free(info);
+}
+
+
+struct bench {
+  const char *name;
+  void (*run)(long n);
+  long iterations;
+};
+
+static struct bench benchmarks[] = {
+  { "format SET (printf)", bench_format, 1000000 },
+  { "format SET (argv)", bench_format_argv, 1000000 },
+  { "append+exec pipeline of 16", bench_exec, 100000 },
+  { "append+exec_flat pipeline of 16", bench_exec_flat, 100000 },
+  { "command array of 1000", bench_command_tree, 5000 },
+  { "command_flat array of 1000", bench_command_flat, 5000 },
+  { "command_raw array of 1000", bench_command_raw, 5000 },
+  { "command_parse array of 1000", bench_command_parse, 5000 },
+  { "parse array of 1000", bench_parse_array, 5000 },
+  { "free array of 1000", bench_free_array, 5000 },
+  { "free nested 10x10x10", bench_free_nested, 5000 },
+  { "reply_integer (integer)", bench_reply_integer_int, 10000000 },
+  { "reply_integer (string)", bench_reply_integer_str, 10000000 },
+  { "reply_integer (scientific)", bench_reply_integer_sci, 1000000 },
+  { "parse_info", bench_parse_info, 20000 },
+};
+
+
+static void
+usage(void)
+{
+  printf("usage: sredis-microbench [OPTION...]\n\n"
+         "  -s, --scale=N             multiply the iterations by N\n"
+         "  -f, --filter=STRING       run the benchmarks containing STRING\n");
+}
+
+
+int
+main(int argc, char *argv[])
+{
+  size_t i;
+  long n;
+
+  while (1) {
+    int opt = getopt_long(argc, argv, "s:f:H", long_opts, NULL);
+    if (opt == -1)
+      break;
+    switch (opt) {
+    case 's':
+      scale = atol(optarg);
+      break;
+    case 'f':
+      filter = optarg;
+      break;
+    case 'H':
+      usage();
+      return 0;
+    default:
+      usage();
+      return 1;
+    }
+  }
+  if (scale <= 0)
+    xerror(1, 0, "invalid argument(s); try --help");
+
+  offline = offline_open();
+
+  printf("%-32s %12s %12s %10s\n", "benchmark", "iterations", "ns/op",
+         "allocs/op");
+  for (i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++) {
+    if (filter && !strstr(benchmarks[i].name, filter))
+      continue;
+
+    n = benchmarks[i].iterations * scale;
+    measured_ns = measured_allocs = 0;
+    benchmarks[i].run(n);
+
+#ifdef HAVE_ALLOC_COUNT
+    printf("%-32s %12ld %12.1f %10.2f\n", benchmarks[i].name, n,
+           (double)measured_ns / n, (double)measured_allocs / n);
+#else
+    printf("%-32s %12ld %12.1f %10s\n", benchmarks[i].name, n,
+           (double)measured_ns / n, "-");
+#endif
+  }
+
+  redis_close(offline);
+  close(offline_peer);
+  return 0;
+}
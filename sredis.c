@@ -1,12 +1,17 @@
+#define _GNU_SOURCE     1       /* strcasestr(3) */
 #include <assert.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <ctype.h>
+#include <time.h>
 
 #include <errno.h>
 
 #include "sredis.h"
+#include "sredis_stats.h"
+#include "sredis_private.h"
 
 
 #ifndef FALSE
@@ -15,6 +20,12 @@
 #endif
 
 #define ERR_READONLY    "READONLY"
+#define ERR_NOPROTO     "NOPROTO"
+#define ERR_UNKNOWN     "ERR unknown command"
+
+#define REDIS_DEFAULT_USER      "default"
+
+#define SLOWLOG_HEAD_MAX        256     /* see redis_slowlog_head() */
 
 #define ENDPOINT_DELIMS " \t\v\n\r"
 #define REDIS_INFO_DELIMS       "\r\n"
@@ -25,21 +36,10 @@
 #define REDIS_INFO_MASTER_HOST  "master_host"
 #define REDIS_INFO_MASTER_PORT  "master_port"
 
-#define MARK_FAILED(rd)        do {      \
-    if ((rd)->chost >= 0)                \
-    (rd)->hosts[(rd)->chost]->failure++; \
-  } while (0)
-
-#define MARK_SUCCESS(rd)        do {     \
-    if ((rd)->chost >= 0)                \
-    (rd)->hosts[(rd)->chost]->success++; \
-  } while (0)
-
-#define N_FAILED(rd)    (((rd)->chost >= 0) ? \
-                         (rd)->hosts[(rd)->chost]->failure : 0)
+#define COUNT(rd, counter, n)   \
+  redis_stats_count((rd)->stats, (rd)->chost, REDIS_COUNTER_ ## counter, (n))
 
-#define N_SUCCEEDED(rd) (((rd)->chost >= 0) ? \
-                         (rd)->hosts[(rd)->chost]->success : 0)
+#define MARK_FAILED(rd)         COUNT(rd, CONNECT_FAILURES, 1)
 
 struct repldata {
   int master;
@@ -47,30 +47,25 @@ struct repldata {
   int port;
 };
 
-typedef int (*redis_info_handler)(REDIS *redis,
-                                  char *section,
-                                  char *field,
-                                  char *value,
-                                  void *data);
-
 static int redis_parse_version(REDIS *rd);
 
 static struct redis_hostent *redis_get_host(REDIS *rd, int index);
 static struct redis_hostent *redis_next_host(REDIS *rd);
-static redisReply *redis_vcommand(REDIS *redis, int reopen,
-                                  const char *format, va_list ap);
-static redisContext *redis_context(struct redis_hostent *endpoint,
-                                   const char *password);
+static redisContext *redis_context(REDIS *redis,
+                                   struct redis_hostent *endpoint);
 static struct redis_hostent *redis_get_hostent_create(REDIS *redis,
                                                       const char *host,
                                                       int port);
-static int redis_parse_info(REDIS *rd, redis_info_handler handler, void *data);
 
 //static int redis_get_info(REDIS *rd);
 static int redis_find_master(REDIS *redis, struct redis_hostent **ent);
 static int redis_find_master_24(REDIS *redis, struct redis_hostent **ent);
 static int redis_find_master_26(REDIS *redis, struct redis_hostent **ent);
 
+#ifdef _PTHREAD
+static void redis_lanes_clear(REDIS *redis);
+#endif
+
 
 static inline int
 REDIS_IS_HIGHER(REDIS *rd, short major, short minor)
@@ -187,7 +182,13 @@ redis_find_master_26(REDIS *redis, struct redis_hostent **ent)
     goto fin;
   }
 
-  if (reply->type != REDIS_REPLY_ARRAY || reply->elements < 2) {
+  /* In RESP3, CONFIG GET returns a map, which hiredis keeps flat as
+   * well; so reply->element[1] is the value in both cases. */
+  if ((reply->type != REDIS_REPLY_ARRAY
+#ifdef SREDIS_HAVE_RESP3
+       && reply->type != REDIS_REPLY_MAP
+#endif
+       ) || reply->elements < 2) {
     xdebug(0, "unexpected redis response type(%d), elms(%zd)",
            reply->type, reply->elements);
     goto fin;
@@ -300,15 +301,215 @@ redis_next_host(REDIS *rd)
 }
 
 
+#ifdef SREDIS_HAVE_RESP3
+static void
+redis_push_dispatch(REDIS *rd, redisReply *reply)
+{
+  if (rd && rd->push_handler)
+    rd->push_handler(rd, reply, rd->push_data);
+  else
+    redis_free(reply);
+}
+#endif  /* SREDIS_HAVE_RESP3 */
+
+
+#ifdef SREDIS_HAVE_PUSH_CB
+static void
+redis_push_callback(void *privdata, void *reply)
+{
+  redis_push_dispatch((REDIS *)privdata, (redisReply *)reply);
+}
+#endif  /* SREDIS_HAVE_PUSH_CB */
+
+
+/*
+ * Take the server version from the HELLO reply, so that
+ * redis_reopen_unlocked() does not need to send INFO again.
+ */
+static void
+redis_hello_version(REDIS *rd, redisReply *reply)
+{
+  redisReply *key, *value;
+  size_t i;
+
+  for (i = 0; i < redis_reply_pairs(reply); i++) {
+    key = redis_reply_key(reply, i);
+    value = redis_reply_value(reply, i);
+    if (!key || !value || !key->str || !value->str)
+      continue;
+
+    if (strcmp(key->str, "version") == 0) {
+      char buf[32];
+      char *dot;
+
+      snprintf(buf, sizeof(buf), "%s", value->str);
+      dot = strchr(buf, '.');
+      rd->ver_minor = dot ? atoi(dot + 1) : 0;
+      rd->ver_major = atoi(buf);
+      break;
+    }
+  }
+}
+
+
+/*
+ * Negotiate the protocol with HELLO.
+ *
+ * Returns 1 if HELLO succeeded, 0 if the server does not support it
+ * (the caller should fall back to RESP2), and -1 on failure.
+ */
+static int
+redis_hello(REDIS *rd, redisContext *ctx)
+{
+  const char *argv[7];
+  char proto[8];
+  int argc = 0;
+  redisReply *reply;
+  int ret;
+
+  snprintf(proto, sizeof(proto), "%d", rd->protocol);
+  argv[argc++] = "HELLO";
+  argv[argc++] = proto;
+  if (rd->password) {
+    argv[argc++] = "AUTH";
+    argv[argc++] = rd->username ? rd->username : REDIS_DEFAULT_USER;
+    argv[argc++] = rd->password;
+  }
+  if (rd->client_name) {
+    argv[argc++] = "SETNAME";
+    argv[argc++] = rd->client_name;
+  }
+
+  reply = redisCommandArgv(ctx, argc, argv, NULL);
+  if (!reply) {
+    xerror(0, 0, "HELLO failed: %s", ctx->errstr);
+    return -1;
+  }
+
+  if (reply->type == REDIS_REPLY_ERROR) {
+    if (strncmp(reply->str, ERR_NOPROTO, sizeof(ERR_NOPROTO) - 1) == 0 ||
+        strncasecmp(reply->str, ERR_UNKNOWN, sizeof(ERR_UNKNOWN) - 1) == 0) {
+      xdebug(0, "HELLO not supported (%s), falling back to RESP2",
+             reply->str);
+      ret = 0;
+    }
+    else {
+      xerror(0, 0, "authentication failed: %s", reply->str);
+      ret = -1;
+    }
+  }
+  else {
+    rd->resp = rd->protocol;
+    redis_hello_version(rd, reply);
+    ret = 1;
+  }
+
+  redis_free(reply);
+  return ret;
+}
+
+
+/*
+ * Authenticate and name the connection in the RESP2 way.
+ *
+ * Returns zero on success, -1 on failure.
+ */
+static int
+redis_auth_legacy(REDIS *rd, redisContext *ctx)
+{
+  redisReply *reply;
+
+  if (rd->password) {
+    reply = redisCommand(ctx, "AUTH %s", rd->password);
+
+    if (reply == NULL || reply->type != REDIS_REPLY_STATUS) {
+      if (!reply)
+        xerror(0, 0, "authentication failed: %s", ctx->errstr);
+      else if (reply->type == REDIS_REPLY_ERROR)
+        xerror(0, 0, "authentication failed: %s", reply->str);
+      else
+        xerror(0, 0, "authentication failed: type(%d)", reply->type);
+      redis_free(reply);
+      return -1;
+    }
+    redis_free(reply);
+  }
+
+  if (rd->client_name) {
+    reply = redisCommand(ctx, "CLIENT SETNAME %s", rd->client_name);
+    if (!reply) {
+      xerror(0, 0, "CLIENT SETNAME failed: %s", ctx->errstr);
+      return -1;
+    }
+    /* Not fatal; the connection is usable without the name. */
+    if (reply->type == REDIS_REPLY_ERROR)
+      xdebug(0, "CLIENT SETNAME failed: %s", reply->str);
+    redis_free(reply);
+  }
+  return 0;
+}
+
+
+/*
+ * If RD has a deadline (see redis_command_deadline()), store the time
+ * left in LEFT, or TIMEOUT if it is non-zero and shorter, and return
+ * TRUE.  Returns -1 if the deadline has passed, and FALSE if there is
+ * no deadline.  LEFT may be NULL.
+ */
+static int
+redis_deadline_left(const REDIS *rd, const struct timeval *timeout,
+                    struct timeval *left)
+{
+  unsigned long long now, ns;
+
+  if (!rd->deadline_ns)
+    return FALSE;
+
+  now = redis_clock_ns();
+  if (now >= rd->deadline_ns)
+    return -1;
+  ns = rd->deadline_ns - now;
+
+  if (!left)
+    ;
+  else if (timeout && (timeout->tv_sec != 0 || timeout->tv_usec != 0) &&
+      (unsigned long long)timeout->tv_sec * 1000000000ULL +
+      timeout->tv_usec * 1000ULL < ns)
+    *left = *timeout;
+  else {
+    left->tv_sec = ns / 1000000000ULL;
+    left->tv_usec = (ns % 1000000000ULL) / 1000;
+    if (left->tv_sec == 0 && left->tv_usec == 0)
+      left->tv_usec = 1;        /* zero means no timeout */
+  }
+  return TRUE;
+}
+
+
 static redisContext *
-redis_context(struct redis_hostent *ent, const char *password)
+redis_context(REDIS *rd, struct redis_hostent *ent)
 {
   redisContext *ctx;
+  struct timeval c_timeout = ent->c_timeout, o_timeout = ent->o_timeout;
+  int ret = 0;
 
-  if (ent->c_timeout.tv_sec == 0 && ent->c_timeout.tv_usec == 0)
+  rd->resp = 0;
+
+  /* Within a deadline, both timeouts are capped by the time left. */
+  switch (redis_deadline_left(rd, &ent->c_timeout, &c_timeout)) {
+  case -1:
+    xdebug(0, "deadline passed before connecting to %s:%d",
+           ent->host, ent->port);
+    return NULL;
+  case TRUE:
+    redis_deadline_left(rd, &ent->o_timeout, &o_timeout);
+    break;
+  }
+
+  if (c_timeout.tv_sec == 0 && c_timeout.tv_usec == 0)
     ctx = redisConnect(ent->host, ent->port);
   else
-    ctx = redisConnectWithTimeout(ent->host, ent->port, ent->c_timeout);
+    ctx = redisConnectWithTimeout(ent->host, ent->port, c_timeout);
 
   if (ctx == NULL || ctx->err) {
     if (ctx) {
@@ -319,32 +520,35 @@ redis_context(struct redis_hostent *ent, const char *password)
     }
     else
       xerror(0, 0, "connection error: can't allocate redis context");
+    return NULL;
   }
-  else {
-    if (ent->o_timeout.tv_sec != 0 || ent->o_timeout.tv_usec != 0)
-      redisSetTimeout(ctx, ent->o_timeout);
-
-    if (password) {
-      redisReply *reply = redisCommand(ctx, "AUTH %s", password);
-
-      if (reply == NULL || reply->type != REDIS_REPLY_STATUS) {
-        if (reply->type == REDIS_REPLY_ERROR)
-          xerror(0, 0, "authentication failed: %s", reply->str);
-        else
-          xerror(0, 0, "authentication failed: type(%d)", reply->type);
-        redis_free(reply);
-        redisFree(ctx);
-        ctx = NULL;
-      }
-      else
-        redis_free(reply);
-    }
+
+  if (o_timeout.tv_sec != 0 || o_timeout.tv_usec != 0)
+    redisSetTimeout(ctx, o_timeout);
+
+#ifdef SREDIS_HAVE_PUSH_CB
+  ctx->privdata = rd;
+  redisSetPushCallback(ctx, redis_push_callback);
+#endif
+
+  if (rd->protocol == 3)
+    ret = redis_hello(rd, ctx);
+
+  if (ret == 0) {
+    rd->resp = 2;
+    ret = (redis_auth_legacy(rd, ctx) == 0) ? 1 : -1;
+  }
+
+  if (ret < 0) {
+    rd->resp = 0;
+    redisFree(ctx);
+    ctx = NULL;
   }
   return ctx;
 }
 
 
-static int
+int
 redis_parse_info(REDIS *rd, redis_info_handler handler, void *data)
 {
   redisReply *reply;
@@ -356,11 +560,18 @@ redis_parse_info(REDIS *rd, redis_info_handler handler, void *data)
   assert(rd->ctx != NULL);
 
   reply = redis_command_fast(rd, "INFO");
-  if (!reply || reply->type != REDIS_REPLY_STRING) {
-    if (reply->type == REDIS_REPLY_ERROR)
+  if (!reply || (reply->type != REDIS_REPLY_STRING
+#ifdef SREDIS_HAVE_RESP3
+                 && reply->type != REDIS_REPLY_VERB
+#endif
+                 )) {
+    if (!reply)
+      xerror(0, 0, "can't connect to the server");
+    else if (reply->type == REDIS_REPLY_ERROR)
       xerror(0, 0, "can't connect to the server: %s", reply->str);
     else
       xerror(0, 0, "can't connect to the server: type(%d)", reply->type);
+    redis_free(reply);
     return -1;
   }
 
@@ -522,6 +733,9 @@ redis_reopen_unlocked(REDIS *rd)
    *   members in REDIS (e.g. ver_major and ver_minor) according to the
    *   new REDIS->CTX. */
   struct redis_hostent *ent;
+  struct redis_flat_build *flat = rd->flat;
+  struct redis_raw_read *raw = rd->raw;
+  unsigned long long start = redis_clock_ns();
   int i;
 
 #if 0
@@ -530,14 +744,29 @@ redis_reopen_unlocked(REDIS *rd)
   }
 #endif  /* 0 */
 
+  /* INFO and CONFIG GET below are not the user's commands, and their
+   * replies must not go into the user's flat or raw reply. */
+  rd->internal++;
+  rd->flat = NULL;
+  rd->raw = NULL;
+
   for (i = 0; i < REDIS_HOSTS_MAX; i++) {
+    if (redis_deadline_left(rd, NULL, NULL) < 0) {
+      /* The current connection, if any, may be in the middle of a
+       * reply, so it is not usable anymore. */
+      if (rd->ctx) {
+        redisFree(rd->ctx);
+        rd->ctx = NULL;
+      }
+      xdebug(0, "deadline passed while reconnecting");
+      break;
+    }
+
     rd->chost = (rd->chost + 1) % REDIS_HOSTS_MAX;
     ent = redis_get_host(rd, rd->chost);
     if (!ent)
       continue;
 
-    MARK_FAILED(rd);
-
     if (rd->ctx) {
       redisFree(rd->ctx);
       rd->ctx = NULL;
@@ -545,19 +774,21 @@ redis_reopen_unlocked(REDIS *rd)
 
     rd->ver_major = rd->ver_minor = 0;
 
-    rd->ctx = redis_context(ent, rd->password);
+    rd->ctx = redis_context(rd, ent);
     if (!rd->ctx) {
+      MARK_FAILED(rd);
       xdebug(0, "can't connect to the redis server");
       continue;
     }
     else {
-      if (redis_parse_version(rd) == -1) {
+      /* HELLO may already have told us the version. */
+      if (rd->ver_major == 0 && redis_parse_version(rd) == -1) {
+        MARK_FAILED(rd);
         redisFree(rd->ctx);
         rd->ctx = NULL;
         xdebug(0, "can't parse the redis version");
         continue;
       }
-      MARK_SUCCESS(rd);
     }
 
     if (redis_find_master(rd, &ent) == -1) {
@@ -568,16 +799,18 @@ redis_reopen_unlocked(REDIS *rd)
     if (ent != NULL) {            /* ENT could be the new master */
       rd->ver_major = rd->ver_minor = 0;
       redisFree(rd->ctx);
-      rd->ctx = redis_context(ent, rd->password);
+      rd->ctx = redis_context(rd, ent);
       /* Note that if redis is mis-configured for the master, so that
        * if we can't connect to it, above call may fail */
 
       if (!rd->ctx) {
+        MARK_FAILED(rd);
         xerror(0, 0, "can't connect to the master (%s:%d)",
                ent->host, ent->port);
       }
       else {
-        if (redis_parse_version(rd) == -1) {
+        if (rd->ver_major == 0 && redis_parse_version(rd) == -1) {
+          MARK_FAILED(rd);
           redisFree(rd->ctx);
           rd->ctx = NULL;
           xdebug(0, "can't parse the redis version");
@@ -591,10 +824,17 @@ redis_reopen_unlocked(REDIS *rd)
       break;                    /* this is the master! */
   }
 
+  rd->flat = flat;
+  rd->raw = raw;
+  rd->internal--;
+  rd->reopen_ns += redis_clock_ns() - start;
+
   if (!rd->ctx) {
     xdebug(0, "tried all registered redis endpoints, none works.");
     return -1;
   }
+
+  redis_stats_connected(rd->stats, rd->chost, rd->connects++ > 0);
   return 0;
 }
 
@@ -665,9 +905,16 @@ redis_close(REDIS *rd)
 
 #ifdef _PTHREAD
   pthread_mutex_destroy(&rd->mutex);
+  pthread_mutex_destroy(&rd->lane_mutex);
+  pthread_mutex_destroy(&rd->flight_mutex);
 #endif
 
+  if (!rd->stats_shared)
+    redis_stats_free(rd->stats);
+
   free(rd->password);
+  free(rd->username);
+  free(rd->client_name);
   free(rd);
 }
 
@@ -692,8 +939,6 @@ redis_host_add(REDIS *redis, const char *host, int port,
         return -1;
       }
 
-      p->success = p->failure = 0;
-
       p->host = strdup(host);
       if (!p->host) {
         free(p);
@@ -717,6 +962,9 @@ redis_host_add(REDIS *redis, const char *host, int port,
       }
       redis->hosts[i] = p;
       redis_unlock(redis);
+#ifdef _PTHREAD
+      redis_lanes_clear(redis);
+#endif
       return i;
     }
   }
@@ -775,6 +1023,9 @@ redis_host_del(REDIS *redis, int index)
     free(redis->hosts[index]);
     redis->hosts[index] = NULL;
     redis_unlock(redis);
+#ifdef _PTHREAD
+    redis_lanes_clear(redis);
+#endif
     return 0;
   }
   redis_unlock(redis);
@@ -803,6 +1054,37 @@ redis_new(void)
   p->ver_minor = 0;
 
   p->password = NULL;
+  p->username = NULL;
+  p->client_name = NULL;
+
+  p->protocol = 2;
+  p->resp = 0;
+
+  p->push_handler = NULL;
+  p->push_data = NULL;
+
+  p->multi_pos = 0;
+
+  p->stats = redis_stats_new();
+  if (!p->stats) {
+    free(p);
+    return NULL;
+  }
+  p->stats_shared = FALSE;
+  p->lock_ns = 0;
+  p->reopen_ns = 0;
+  p->deadline_ns = 0;
+  p->connects = 0;
+  p->internal = 0;
+  p->flat = NULL;
+  p->raw = NULL;
+
+  p->waiters = 0;
+  p->waiters_peak = 0;
+  p->waiters_max = 0;
+
+  p->hooks = NULL;
+  p->parent = NULL;
 
 #ifdef _PTHREAD
   {
@@ -813,6 +1095,7 @@ redis_new(void)
     if (err) {
       xdebug(err, "pthread_mutexattr_settype() failed");
       pthread_mutexattr_destroy(&attr);
+      redis_stats_free(p->stats);
       free(p);
       return NULL;
     }
@@ -821,11 +1104,37 @@ redis_new(void)
     if (err) {
       xdebug(err, "pthread_mutex_init() failed");
       pthread_mutexattr_destroy(&attr);
+      redis_stats_free(p->stats);
       free(p);
       return NULL;
     }
 
     pthread_mutexattr_destroy(&attr);
+
+    err = pthread_mutex_init(&p->lane_mutex, NULL);
+    if (err) {
+      xdebug(err, "pthread_mutex_init() failed");
+      pthread_mutex_destroy(&p->mutex);
+      redis_stats_free(p->stats);
+      free(p);
+      return NULL;
+    }
+    p->lanes_idle = 0;
+    p->lanes_max = REDIS_LANES_DEFAULT;
+    p->lane_timeout.tv_sec = p->lane_timeout.tv_usec = 0;
+    p->lanes_gen = p->lane_gen = 0;
+
+    err = pthread_mutex_init(&p->flight_mutex, NULL);
+    if (err) {
+      xdebug(err, "pthread_mutex_init() failed");
+      pthread_mutex_destroy(&p->lane_mutex);
+      pthread_mutex_destroy(&p->mutex);
+      redis_stats_free(p->stats);
+      free(p);
+      return NULL;
+    }
+    p->flights = NULL;
+    p->coalesce = FALSE;
   }
 #endif  /* _PTHREAD */
 
@@ -846,6 +1155,144 @@ redis_set_password(REDIS *redis, const char *password)
 }
 
 
+REDIS *
+redis_dup(REDIS *redis)
+{
+  REDIS *p;
+  struct redis_hostent *ent;
+  int i;
+
+  p = redis_new();
+  if (!p)
+    return NULL;
+
+  redis_lock(redis);
+
+  for (i = 0; i < REDIS_HOSTS_MAX; i++) {
+    ent = redis->hosts[i];
+    if (!ent)
+      continue;
+
+    p->hosts[i] = malloc(sizeof(*ent));
+    if (!p->hosts[i])
+      goto err;
+    memcpy(p->hosts[i], ent, sizeof(*ent));
+    p->hosts[i]->host = strdup(ent->host);
+    if (!p->hosts[i]->host) {
+      free(p->hosts[i]);
+      p->hosts[i] = NULL;
+      goto err;
+    }
+  }
+
+  /* redis_reopen_unlocked() starts from the next one of 'chost', so
+   * that the new connection goes to the current master first. */
+  p->chost = (redis->chost < 0) ? -1 : redis->chost - 1;
+
+  if ((redis->password && !(p->password = strdup(redis->password))) ||
+      (redis->username && !(p->username = strdup(redis->username))) ||
+      (redis->client_name &&
+       !(p->client_name = strdup(redis->client_name))))
+    goto err;
+
+  p->protocol = redis->protocol;
+
+  redis_unlock(redis);
+  return p;
+
+ err:
+  redis_unlock(redis);
+  xerror(0, errno, "can't duplicate REDIS");
+  redis_close(p);
+  return NULL;
+}
+
+
+void
+redis_set_username(REDIS *redis, const char *username)
+{
+  free(redis->username);
+
+  if (username)
+    redis->username = strdup(username);
+  else
+    redis->username = 0;
+}
+
+
+void
+redis_set_client_name(REDIS *redis, const char *name)
+{
+  free(redis->client_name);
+
+  if (name)
+    redis->client_name = strdup(name);
+  else
+    redis->client_name = 0;
+}
+
+
+int
+redis_set_protocol(REDIS *redis, int protocol)
+{
+#ifdef SREDIS_HAVE_RESP3
+  if (protocol != 2 && protocol != 3) {
+#else
+  if (protocol != 2) {
+#endif
+    errno = EINVAL;
+    return -1;
+  }
+
+  redis_lock(redis);
+  redis->protocol = protocol;
+  redis_unlock(redis);
+  return 0;
+}
+
+
+int
+redis_protocol(REDIS *redis)
+{
+  int ret;
+
+  redis_lock(redis);
+  ret = redis->ctx ? redis->resp : 0;
+  redis_unlock(redis);
+  return ret;
+}
+
+
+void
+redis_set_hooks(REDIS *redis, const struct redis_hooks *hooks)
+{
+  redis_lock(redis);
+#ifdef _PTHREAD
+  pthread_mutex_lock(&redis->lane_mutex);
+#endif
+  if (hooks) {
+    redis->hooks_set = *hooks;
+    redis->hooks = &redis->hooks_set;
+  }
+  else
+    redis->hooks = NULL;
+#ifdef _PTHREAD
+  pthread_mutex_unlock(&redis->lane_mutex);
+#endif
+  redis_unlock(redis);
+}
+
+
+void
+redis_set_push_handler(REDIS *redis, redis_push_handler handler, void *data)
+{
+  redis_lock(redis);
+  redis->push_handler = handler;
+  redis->push_data = data;
+  redis_unlock(redis);
+}
+
+
 REDIS *
 redis_open(const char *host, int port, const struct timeval *c_timeout,
            const struct timeval *o_timeout)
@@ -874,24 +1321,344 @@ redis_open(const char *host, int port, const struct timeval *c_timeout,
 }
 
 
-static redisReply *
-redis_vcommand_unlocked(REDIS *redis, int reopen,
-                        const char *format, va_list ap)
+/*
+ * Return nonzero if the last I/O error of CTX was a socket timeout.
+ * Should be called right after the error, since it looks at errno.
+ */
+static int
+redis_is_timeout(const redisContext *ctx)
 {
-  redisReply *reply = NULL;
-
-  assert(redis->stacked == 0);
+#ifdef REDIS_ERR_TIMEOUT
+  if (ctx->err == REDIS_ERR_TIMEOUT)
+    return TRUE;
+#endif
+  return ctx->err == REDIS_ERR_IO &&
+    (errno == EAGAIN || errno == EWOULDBLOCK || errno == ETIMEDOUT);
+}
 
-#if 0
-  if (redis->chost < 0) {
-    xdebug(0, "redis was not configured, no server endpoint");
-    return NULL;
-  }
-#endif  /* 0 */
 
-  if (!redis->ctx) {
+/*
+ * Cap the socket timeout of REDIS->ctx by the time left before the
+ * deadline.  Returns -1 if the deadline has passed.
+ */
+static int
+redis_deadline_timeout(REDIS *redis)
+{
+  struct redis_hostent *ent = NULL;
+  struct timeval left;
+
+  if (redis->chost >= 0)
+    ent = redis->hosts[redis->chost];
+  if (redis_deadline_left(redis, ent ? &ent->o_timeout : NULL, &left) < 0)
+    return -1;
+  redisSetTimeout(redis->ctx, left);
+  return 0;
+}
+
+
+/*
+ * Start the deadline TIMEOUT from now for REDIS, which should be
+ * locked (or be a lane owned by the caller).  If REDIS already has an
+ * earlier deadline (a nested call), it is kept.  Returns the previous
+ * deadline, to be passed to redis_deadline_end().
+ */
+static unsigned long long
+redis_deadline_begin(REDIS *redis, unsigned long long deadline)
+{
+  unsigned long long saved = redis->deadline_ns;
+
+  if (!saved || deadline < saved)
+    redis->deadline_ns = deadline;
+  return saved;
+}
+
+
+static void
+redis_deadline_end(REDIS *redis, unsigned long long saved)
+{
+  struct redis_hostent *ent = NULL;
+  struct timeval none = { 0, 0 };
+
+  redis->deadline_ns = saved;
+  if (saved || !redis->ctx)
+    return;
+
+  /* restore the operation timeout of the host */
+  if (redis->chost >= 0)
+    ent = redis->hosts[redis->chost];
+  redisSetTimeout(redis->ctx, ent ? ent->o_timeout : none);
+}
+
+
+/* what redis_get_reply() measured */
+struct redis_call {
+  unsigned long long phase[REDIS_PHASE_MAX];
+  size_t bytes_out;
+  size_t bytes_in;
+  int timeout;
+};
+
+
+/*
+ * Detach the flat reply builder from the reader of REDIS after a read.
+ * If a reply is left half-read, the reader still refers to the
+ * builder, so the connection is dropped now.
+ */
+static void
+redis_flat_read_end(REDIS *redis)
+{
+  if (redis_flat_detach(redis->flat, redis->ctx->reader) != 0) {
+    xdebug(0, "dropping the connection with a half-read flat reply");
+    redisFree(redis->ctx);
+    redis->ctx = NULL;
+  }
+}
+
+
+/*
+ * Like redisGetReply(): send the output buffer of REDIS->ctx, then
+ * read one reply.  The time of each phase and the bytes are added to
+ * CALL.
+ *
+ * If REDIS->flat is set, the reply is read into it (see
+ * redis_command_flat()), and *REPLY is a stand-in for its top level.
+ * Likewise for REDIS->raw (see redis_command_raw() and
+ * redis_command_parse()).
+ */
+static int
+redis_get_reply(REDIS *redis, redisReply **reply, struct redis_call *call)
+{
+  redisContext *ctx = redis->ctx;
+  unsigned long long *phase = call->phase;
+  unsigned long long start, first = 0;
+  void *aux = NULL;
+  size_t len;
+  int done, counted = !redis->internal;
+
+  len = sdslen(ctx->obuf);
+  call->bytes_out += len;
+  if (counted)
+    COUNT(redis, BYTES_OUT, len);
+
+  if (redis->flat)
+    redis_flat_attach(redis->flat, ctx->reader);
+
+  start = redis_clock_ns();
+  do {
+    if (redis->deadline_ns && redis_deadline_timeout(redis) != 0)
+      goto deadline;
+    if (redisBufferWrite(ctx, &done) == REDIS_ERR)
+      goto err;
+  } while (!done);
+  phase[REDIS_PHASE_WRITE] += redis_clock_ns() - start;
+
+  start = redis_clock_ns();
+  while (1) {
+    if (redis->raw) {
+      if (redis_raw_get(redis->raw, ctx, &aux) == REDIS_ERR)
+        goto fail;
+    }
+    else if (redisGetReplyFromReader(ctx, &aux) == REDIS_ERR)
+      goto fail;
+    if (aux) {
+#ifdef SREDIS_HAVE_RESP3
+      if (((redisReply *)aux)->type == REDIS_REPLY_PUSH) {
+        redis_push_dispatch(redis, aux);
+        aux = NULL;
+        continue;
+      }
+#endif
+      break;
+    }
+    len = ctx->reader->len;
+    if (redis->deadline_ns && redis_deadline_timeout(redis) != 0)
+      goto deadline;
+    if (redisBufferRead(ctx) == REDIS_ERR)
+      goto err;
+    len = ctx->reader->len - len;
+    call->bytes_in += len;
+    if (counted)
+      COUNT(redis, BYTES_IN, len);
+    if (!first) {
+      first = redis_clock_ns();
+      phase[REDIS_PHASE_WAIT] += first - start;
+    }
+  }
+  phase[REDIS_PHASE_PARSE] += redis_clock_ns() - (first ? first : start);
+
+  if (redis->flat)
+    redis_flat_read_end(redis);
+  *reply = aux;
+  return REDIS_OK;
+
+ err:
+  if (redis_is_timeout(ctx)) {
+    call->timeout = TRUE;
+    if (counted)
+      COUNT(redis, TIMEOUTS, 1);
+  }
+  goto fail;
+
+ deadline:
+  xdebug(0, "deadline passed while waiting for the reply");
+  call->timeout = TRUE;
+  if (counted)
+    COUNT(redis, TIMEOUTS, 1);
+
+ fail:
+  if (redis->flat)
+    redis_flat_read_end(redis);
+  return REDIS_ERR;
+}
+
+
+/*
+ * Call the before hook of REDIS.  If KEY is non-null, the first
+ * argument of the command in BUF is copied into it.
+ */
+static void
+redis_hook_before(REDIS *redis, struct redis_call_info *info,
+                  const char *buf, char *key, const char *command,
+                  size_t commands)
+{
+  ssize_t len;
+
+  memset(info, 0, sizeof(*info));
+  info->command = command;
+  info->commands = commands;
+
+  if (key && commands == 1) {
+    len = redis_stats_arg(buf, 1, key, REDIS_HOOK_KEY_MAX);
+    if (len >= 0) {
+      info->key = key;
+      info->key_len = len;
+    }
+  }
+
+  if (redis->chost >= 0 && redis->hosts[redis->chost]) {
+    info->host = redis->hosts[redis->chost]->host;
+    info->port = redis->hosts[redis->chost]->port;
+  }
+
+  if (redis->hooks->before)
+    redis->hooks->before(redis->parent ? redis->parent : redis, info,
+                         redis->hooks->data);
+}
+
+
+static void
+redis_hook_after(REDIS *redis, struct redis_call_info *info,
+                 const struct redis_call *call, const redisReply *reply,
+                 int outcome)
+{
+  info->bytes_out = call->bytes_out;
+  info->bytes_in = call->bytes_in;
+  info->lock_ns = call->phase[REDIS_PHASE_LOCK];
+  info->duration_ns = call->phase[REDIS_PHASE_WRITE] +
+    call->phase[REDIS_PHASE_WAIT] + call->phase[REDIS_PHASE_PARSE];
+  info->outcome = outcome;
+  info->reply = reply;
+
+  if (redis->hooks->after)
+    redis->hooks->after(redis->parent ? redis->parent : redis, info,
+                        redis->hooks->data);
+}
+
+
+/*
+ * Copy the beginning of the output buffer into HEAD if the slow log
+ * is on, since it is gone once sent.  Returns the number of bytes
+ * copied.
+ */
+static size_t
+redis_slowlog_head(REDIS *redis, char *head)
+{
+  size_t len;
+
+  if (!redis_stats_slowlog_on(redis->stats))
+    return 0;
+
+  len = sdslen(redis->ctx->obuf);
+  if (len > SLOWLOG_HEAD_MAX)
+    len = SLOWLOG_HEAD_MAX;
+  memcpy(head, redis->ctx->obuf, len);
+  return len;
+}
+
+
+/*
+ * Call the hooks of REDIS for the command in FORMAT, which was not sent
+ * since no connection could be made.
+ */
+static void
+redis_hook_unconnected(REDIS *redis, const char *format, va_list ap)
+{
+  struct redis_call call;
+  struct redis_call_info info;
+  char name[32];
+  char key[REDIS_HOOK_KEY_MAX];
+  char *cmd = NULL;
+
+  memset(&call, 0, sizeof(call));
+  name[0] = '\0';
+  if (redisvFormatCommand(&cmd, format, ap) < 0)
+    cmd = NULL;
+  else
+    redis_stats_name(cmd, name, sizeof(name));
+  if (!name[0])
+    strcpy(name, "(unknown)");
+
+  redis_hook_before(redis, &info, cmd, cmd ? key : NULL, name, 1);
+  redis_hook_after(redis, &info, &call, NULL, REDIS_OUTCOME_UNCONNECTED);
+  if (cmd)
+    redisFreeCommand(cmd);
+}
+
+
+static int
+redis_outcome(const struct redis_call *call, const redisReply *reply)
+{
+  if (!reply)
+    return call->timeout ? REDIS_OUTCOME_TIMEOUT : REDIS_OUTCOME_FAILED;
+  if (reply->type == REDIS_REPLY_ERROR)
+    return REDIS_OUTCOME_ERROR;
+  return REDIS_OUTCOME_OK;
+}
+
+
+static redisReply *
+redis_vcommand_unlocked(REDIS *redis, int reopen,
+                        const char *format, va_list ap)
+{
+  redisReply *reply = NULL;
+  struct redis_call call;
+  struct redis_call_info info;
+  struct redis_hostent *ent = NULL;
+  char name[32];
+  char key[REDIS_HOOK_KEY_MAX];
+  char head[SLOWLOG_HEAD_MAX];
+  size_t head_len = 0;
+  int internal = redis->internal;
+
+  assert(redis->stacked == 0);
+
+  memset(&call, 0, sizeof(call));
+  call.phase[REDIS_PHASE_LOCK] = redis->lock_ns;
+  redis->lock_ns = 0;
+  redis->reopen_ns = 0;
+
+#if 0
+  if (redis->chost < 0) {
+    xdebug(0, "redis was not configured, no server endpoint");
+    return NULL;
+  }
+#endif  /* 0 */
+
+  if (!redis->ctx) {
     if (reopen && redis_reopen_unlocked(redis) != 0) {
       xdebug(0, "redis re-connection failed");
+      if (redis->hooks && !internal)
+        redis_hook_unconnected(redis, format, ap);
       return NULL;
     }
     else
@@ -901,8 +1668,34 @@ redis_vcommand_unlocked(REDIS *redis, int reopen,
   if (redis->ctx) {
     /* We need double check for redis->ctx since
      * wrong master configuration may causes redis_reopen() failed.*/
-    reply = redisvCommand(redis->ctx, format, ap);
+    if (redisvAppendCommand(redis->ctx, format, ap) == REDIS_OK) {
+      int host = redis->chost;
+
+      redis_stats_name(redis->ctx->obuf, name, sizeof(name));
+      if (!name[0])
+        strcpy(name, "(unknown)");
+      if (!internal) {
+        COUNT(redis, COMMANDS, 1);
+        head_len = redis_slowlog_head(redis, head);
+      }
+      if (host >= 0)
+        ent = redis->hosts[host];
+
+      if (redis->hooks && !internal)
+        redis_hook_before(redis, &info, redis->ctx->obuf, key, name, 1);
+
+      if (redis_get_reply(redis, &reply, &call) != REDIS_OK)
+        reply = NULL;
+      if (!internal)
+        redis_stats_record(redis->stats, name, host, call.phase);
+
+      if (redis->hooks && !internal)
+        redis_hook_after(redis, &info, &call, reply,
+                         redis_outcome(&call, reply));
+    }
   }
+  else if (redis->hooks && !internal)
+    redis_hook_unconnected(redis, format, ap);
 
   if (!reply) {
     xdebug(0, "redis null reply");
@@ -911,34 +1704,741 @@ redis_vcommand_unlocked(REDIS *redis, int reopen,
     else
       xdebug(0, "redis re-connected");
   }
-  else if (reply->type == REDIS_REPLY_ERROR) {
-    xdebug(0, "redis error: %s", reply->str);
-    if (reply->str != 0 && strncasecmp(ERR_READONLY,
-                                       reply->str,
-                                       sizeof(ERR_READONLY) - 1) == 0) {
-      /* Strange, currently connected to the master, but it is
-       * actually a slave.   It seems that hiredis didn't give
-       * a detailed error but a error string. */
-      xdebug(0, "volunterily disconnect from the possible slave");
-      if (redis_reopen_unlocked(redis) != 0)
-        xdebug(0, "redis re-connection failed");
-      else
-        xdebug(0, "redis re-connected");
-    }
+  else if (reply->type == REDIS_REPLY_ERROR) {
+    xdebug(0, "redis error: %s", reply->str);
+    if (!internal)
+      COUNT(redis, ERRORS, 1);
+    if (reply->str != 0 && strncasecmp(ERR_READONLY,
+                                       reply->str,
+                                       sizeof(ERR_READONLY) - 1) == 0) {
+      COUNT(redis, READONLY, 1);
+      /* Strange, currently connected to the master, but it is
+       * actually a slave.   It seems that hiredis didn't give
+       * a detailed error but a error string. */
+      xdebug(0, "volunterily disconnect from the possible slave");
+      if (redis_reopen_unlocked(redis) != 0)
+        xdebug(0, "redis re-connection failed");
+      else
+        xdebug(0, "redis re-connected");
+    }
+  }
+
+  if (head_len)
+    redis_stats_slowlog(redis->stats, head, head_len, 1, ent, call.phase,
+                        redis->reopen_ns);
+  return reply;
+}
+
+
+#ifdef _PTHREAD
+static const char *blocking_commands[] = {
+  "BLPOP", "BRPOP", "BRPOPLPUSH", "BLMOVE", "BLMPOP",
+  "BZPOPMIN", "BZPOPMAX", "BZMPOP",
+  NULL,
+};
+
+
+/*
+ * Copy the command name in FORMAT into NAME of SIZE bytes.  The name
+ * is taken from the literal format string, or from the first argument
+ * if the format starts with "%s".
+ *
+ * Returns zero on success, -1 if the name is unknown or too long.
+ */
+static int
+redis_command_name(const char *format, va_list ap, char *name, size_t size)
+{
+  const char *p;
+  size_t len;
+
+  p = format + strspn(format, " ");
+  if (strncmp(p, "%s", 2) == 0 && (p[2] == ' ' || p[2] == '\0')) {
+    va_list aq;
+
+    va_copy(aq, ap);
+    p = va_arg(aq, const char *);
+    va_end(aq);
+    if (!p)
+      return -1;
+  }
+
+  len = strcspn(p, " ");
+  if (len == 0 || len >= size || memchr(p, '%', len))
+    return -1;
+  memcpy(name, p, len);
+  name[len] = '\0';
+  return 0;
+}
+
+
+/*
+ * Return nonzero if the command in FORMAT may block the connection.
+ */
+static int
+redis_is_blocking(const char *format, va_list ap)
+{
+  char name[16];
+  const char *p;
+  int i;
+
+  if (redis_command_name(format, ap, name, sizeof(name)) != 0)
+    return FALSE;
+
+  if (toupper((unsigned char)name[0]) != 'B' &&
+      toupper((unsigned char)name[0]) != 'W' &&
+      toupper((unsigned char)name[0]) != 'X')
+    return FALSE;               /* fast path for the most commands */
+
+  for (i = 0; blocking_commands[i]; i++) {
+    if (strcasecmp(name, blocking_commands[i]) == 0)
+      return TRUE;
+  }
+
+  if (strcasecmp(name, "XREAD") == 0 || strcasecmp(name, "XREADGROUP") == 0) {
+    /* blocks only with the BLOCK option */
+    for (p = format; (p = strcasestr(p, "BLOCK")) != NULL; p += 5) {
+      if ((p == format || p[-1] == ' ') && (p[5] == ' ' || p[5] == '\0'))
+        return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+
+static void
+redis_lane_timeout(REDIS *lane, const struct timeval *timeout)
+{
+  int i;
+
+  for (i = 0; i < REDIS_HOSTS_MAX; i++) {
+    if (lane->hosts[i])
+      lane->hosts[i]->o_timeout = *timeout;
+  }
+}
+
+
+/*
+ * Take an idle lane of REDIS, or make a new one.  If the lanes have
+ * been turned off since the caller looked, *OFF is set to TRUE and
+ * NULL is returned.
+ */
+static REDIS *
+redis_lane_get(REDIS *redis, int *off)
+{
+  REDIS *lane = NULL;
+  struct timeval timeout;
+  unsigned gen;
+
+  pthread_mutex_lock(&redis->lane_mutex);
+  *off = redis->lanes_max == 0;
+  if (redis->lanes_idle > 0)
+    lane = redis->lanes[--redis->lanes_idle];
+  timeout = redis->lane_timeout;
+  gen = redis->lanes_gen;
+  pthread_mutex_unlock(&redis->lane_mutex);
+
+  if (*off)
+    return NULL;
+
+  if (!lane) {
+    /* GEN is taken before the endpoints are copied, so a lane that
+     * may have missed a change is never pooled. */
+    lane = redis_dup(redis);
+    if (!lane)
+      return NULL;
+
+    lane->lanes_max = 0;        /* no lane of a lane */
+    redis_stats_free(lane->stats);
+    lane->stats = redis->stats;
+    lane->stats_shared = TRUE;
+    lane->parent = redis;
+    lane->lane_gen = gen;
+    redis_lane_timeout(lane, &timeout);
+    xdebug(0, "new lane for blocking commands");
+  }
+
+  /* The hooks may have been changed since the lane was created. */
+  pthread_mutex_lock(&redis->lane_mutex);
+  lane->hooks_set = redis->hooks_set;
+  lane->hooks = redis->hooks ? &lane->hooks_set : NULL;
+  pthread_mutex_unlock(&redis->lane_mutex);
+  return lane;
+}
+
+
+/*
+ * Return LANE to the idle lanes of REDIS, or close it if there is no
+ * room, or if the endpoints have changed since it was created.
+ */
+static void
+redis_lane_put(REDIS *redis, REDIS *lane)
+{
+  pthread_mutex_lock(&redis->lane_mutex);
+  if (lane->lane_gen == redis->lanes_gen
+      && redis->lanes_idle < redis->lanes_max) {
+    redis->lanes[redis->lanes_idle++] = lane;
+    lane = NULL;
+  }
+  pthread_mutex_unlock(&redis->lane_mutex);
+
+  if (lane)
+    redis_close(lane);
+}
+
+
+/*
+ * Close every idle lane.  Called whenever the endpoints are changed,
+ * since the lanes have their own copy of them.  The lanes in use are
+ * closed by redis_lane_put().
+ */
+static void
+redis_lanes_clear(REDIS *redis)
+{
+  REDIS *lanes[REDIS_LANES_MAX];
+  int i, n;
+
+  pthread_mutex_lock(&redis->lane_mutex);
+  n = redis->lanes_idle;
+  memcpy(lanes, redis->lanes, sizeof(REDIS *) * n);
+  redis->lanes_idle = 0;
+  redis->lanes_gen++;
+  pthread_mutex_unlock(&redis->lane_mutex);
+
+  for (i = 0; i < n; i++)
+    redis_close(lanes[i]);
+}
+
+
+/*
+ * Send a blocking command on a lane of REDIS.  *OFF is set to TRUE if
+ * nothing was sent because the lanes are turned off.
+ */
+static redisReply *
+redis_vcommand_lane(REDIS *redis, int reopen, unsigned long long deadline,
+                    const char *format, va_list ap, int *off)
+{
+  redisReply *reply;
+  REDIS *lane;
+  unsigned long long saved = 0;
+  int timedout = FALSE;
+
+  unsigned long long start = redis_clock_ns();
+
+  lane = redis_lane_get(redis, off);
+  if (!lane)
+    return NULL;
+  lane->lock_ns = redis_clock_ns() - start;
+
+  /* The lane is owned by this thread until redis_lane_put(). */
+  if (deadline)
+    saved = redis_deadline_begin(lane, deadline);
+  reply = redis_vcommand_unlocked(lane, reopen, format, ap);
+  if (deadline) {
+    timedout = !reply && redis_deadline_left(lane, NULL, NULL) < 0;
+    redis_deadline_end(lane, saved);
+  }
+
+  redis_lane_put(redis, lane);
+  if (timedout)
+    errno = ETIMEDOUT;
+  return reply;
+}
+
+
+int
+redis_set_blocking_lanes(REDIS *redis, int max, const struct timeval *timeout)
+{
+  if (max < 0 || max > REDIS_LANES_MAX) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  redis_lanes_clear(redis);
+
+  pthread_mutex_lock(&redis->lane_mutex);
+  redis->lanes_max = max;
+  if (timeout)
+    redis->lane_timeout = *timeout;
+  else
+    redis->lane_timeout.tv_sec = redis->lane_timeout.tv_usec = 0;
+  pthread_mutex_unlock(&redis->lane_mutex);
+  return 0;
+}
+#endif  /* _PTHREAD */
+
+
+#ifdef _PTHREAD
+/*
+ * Convert DEADLINE into ABSTIME in CLOCK_REALTIME, which
+ * pthread_mutex_timedlock() and pthread_cond_timedwait() take.
+ * Returns zero on success, or ETIMEDOUT if DEADLINE has passed.
+ */
+static int
+redis_abstime(unsigned long long deadline, struct timespec *abstime)
+{
+  unsigned long long now, ns;
+
+  now = redis_clock_ns();
+  if (now >= deadline)
+    return ETIMEDOUT;
+  ns = deadline - now;
+
+  clock_gettime(CLOCK_REALTIME, abstime);
+  abstime->tv_sec += ns / 1000000000ULL;
+  abstime->tv_nsec += ns % 1000000000ULL;
+  if (abstime->tv_nsec >= 1000000000L) {
+    abstime->tv_sec++;
+    abstime->tv_nsec -= 1000000000L;
+  }
+  return 0;
+}
+#endif  /* _PTHREAD */
+
+
+/*
+ * Lock REDIS, waiting until DEADLINE at most (forever if zero).
+ * Returns zero on success, or ETIMEDOUT.
+ */
+static int
+redis_lock_deadline(REDIS *redis, unsigned long long deadline)
+{
+#ifdef _PTHREAD
+  struct timespec abstime;
+  int ret;
+
+  if (!deadline) {
+    redis_lock(redis);
+    return 0;
+  }
+
+  if (pthread_mutex_trylock(&redis->mutex) == 0)
+    return 0;
+
+  if (redis_abstime(deadline, &abstime) != 0)
+    return ETIMEDOUT;
+
+  ret = pthread_mutex_timedlock(&redis->mutex, &abstime);
+  if (ret && ret != ETIMEDOUT)
+    xdebug(ret, "pthread_mutex_timedlock() failed");
+  return ret ? ETIMEDOUT : 0;
+#else
+  (void)deadline;
+  return 0;
+#endif  /* _PTHREAD */
+}
+
+
+/*
+ * Lock REDIS for a command.  If TRY is nonzero, do not wait at all.
+ * Otherwise, wait until DEADLINE (see redis_lock_deadline()), unless
+ * too many threads are waiting already (see redis_set_max_waiters()).
+ *
+ * Returns zero on success, EBUSY if rejected, or ETIMEDOUT.
+ */
+static int
+redis_admit(REDIS *redis, int try, unsigned long long deadline)
+{
+#ifdef _PTHREAD
+  int waiters, peak, ret;
+
+  if (pthread_mutex_trylock(&redis->mutex) == 0)
+    return 0;
+
+  if (try) {
+    COUNT(redis, REJECTED, 1);
+    return EBUSY;
+  }
+
+  waiters = __sync_add_and_fetch(&redis->waiters, 1);
+  if (redis->waiters_max > 0 && waiters > redis->waiters_max) {
+    __sync_sub_and_fetch(&redis->waiters, 1);
+    COUNT(redis, REJECTED, 1);
+    return EBUSY;
+  }
+  while ((peak = redis->waiters_peak) < waiters &&
+         !__sync_bool_compare_and_swap(&redis->waiters_peak, peak, waiters))
+    ;
+
+  ret = redis_lock_deadline(redis, deadline);
+  __sync_sub_and_fetch(&redis->waiters, 1);
+  return ret;
+#else
+  (void)try;
+  (void)deadline;
+  return 0;
+#endif  /* _PTHREAD */
+}
+
+
+int
+redis_set_max_waiters(REDIS *redis, int max)
+{
+  if (max < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  redis->waiters_max = max;
+  return 0;
+}
+
+
+/*
+ * Report the failure RET of redis_admit(), and set errno.
+ */
+static void
+redis_admit_failed(REDIS *redis, int ret)
+{
+  if (ret == ETIMEDOUT) {
+    xdebug(0, "deadline passed while waiting for the lock");
+    COUNT(redis, TIMEOUTS, 1);
+  }
+  else
+    xdebug(0, "redis is busy; command rejected");
+  errno = ret;
+}
+
+
+/* the deadline TIMEOUT from now, or zero if TIMEOUT is NULL or zero */
+static unsigned long long
+redis_deadline(const struct timeval *timeout)
+{
+  if (!timeout || (timeout->tv_sec == 0 && timeout->tv_usec == 0))
+    return 0;
+  return redis_clock_ns() + (unsigned long long)timeout->tv_sec * 1000000000ULL
+    + (unsigned long long)timeout->tv_usec * 1000ULL;
+}
+
+
+/*
+ * Send the command in FORMAT with REDIS locked by redis_admit(), and
+ * unlock it.
+ */
+static redisReply *
+redis_vcommand_admitted_locked(REDIS *redis, int reopen,
+                               unsigned long long deadline,
+                               const char *format, va_list ap)
+{
+  redisReply *reply;
+  unsigned long long saved = 0;
+  int timedout = FALSE;
+
+  if (deadline)
+    saved = redis_deadline_begin(redis, deadline);
+  reply = redis_vcommand_unlocked(redis, reopen, format, ap);
+  if (deadline) {
+    timedout = !reply && redis_deadline_left(redis, NULL, NULL) < 0;
+    redis_deadline_end(redis, saved);
+  }
+
+  redis_unlock(redis);
+  if (timedout)
+    errno = ETIMEDOUT;
+  return reply;
+}
+
+
+static redisReply *
+redis_vcommand_admitted(REDIS *redis, int reopen, int try,
+                        unsigned long long deadline,
+                        const char *format, va_list ap)
+{
+  unsigned long long start = redis_clock_ns();
+  int ret;
+
+  ret = redis_admit(redis, try, deadline);
+  if (ret != 0) {
+    redis_admit_failed(redis, ret);
+    return NULL;
+  }
+  redis->lock_ns = redis_clock_ns() - start;
+
+  return redis_vcommand_admitted_locked(redis, reopen, deadline, format, ap);
+}
+
+
+#ifdef _PTHREAD
+/*
+ * A read-only command in flight; see redis_set_coalescing().  The
+ * first caller (the leader) sends it, and the later ones (the
+ * followers) wait on COND for its reply.  It is freed by the last of
+ * its users.
+ */
+struct redis_flight {
+  struct redis_flight *next;
+  char *cmd;                    /* the formatted command */
+  int len;
+  int users;                    /* the leader and the waiting followers */
+  int followers;
+  int sent;                     /* the leader has locked REDIS */
+  int done;                     /* REPLY and ERROR are set */
+  redisReply *reply;
+  int error;                    /* errno of the leader if REPLY is NULL */
+  pthread_cond_t cond;
+};
+
+static const char *readonly_commands[] = {
+  "GET", "MGET", "GETRANGE", "STRLEN", "EXISTS", "TTL", "PTTL", "TYPE",
+  "HGET", "HMGET", "HGETALL", "HKEYS", "HVALS", "HLEN", "HEXISTS", "HSTRLEN",
+  "LRANGE", "LLEN", "LINDEX",
+  "SMEMBERS", "SISMEMBER", "SMISMEMBER", "SCARD",
+  "ZRANGE", "ZREVRANGE", "ZRANGEBYSCORE", "ZREVRANGEBYSCORE", "ZRANGEBYLEX",
+  "ZSCORE", "ZMSCORE", "ZCARD", "ZCOUNT", "ZRANK", "ZREVRANK",
+  "GETBIT", "BITCOUNT", "XRANGE", "XREVRANGE", "XLEN",
+  NULL,
+};
+
+
+/*
+ * Return nonzero if the command in FORMAT only reads.
+ */
+static int
+redis_is_readonly(const char *format, va_list ap)
+{
+  char name[24];
+  int i;
+
+  if (redis_command_name(format, ap, name, sizeof(name)) != 0)
+    return FALSE;
+
+  for (i = 0; readonly_commands[i]; i++) {
+    if (strcasecmp(name, readonly_commands[i]) == 0)
+      return TRUE;
+  }
+  return FALSE;
+}
+
+
+/* Drop a user of FLIGHT; called with FLIGHT_MUTEX held. */
+static void
+redis_flight_unref(struct redis_flight *flight)
+{
+  if (--flight->users > 0)
+    return;
+  pthread_cond_destroy(&flight->cond);
+  redisFreeCommand(flight->cmd);
+  free(flight);
+}
+
+
+/*
+ * Wait for the reply of FLIGHT as a follower, until DEADLINE at most
+ * (forever if zero).  Called and returns with FLIGHT_MUTEX held.
+ */
+static redisReply *
+redis_flight_wait(REDIS *redis, struct redis_flight *flight,
+                  unsigned long long deadline)
+{
+  struct timespec abstime;
+  redisReply *reply;
+  int ret = 0;
+
+  flight->users++;
+  flight->followers++;
+
+  if (deadline)
+    ret = redis_abstime(deadline, &abstime);
+  while (!flight->done && ret == 0) {
+    if (deadline)
+      ret = pthread_cond_timedwait(&flight->cond, &redis->flight_mutex,
+                                   &abstime);
+    else
+      ret = pthread_cond_wait(&flight->cond, &redis->flight_mutex);
+  }
+
+  if (!flight->done) {
+    flight->followers--;
+    redis_flight_unref(flight);
+    xdebug(0, "deadline passed while waiting for the same command");
+    COUNT(redis, TIMEOUTS, 1);
+    errno = ETIMEDOUT;
+    return NULL;
+  }
+
+  reply = flight->reply;
+  if (!reply)
+    errno = flight->error;
+  redis_flight_unref(flight);
+  COUNT(redis, COALESCED, 1);
+  return reply;
+}
+
+
+/*
+ * Send the read-only command in FORMAT, or wait for the reply of the
+ * same command if it is in flight already.
+ *
+ * Only a flight whose leader has not locked REDIS yet is joined, so
+ * that its command is written after anything the follower did before
+ * this call (e.g. a SET of the same key).  And if this thread can lock
+ * REDIS right away (in particular, if it holds the lock already; see
+ * redis_lock()), the command is just sent; waiting for a leader that
+ * needs the lock would never end.
+ */
+static redisReply *
+redis_vcommand_flight(REDIS *redis, int reopen, unsigned long long deadline,
+                      const char *format, va_list ap)
+{
+  struct redis_flight *flight, **pp;
+  unsigned long long start;
+  redisReply *reply;
+  char *cmd;
+  va_list aq;
+  int len, ret, error;
+
+  if (pthread_mutex_trylock(&redis->mutex) == 0) {
+    redis->lock_ns = 0;
+    return redis_vcommand_admitted_locked(redis, reopen, deadline,
+                                          format, ap);
+  }
+
+  va_copy(aq, ap);
+  len = redisvFormatCommand(&cmd, format, aq);
+  va_end(aq);
+  if (len < 0)
+    return redis_vcommand_admitted(redis, reopen, FALSE, deadline,
+                                   format, ap);
+
+  pthread_mutex_lock(&redis->flight_mutex);
+  for (flight = redis->flights; flight; flight = flight->next) {
+    if (!flight->sent && flight->len == len &&
+        memcmp(flight->cmd, cmd, len) == 0)
+      break;
+  }
+  if (flight) {
+    redisFreeCommand(cmd);
+    reply = redis_flight_wait(redis, flight, deadline);
+    error = errno;
+    pthread_mutex_unlock(&redis->flight_mutex);
+    errno = error;
+    return reply;
+  }
+
+  flight = malloc(sizeof(*flight));
+  if (!flight) {
+    pthread_mutex_unlock(&redis->flight_mutex);
+    redisFreeCommand(cmd);
+    return redis_vcommand_admitted(redis, reopen, FALSE, deadline,
+                                   format, ap);
+  }
+  flight->cmd = cmd;
+  flight->len = len;
+  flight->users = 1;
+  flight->followers = 0;
+  flight->sent = FALSE;
+  flight->done = FALSE;
+  flight->reply = NULL;
+  flight->error = 0;
+  pthread_cond_init(&flight->cond, NULL);
+  flight->next = redis->flights;
+  redis->flights = flight;
+  pthread_mutex_unlock(&redis->flight_mutex);
+
+  start = redis_clock_ns();
+  ret = redis_admit(redis, FALSE, deadline);
+  pthread_mutex_lock(&redis->flight_mutex);
+  flight->sent = TRUE;          /* no more followers */
+  pthread_mutex_unlock(&redis->flight_mutex);
+  if (ret != 0) {
+    redis_admit_failed(redis, ret);
+    reply = NULL;
+  }
+  else {
+    redis->lock_ns = redis_clock_ns() - start;
+    reply = redis_vcommand_admitted_locked(redis, reopen, deadline,
+                                           format, ap);
+  }
+  error = errno;
+
+  pthread_mutex_lock(&redis->flight_mutex);
+  for (pp = &redis->flights; *pp != flight; pp = &(*pp)->next)
+    ;
+  *pp = flight->next;
+
+  if (reply && flight->followers > 0 &&
+      redis_reply_share(reply, flight->followers + 1) != 0) {
+    xdebug(errno, "can't share the reply");
+    flight->error = errno;      /* the followers fail */
+  }
+  else {
+    flight->reply = reply;
+    flight->error = error;
   }
+  flight->done = TRUE;
+  pthread_cond_broadcast(&flight->cond);
+  redis_flight_unref(flight);
+  pthread_mutex_unlock(&redis->flight_mutex);
 
+  errno = error;
   return reply;
 }
 
 
+int
+redis_set_coalescing(REDIS *redis, int on)
+{
+  redis->coalesce = !!on;
+  return 0;
+}
+#endif  /* _PTHREAD */
+
+
 static redisReply *
+redis_vcommand_by(REDIS *redis, int reopen, int try,
+                  unsigned long long deadline, const char *format, va_list ap)
+{
+#ifdef _PTHREAD
+  /* LANES_MAX is only a hint here; redis_lane_get() reads it again
+   * under LANE_MUTEX. */
+  if (redis->lanes_max > 0 && redis_is_blocking(format, ap)) {
+    redisReply *reply;
+    int off;
+
+    reply = redis_vcommand_lane(redis, reopen, deadline, format, ap, &off);
+    if (!off)
+      return reply;
+  }
+  if (redis->coalesce && !try && redis_is_readonly(format, ap))
+    return redis_vcommand_flight(redis, reopen, deadline, format, ap);
+#endif
+
+  return redis_vcommand_admitted(redis, reopen, try, deadline, format, ap);
+}
+
+
+redisReply *
 redis_vcommand(REDIS *redis, int reopen,
                const char *format, va_list ap)
 {
-  redisReply *reply;
-  redis_lock(redis);
-  reply = redis_vcommand_unlocked(redis, reopen, format, ap);
-  redis_unlock(redis);
+  return redis_vcommand_by(redis, reopen, FALSE, 0, format, ap);
+}
+
+
+redisReply *
+redis_command_deadline(REDIS *redis, const struct timeval *timeout,
+                       const char *format, ...)
+{
+  va_list ap;
+  redisReply *reply = NULL;
+
+  va_start(ap, format);
+  reply = redis_vcommand_by(redis, TRUE, FALSE, redis_deadline(timeout),
+                            format, ap);
+  va_end(ap);
+
+  return reply;
+}
+
+
+redisReply *
+redis_try_command(REDIS *redis, const char *format, ...)
+{
+  va_list ap;
+  redisReply *reply = NULL;
+
+  va_start(ap, format);
+  reply = redis_vcommand_by(redis, TRUE, TRUE, 0, format, ap);
+  va_end(ap);
+
   return reply;
 }
 
@@ -999,11 +2499,12 @@ redis_command(REDIS *redis, const char *format, ...)
 }
 
 
+/*
+ * Reconnect REDIS if needed, before queuing a command.
+ */
 static int
-redis_vappend(REDIS *redis, const char *format, va_list ap)
+redis_append_prepare(REDIS *redis)
 {
-  int ret;
-
   if (!redis->ctx) {
     if (redis->stacked != 0) {
       xdebug(0, "redis connection failed during building PIPELINE or MULTI");
@@ -1017,6 +2518,17 @@ redis_vappend(REDIS *redis, const char *format, va_list ap)
     else
       xdebug(0, "redis re-connected");
   }
+  return REDIS_OK;
+}
+
+
+int
+redis_vappend(REDIS *redis, const char *format, va_list ap)
+{
+  int ret;
+
+  if (redis_append_prepare(redis) != REDIS_OK)
+    return REDIS_ERR;
 
   ret = redisvAppendCommand(redis->ctx, format, ap);
 
@@ -1027,6 +2539,43 @@ redis_vappend(REDIS *redis, const char *format, va_list ap)
 }
 
 
+int
+redis_append_argv_unlocked(REDIS *redis, int argc, const char **argv,
+                           const size_t *argvlen)
+{
+  int ret;
+
+  if (redis_append_prepare(redis) != REDIS_OK)
+    return REDIS_ERR;
+
+  ret = redisAppendCommandArgv(redis->ctx, argc, argv, argvlen);
+
+  if (ret == REDIS_OK)
+    redis->stacked++;
+
+  return ret;
+}
+
+
+int
+redis_send_unlocked(REDIS *redis)
+{
+  size_t len;
+  int done;
+
+  if (!redis->ctx || redis->stacked == 0)
+    return REDIS_ERR;
+
+  len = sdslen(redis->ctx->obuf);
+  COUNT(redis, BYTES_OUT, len);
+  do {
+    if (redisBufferWrite(redis->ctx, &done) == REDIS_ERR)
+      return REDIS_ERR;
+  } while (!done);
+  return REDIS_OK;
+}
+
+
 int
 redis_multi(REDIS *redis)
 {
@@ -1048,181 +2597,467 @@ redis_multi(REDIS *redis)
     return ret;
   }
 
-  // redis->multi[redis->multi_pos++] = redis->stacked - 1;
+  // redis->multi[redis->multi_pos++] = redis->stacked - 1;
+
+  redis_unlock(redis);
+
+  return ret;
+}
+
+
+int
+redis_multi_exec(REDIS *redis)
+{
+  int ret;
+
+  redis_lock(redis);
+
+  if (redis->multi_pos >= REDIS_MULTI_MAX - 1) {
+    /* redis->multi overflow.  Too many transaction before exec. */
+    /* TODO: How to recover from this error? */
+    redis_unlock(redis);
+    return REDIS_ERR;
+  }
+
+  ret = redis_append_unlocked(redis, "EXEC");
+  if (ret != REDIS_OK) {
+    redis_unlock(redis);
+    return ret;
+  }
+
+  redis->multi[redis->multi_pos++] = redis->stacked - 1;
+
+  redis_unlock(redis);
+
+  return ret;
+}
+
+
+redisReply *
+redis_multi_reply(REDIS *redis, redisReply *reply, int index)
+{
+  int mindex;
+
+  if (!reply || reply->type != REDIS_REPLY_ARRAY)
+    return NULL;
+
+  mindex = redis->multi[index];
+  if (mindex >= reply->elements || mindex < 0)
+    return NULL;
+
+  return reply->element[mindex];
+}
+
+
+int
+redis_append_unlocked(REDIS *redis, const char *format, ...)
+{
+  va_list ap;
+  int ret;
+
+  va_start(ap, format);
+  ret = redis_vappend(redis, format, ap);
+  va_end(ap);
+
+  return ret;
+}
+
+
+int
+redis_append(REDIS *redis, const char *format, ...)
+{
+  va_list ap;
+  int ret;
+
+  va_start(ap, format);
+  redis_lock(redis);
+  ret = redis_vappend(redis, format, ap);
+  redis_unlock(redis);
+  va_end(ap);
+
+  return ret;
+}
+
+
+/* Create a reply object: copied from hiredis.c */
+static redisReply *
+createReplyObject(int type)
+{
+  redisReply *r = calloc(1, sizeof(*r));
+
+  if (r == NULL)
+    return NULL;
+
+  r->type = type;
+  return r;
+}
+
+
+/*
+ * Read the replies of the stacked commands into the elements of
+ * PACKED, or into REDIS->flat (or through REDIS->raw) if PACKED is
+ * NULL.  On failure, the connection is reopened.  Returns zero on
+ * success, -1 on failure.
+ */
+static int
+redis_exec_replies(REDIS *redis, redisReply *packed)
+{
+  redisReply *reply;
+  struct redis_call call;
+  struct redis_call_info info;
+  int host = redis->chost;
+  int outcome = REDIS_OUTCOME_OK;
+  char head[SLOWLOG_HEAD_MAX];
+  size_t head_len, stacked;
+  size_t i;
+
+  memset(&call, 0, sizeof(call));
+  call.phase[REDIS_PHASE_LOCK] = redis->lock_ns;
+  redis->lock_ns = 0;
+
+  COUNT(redis, COMMANDS, redis->stacked);
+  COUNT(redis, PIPELINED, redis->stacked);
+
+  if (redis->hooks)
+    redis_hook_before(redis, &info, NULL, NULL, "(pipeline)",
+                      redis->stacked);
+
+  redis->reopen_ns = 0;
+  head_len = redis_slowlog_head(redis, head);
+  stacked = redis->stacked;
+
+  for (i = 0; i < redis->stacked; i++) {
+    if (redis_get_reply(redis, &reply, &call) == REDIS_ERR) {
+      goto err;
+    }
+    if (reply == NULL) {
+      xerror(0, 0, "unrecognized reply from redis!");
+      abort();
+    }
+    else if (reply->type == REDIS_REPLY_ERROR) {
+      xdebug(0, "redis error: %s", reply->str);
+      COUNT(redis, ERRORS, 1);
+      outcome = REDIS_OUTCOME_ERROR;
+    }
+    if (packed)
+      packed->element[i] = reply;
+  }
+  redis->stacked = 0;
+  redis->multi_pos = 0;
+
+  redis_stats_record(redis->stats, "", host, call.phase);
+  if (redis->hooks)
+    redis_hook_after(redis, &info, &call, NULL, outcome);
+  if (head_len)
+    redis_stats_slowlog(redis->stats, head, head_len, stacked,
+                        host >= 0 ? redis->hosts[host] : NULL,
+                        call.phase, 0);
+  return 0;
+
+ err:
+  for (i = 0; packed && i < redis->stacked; i++) {
+    if (packed->element[i] != NULL) {
+      freeReplyObject(packed->element[i]);
+      packed->element[i] = NULL;
+    }
+  }
+
+  redis_stats_record(redis->stats, "", host, call.phase);
+  if (redis->hooks)
+    redis_hook_after(redis, &info, &call, NULL, redis_outcome(&call, NULL));
+
+  redis->stacked = 0;
+  redis->multi_pos = 0;
+
+  redis_reopen_unlocked(redis);
+
+  if (head_len)
+    redis_stats_slowlog(redis->stats, head, head_len, stacked,
+                        host >= 0 ? redis->hosts[host] : NULL,
+                        call.phase, redis->reopen_ns);
+  return -1;
+}
+
+
+redisReply *
+redis_exec_unlocked(REDIS *redis)
+{
+  redisReply *packed;
+  size_t i;
+
+  assert(redis != NULL);
+
+  if (redis->stacked == 0)
+    return NULL;
+
+  packed = createReplyObject(REDIS_REPLY_ARRAY);
+  if (!packed)
+    return NULL;
+
+  packed->element = malloc(redis->stacked * sizeof(redisReply *));
+  if (packed->element == NULL) {
+    xerror(0, errno, "can't allocate memory for redisReply *");
+    freeReplyObject(packed);
+    return NULL;
+  }
+
+  for (i = 0; i < redis->stacked; i++)
+    packed->element[i] = NULL;
 
-  redis_unlock(redis);
+  packed->elements = redis->stacked;
 
-  return ret;
+  if (redis_exec_replies(redis, packed) != 0) {
+    packed->elements = 0;
+    freeReplyObject(packed);
+    return NULL;
+  }
+  return packed;
 }
 
 
-int
-redis_multi_exec(REDIS *redis)
+static redisReply *
+redis_exec_by(REDIS *redis, int try, unsigned long long deadline)
 {
-  int ret;
-
-  redis_lock(redis);
+  redisReply *reply;
+  unsigned long long saved = 0, start = redis_clock_ns();
+  int ret, timedout = FALSE;
 
-  if (redis->multi_pos >= REDIS_MULTI_MAX - 1) {
-    /* redis->multi overflow.  Too many transaction before exec. */
-    /* TODO: How to recover from this error? */
-    redis_unlock(redis);
-    return REDIS_ERR;
+  ret = redis_admit(redis, try, deadline);
+  if (ret != 0) {
+    redis_admit_failed(redis, ret);
+    return NULL;
   }
+  redis->lock_ns = redis_clock_ns() - start;
 
-  ret = redis_append_unlocked(redis, "EXEC");
-  if (ret != REDIS_OK) {
-    redis_unlock(redis);
-    return ret;
+  if (deadline)
+    saved = redis_deadline_begin(redis, deadline);
+  reply = redis_exec_unlocked(redis);
+  if (deadline) {
+    timedout = !reply && redis_deadline_left(redis, NULL, NULL) < 0;
+    redis_deadline_end(redis, saved);
   }
 
-  redis->multi[redis->multi_pos++] = redis->stacked - 1;
-
   redis_unlock(redis);
-
-  return ret;
+  if (timedout)
+    errno = ETIMEDOUT;
+  return reply;
 }
 
 
 redisReply *
-redis_multi_reply(REDIS *redis, redisReply *reply, int index)
+redis_exec(REDIS *redis)
 {
-  int mindex;
+  return redis_exec_by(redis, FALSE, 0);
+}
 
-  if (!reply || reply->type != REDIS_REPLY_ARRAY)
-    return NULL;
 
-  mindex = redis->multi[index];
-  if (mindex >= reply->elements || mindex < 0)
-    return NULL;
+redisReply *
+redis_try_exec(REDIS *redis)
+{
+  return redis_exec_by(redis, TRUE, 0);
+}
 
-  return reply->element[mindex];
+
+redisReply *
+redis_exec_deadline(REDIS *redis, const struct timeval *timeout)
+{
+  return redis_exec_by(redis, FALSE, redis_deadline(timeout));
 }
 
 
-int
-redis_append_unlocked(REDIS *redis, const char *format, ...)
+REDIS_FLAT *
+redis_command_flat(REDIS *redis, const char *format, ...)
 {
+  struct redis_flat_build *b;
+  REDIS_FLAT *flat = NULL;
+  redisReply *reply;
+  unsigned long long start = redis_clock_ns();
   va_list ap;
   int ret;
 
+  b = redis_flat_build_new();
+  if (!b) {
+    xerror(0, errno, "can't allocate memory for a flat reply");
+    return NULL;
+  }
+
+  ret = redis_admit(redis, FALSE, 0);
+  if (ret != 0) {
+    redis_admit_failed(redis, ret);
+    redis_flat_build_free(b);
+    return NULL;
+  }
+  redis->lock_ns = redis_clock_ns() - start;
+
+  redis->flat = b;
   va_start(ap, format);
-  ret = redis_vappend(redis, format, ap);
+  reply = redis_vcommand_unlocked(redis, TRUE, format, ap);
   va_end(ap);
+  redis->flat = NULL;
+  if (reply)
+    flat = redis_flat_seal(b);
+  redis_unlock(redis);
 
-  return ret;
+  redis_flat_build_free(b);
+  return flat;
 }
 
 
-int
-redis_append(REDIS *redis, const char *format, ...)
+REDIS_RAW *
+redis_command_raw(REDIS *redis, const char *format, ...)
 {
+  struct redis_raw_read rr;
+  redisReply *reply;
+  unsigned long long start = redis_clock_ns();
   va_list ap;
   int ret;
 
+  memset(&rr, 0, sizeof(rr));
+
+  ret = redis_admit(redis, FALSE, 0);
+  if (ret != 0) {
+    redis_admit_failed(redis, ret);
+    return NULL;
+  }
+  redis->lock_ns = redis_clock_ns() - start;
+
+  redis->raw = &rr;
   va_start(ap, format);
-  redis_lock(redis);
-  ret = redis_vappend(redis, format, ap);
-  redis_unlock(redis);
+  reply = redis_vcommand_unlocked(redis, TRUE, format, ap);
   va_end(ap);
+  redis->raw = NULL;
+  redis_unlock(redis);
 
-  return ret;
+  if (!reply) {
+    redis_raw_free(rr.raw);
+    return NULL;
+  }
+  return rr.raw;
 }
 
 
-/* Create a reply object: copied from hiredis.c */
-static redisReply *
-createReplyObject(int type)
+REDIS_FLAT *
+redis_exec_flat_unlocked(REDIS *redis)
 {
-  redisReply *r = calloc(1, sizeof(*r));
+  struct redis_flat_build *b;
+  REDIS_FLAT *flat = NULL;
 
-  if (r == NULL)
+  if (redis->stacked == 0)
     return NULL;
 
-  r->type = type;
-  return r;
+  b = redis_flat_build_new();
+  if (!b) {
+    xerror(0, errno, "can't allocate memory for a flat reply");
+    return NULL;
+  }
+
+  redis->flat = b;
+  if (redis_exec_replies(redis, NULL) == 0)
+    flat = redis_flat_seal(b);
+  redis->flat = NULL;
+
+  redis_flat_build_free(b);
+  return flat;
 }
 
 
-redisReply *
-redis_exec_unlocked(REDIS *redis)
+REDIS_FLAT *
+redis_exec_flat(REDIS *redis)
 {
-  redisReply *reply, *packed;
-  size_t i;
-
-  assert(redis != NULL);
+  REDIS_FLAT *flat;
+  unsigned long long start = redis_clock_ns();
+  int ret;
 
-  if (redis->stacked == 0)
+  ret = redis_admit(redis, FALSE, 0);
+  if (ret != 0) {
+    redis_admit_failed(redis, ret);
     return NULL;
+  }
+  redis->lock_ns = redis_clock_ns() - start;
 
-  packed = createReplyObject(REDIS_REPLY_ARRAY);
-  if (!packed)
-    return NULL;
+  flat = redis_exec_flat_unlocked(redis);
+  redis_unlock(redis);
+  return flat;
+}
 
-  packed->element = malloc(redis->stacked * sizeof(redisReply *));
-  if (packed->element == NULL) {
-    xerror(0, errno, "can't allocate memory for redisReply *");
-    freeReplyObject(packed);
-    return NULL;
-  }
 
-  for (i = 0; i < redis->stacked; i++)
-    packed->element[i] = NULL;
+int
+redis_command_parse(REDIS *redis, const struct redis_parse_handler *handler,
+                    void *data, const char *format, ...)
+{
+  struct redis_raw_read rr;
+  redisReply *reply;
+  unsigned long long start = redis_clock_ns();
+  va_list ap;
+  int ret;
 
-  packed->elements = redis->stacked;
+  memset(&rr, 0, sizeof(rr));
+  rr.scan.handler = handler;
+  rr.scan.data = data;
 
-  for (i = 0; i < redis->stacked; i++) {
-    if (redisGetReply(redis->ctx, (void **)&reply) == REDIS_ERR) {
-      goto err;
-    }
-    if (reply == NULL) {
-      xerror(0, 0, "unrecognized reply from redis!");
-      abort();
-    }
-    else if (reply->type == REDIS_REPLY_ERROR) {
-      xdebug(0, "redis error: %s", reply->str);
-    }
-    packed->element[i] = reply;
+  ret = redis_admit(redis, FALSE, 0);
+  if (ret != 0) {
+    redis_admit_failed(redis, ret);
+    return -1;
   }
-  redis->stacked = 0;
-  redis->multi_pos = 0;
+  redis->lock_ns = redis_clock_ns() - start;
 
-  return packed;
+  redis->raw = &rr;
+  va_start(ap, format);
+  reply = redis_vcommand_unlocked(redis, TRUE, format, ap);
+  va_end(ap);
+  redis->raw = NULL;
+  redis_unlock(redis);
 
- err:
-  for (i = 0; i < redis->stacked; i++) {
-    if (packed->element[i] != NULL) {
-      freeReplyObject(packed->element[i]);
-      packed->element[i] = NULL;
-    }
-  }
-  packed->elements = 0;
-  freeReplyObject(packed);
+  return reply ? 0 : -1;
+}
 
-  redis->stacked = 0;
-  redis->multi_pos = 0;
 
-  redis_reopen_unlocked(redis);
+int
+redis_exec_parse_unlocked(REDIS *redis,
+                          const struct redis_parse_handler *handler,
+                          void *data)
+{
+  struct redis_raw_read rr;
+  int ret;
 
-  return NULL;
+  if (redis->stacked == 0)
+    return -1;
+
+  memset(&rr, 0, sizeof(rr));
+  rr.scan.handler = handler;
+  rr.scan.data = data;
+
+  redis->raw = &rr;
+  ret = redis_exec_replies(redis, NULL);
+  redis->raw = NULL;
+  return ret;
 }
 
 
-redisReply *
-redis_exec(REDIS *redis)
+int
+redis_exec_parse(REDIS *redis, const struct redis_parse_handler *handler,
+                 void *data)
 {
-  redisReply *reply;
-  redis_lock(redis);
-  reply = redis_exec_unlocked(redis);
+  unsigned long long start = redis_clock_ns();
+  int ret;
+
+  ret = redis_admit(redis, FALSE, 0);
+  if (ret != 0) {
+    redis_admit_failed(redis, ret);
+    return -1;
+  }
+  redis->lock_ns = redis_clock_ns() - start;
+
+  ret = redis_exec_parse_unlocked(redis, handler, data);
   redis_unlock(redis);
-  return reply;
+  return ret;
 }
 
-
 void
 redis_free(redisReply *reply)
 {
-  if (reply)
+  if (reply && !redis_reply_release(reply))
     freeReplyObject(reply);
 }
 
@@ -1238,6 +3073,16 @@ static struct {
   P(REDIS_REPLY_NIL),
   P(REDIS_REPLY_STATUS),
   P(REDIS_REPLY_ERROR),
+#ifdef SREDIS_HAVE_RESP3
+  P(REDIS_REPLY_DOUBLE),
+  P(REDIS_REPLY_BOOL),
+  P(REDIS_REPLY_MAP),
+  P(REDIS_REPLY_SET),
+  P(REDIS_REPLY_ATTR),
+  P(REDIS_REPLY_PUSH),
+  P(REDIS_REPLY_BIGNUM),
+  P(REDIS_REPLY_VERB),
+#endif
   { 0, 0 },
 #undef P
 };
@@ -1271,9 +3116,44 @@ redis_dump_reply(const redisReply *reply,
 
     switch (reply->type) {
     case REDIS_REPLY_STRING:
+    case REDIS_REPLY_STATUS:
     case REDIS_REPLY_ERROR:
+#ifdef SREDIS_HAVE_RESP3
+    case REDIS_REPLY_BIGNUM:
+#endif
       xerror(0, 0, "%*s%s reply: %s", idnt, " ", prefix, reply->str);
       break;
+#ifdef SREDIS_HAVE_RESP3
+    case REDIS_REPLY_VERB:
+      xerror(0, 0, "%*s%s reply: (%.3s) %s", idnt, " ", prefix,
+             reply->vtype, reply->str);
+      break;
+    case REDIS_REPLY_DOUBLE:
+      xerror(0, 0, "%*s%s reply: %.17g", idnt, " ", prefix, reply->dval);
+      break;
+    case REDIS_REPLY_BOOL:
+      xerror(0, 0, "%*s%s reply: %s", idnt, " ", prefix,
+             reply->integer ? "true" : "false");
+      break;
+    case REDIS_REPLY_MAP:
+    case REDIS_REPLY_ATTR:
+      xerror(0, 0, "%*s%s reply: map size(%zd)", idnt, " ", prefix,
+             reply->elements / 2);
+      for (i = 0; i < reply->elements; i++) {
+        redis_dump_reply(reply->element[i], (i % 2 == 0) ? "key" : "value",
+                         indent + 1);
+      }
+      break;
+    case REDIS_REPLY_SET:
+    case REDIS_REPLY_PUSH:
+      xerror(0, 0, "%*s%s reply: %s size(%zd)", idnt, " ", prefix,
+             reply->type == REDIS_REPLY_SET ? "set" : "push",
+             reply->elements);
+      for (i = 0; i < reply->elements; i++) {
+        redis_dump_reply(reply->element[i], prefix, indent + 1);
+      }
+      break;
+#endif  /* SREDIS_HAVE_RESP3 */
     case REDIS_REPLY_INTEGER:
       xerror(0, 0, "%*s%s reply: %lld", idnt, " ", prefix, reply->integer);
       break;
@@ -1301,8 +3181,17 @@ redis_reply_integer(redisReply *reply)
 
   switch (reply->type) {
   case REDIS_REPLY_INTEGER:
+#ifdef SREDIS_HAVE_RESP3
+  case REDIS_REPLY_BOOL:
+#endif
     ret = reply->integer;
     break;
+#ifdef SREDIS_HAVE_RESP3
+  case REDIS_REPLY_DOUBLE:
+    ret = (long long)reply->dval;
+    break;
+  case REDIS_REPLY_BIGNUM:
+#endif
   case REDIS_REPLY_STRING:
     if (reply->str[0] == '\0')
       break;                 /* empty string("") is treated as zero. */
@@ -1328,3 +3217,114 @@ redis_reply_integer(redisReply *reply)
   }
   return ret;
 }
+
+
+double
+redis_reply_double(redisReply *reply)
+{
+  char *endptr;
+  double ret = 0;
+
+  switch (reply->type) {
+  case REDIS_REPLY_INTEGER:
+#ifdef SREDIS_HAVE_RESP3
+  case REDIS_REPLY_BOOL:
+#endif
+    ret = (double)reply->integer;
+    break;
+#ifdef SREDIS_HAVE_RESP3
+  case REDIS_REPLY_DOUBLE:
+    ret = reply->dval;
+    break;
+  case REDIS_REPLY_BIGNUM:
+  case REDIS_REPLY_VERB:
+#endif
+  case REDIS_REPLY_STRING:
+  case REDIS_REPLY_STATUS:
+    if (reply->str[0] == '\0')
+      break;                 /* empty string("") is treated as zero. */
+    errno = 0;
+    ret = strtod(reply->str, &endptr);
+    if (*endptr != '\0') {
+      xdebug(0, "warning: invalid value (%s) detected when double expected",
+             reply->str);
+      errno = EINVAL;
+      ret = 0;
+    }
+    break;
+  default:
+    xdebug(0, "warning: wrong type(%d) detected when double expected",
+           reply->type);
+    errno = EINVAL;
+    break;
+  }
+  return ret;
+}
+
+
+/*
+ * Return nonzero if REPLY is an array of [key, value] arrays, which
+ * is how RESP3 returns ZRANGE ... WITHSCORES and friends.
+ */
+static int
+redis_reply_nested_pairs(const redisReply *reply)
+{
+  return (reply->type == REDIS_REPLY_ARRAY && reply->elements > 0 &&
+          reply->element[0] &&
+          reply->element[0]->type == REDIS_REPLY_ARRAY &&
+          reply->element[0]->elements == 2);
+}
+
+
+size_t
+redis_reply_pairs(const redisReply *reply)
+{
+  if (!reply)
+    return 0;
+
+  switch (reply->type) {
+#ifdef SREDIS_HAVE_RESP3
+  case REDIS_REPLY_MAP:
+  case REDIS_REPLY_ATTR:
+    return reply->elements / 2;
+#endif
+  case REDIS_REPLY_ARRAY:
+    if (redis_reply_nested_pairs(reply))
+      return reply->elements;
+    return reply->elements / 2;
+  default:
+    return 0;
+  }
+}
+
+
+static redisReply *
+redis_reply_pair(const redisReply *reply, size_t index, int which)
+{
+  redisReply *pair;
+
+  if (index >= redis_reply_pairs(reply))
+    return NULL;
+
+  if (redis_reply_nested_pairs(reply)) {
+    pair = reply->element[index];
+    if (pair->type != REDIS_REPLY_ARRAY || pair->elements != 2)
+      return NULL;
+    return pair->element[which];
+  }
+  return reply->element[index * 2 + which];
+}
+
+
+redisReply *
+redis_reply_key(const redisReply *reply, size_t index)
+{
+  return redis_reply_pair(reply, index, 0);
+}
+
+
+redisReply *
+redis_reply_value(const redisReply *reply, size_t index)
+{
+  return redis_reply_pair(reply, index, 1);
+}
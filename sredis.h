@@ -3,6 +3,7 @@
 
 #include <sys/time.h>
 #include <errno.h>
+#include <stdio.h>
 #ifdef _PTHREAD
 #include <pthread.h>
 #endif
@@ -27,15 +28,51 @@ BEGIN_C_DECLS
 
 #define REDIS_HOSTS_MAX         16
 #define REDIS_MULTI_MAX         16
+#define REDIS_LANES_MAX         16
+#define REDIS_LANES_DEFAULT     0       /* no lanes unless asked */
+
+/*
+ * hiredis 1.0 and later understand RESP3 (maps, sets, doubles,
+ * booleans, push frames, ...).  With older hiredis, sredis silently
+ * stays on RESP2.
+ */
+#if defined(REDIS_REPLY_MAP) && defined(REDIS_REPLY_PUSH)
+# define SREDIS_HAVE_RESP3      1
+#endif
+
+/* hiredis 1.1 and later deliver RESP3 push frames via a callback */
+#if defined(SREDIS_HAVE_RESP3) && defined(HIREDIS_MAJOR) &&     \
+  (HIREDIS_MAJOR > 1 || (HIREDIS_MAJOR == 1 && HIREDIS_MINOR >= 1))
+# define SREDIS_HAVE_PUSH_CB    1
+#endif
+
+struct REDIS_;
+struct redis_stats;
+struct redis_call_info;
+
+/*
+ * Handler for out-of-band RESP3 push frames (e.g. client-side caching
+ * invalidations).  The handler owns REPLY and should release it with
+ * redis_free().
+ */
+typedef void (*redis_push_handler)(struct REDIS_ *redis, redisReply *reply,
+                                   void *data);
+
+/* See redis_set_hooks(). */
+typedef void (*redis_call_hook)(struct REDIS_ *redis,
+                                struct redis_call_info *info, void *data);
+
+struct redis_hooks {
+  redis_call_hook before;       /* right before sending */
+  redis_call_hook after;        /* after the reply, or the failure */
+  void *data;
+};
 
 struct redis_hostent {
   const char *host;
   int port;
   struct timeval o_timeout;
   struct timeval c_timeout;
-
-  unsigned short success;
-  unsigned short failure;
 };
 
 struct REDIS_ {
@@ -61,12 +98,56 @@ struct REDIS_ {
   // short ver_tiny;
 
   char *password;
+  char *username;
+  char *client_name;
+
+  int protocol;                 /* requested protocol version (2 or 3) */
+  int resp;                     /* negotiated protocol version */
+
+  redis_push_handler push_handler;
+  void *push_data;
 
   int multi[REDIS_MULTI_MAX];
   int multi_pos;
 
+  /* see redis_stats_snapshot() */
+  struct redis_stats *stats;
+  int stats_shared;             /* STATS is owned by other REDIS */
+  unsigned long long lock_ns;   /* lock wait of the current command */
+  unsigned long long reopen_ns; /* reconnection time of the same */
+  unsigned long long deadline_ns; /* see redis_command_deadline() */
+  unsigned connects;            /* successful (re)connections */
+  int internal;                 /* nonzero while reconnecting */
+  struct redis_flat_build *flat; /* see redis_command_flat() */
+  struct redis_raw_read *raw;   /* see redis_command_raw(), _parse() */
+
+  /* see redis_set_max_waiters() */
+  int waiters;                  /* threads waiting for MUTEX */
+  int waiters_peak;
+  int waiters_max;
+
+  /* see redis_set_hooks() */
+  struct redis_hooks *hooks;    /* NULL, or &hooks_set */
+  struct redis_hooks hooks_set;
+  struct REDIS_ *parent;        /* the owner of a lane */
+
 #ifdef _PTHREAD
   pthread_mutex_t mutex;
+
+  /* Idle connections for blocking commands; see
+   * redis_set_blocking_lanes(). */
+  pthread_mutex_t lane_mutex;
+  struct REDIS_ *lanes[REDIS_LANES_MAX];
+  int lanes_idle;
+  int lanes_max;
+  struct timeval lane_timeout;
+  unsigned lanes_gen;           /* bumped when the endpoints change */
+  unsigned lane_gen;            /* LANES_GEN of PARENT for this lane */
+
+  /* Read-only commands in flight; see redis_set_coalescing(). */
+  pthread_mutex_t flight_mutex;
+  struct redis_flight *flights;
+  int coalesce;
 #endif
 };
 typedef struct REDIS_ REDIS;
@@ -113,6 +194,16 @@ REDIS *redis_open(const char *host, int port,
                   const struct timeval *c_timeout,
                   const struct timeval *o_timeout);
 
+/*
+ * Create and allocate new REDIS structure, which has the same
+ * connection information (endpoints, timeouts, credentials and
+ * protocol) as REDIS.
+ *
+ * The new one has its own connection, so it is useful for a
+ * long-running blocking operation that should not hold REDIS.
+ */
+REDIS *redis_dup(REDIS *redis);
+
 /*
  * Set the password for the authentication.
  *
@@ -121,6 +212,95 @@ REDIS *redis_open(const char *host, int port,
  */
 void redis_set_password(REDIS *redis, const char *password);
 
+/*
+ * Set the ACL user name for the authentication.
+ *
+ * It is used only when the connection is negotiated with HELLO
+ * (i.e. protocol 3).  If NULL, "default" is used.
+ */
+void redis_set_username(REDIS *redis, const char *username);
+
+/*
+ * Set the connection name (a.k.a. CLIENT SETNAME).
+ *
+ * Pass NULL to clear.  The name is applied on the next connection.
+ */
+void redis_set_client_name(REDIS *redis, const char *name);
+
+/*
+ * Select the protocol version (2 or 3) for the next connection.
+ *
+ * For protocol 3, sredis sends "HELLO 3" with the credentials and the
+ * client name in the same round trip.  If the server does not know
+ * HELLO (redis < 6.0), sredis falls back to RESP2 with AUTH.
+ *
+ * Returns zero on success.  If PROTOCOL is not supported (or hiredis
+ * is too old for RESP3), it returns -1 and errno is set to EINVAL.
+ */
+int redis_set_protocol(REDIS *redis, int protocol);
+
+/*
+ * Return the protocol version negotiated with the current server, or
+ * zero if not connected.
+ */
+int redis_protocol(REDIS *redis);
+
+/*
+ * Register HANDLER for RESP3 push frames.  Pass NULL to drop the push
+ * frames silently (the default).
+ */
+void redis_set_push_handler(REDIS *redis, redis_push_handler handler,
+                            void *data);
+
+/*
+ * Instrumentation hooks
+ *
+ * HOOKS->before is called right before a command (or a pipeline of
+ * redis_exec()) is sent, and HOOKS->after is called when its reply is
+ * received, or when it failed.  Both are called with the REDIS mutex
+ * held, from the thread that sent the command, with the same INFO, so
+ * that the before hook can leave something (e.g. a tracing span) in
+ * INFO->span for the after hook.
+ *
+ * If no connection could be made, both are called one after the
+ * other, with REDIS_OUTCOME_UNCONNECTED.  The commands that sredis
+ * sends by itself while reconnecting (INFO, CONFIG GET) are not
+ * reported, nor counted in the statistics and the slow log.
+ *
+ * Pass NULL to remove the hooks.  Without hooks, the cost is one
+ * branch per command.
+ */
+enum {
+  REDIS_OUTCOME_OK,
+  REDIS_OUTCOME_ERROR,          /* an error reply */
+  REDIS_OUTCOME_TIMEOUT,
+  REDIS_OUTCOME_FAILED,         /* I/O or protocol error */
+  REDIS_OUTCOME_UNCONNECTED,    /* not sent; no connection could be made */
+};
+
+#define REDIS_HOOK_KEY_MAX      128
+
+struct redis_call_info {
+  const char *command;          /* upper case, or "(pipeline)" */
+  const char *key;              /* the first argument, or NULL */
+  size_t key_len;               /* may be longer than strlen(key) */
+  size_t commands;              /* number of commands */
+  const char *host;             /* the endpoint */
+  int port;
+
+  /* valid in the after hook */
+  size_t bytes_out;
+  size_t bytes_in;
+  unsigned long long lock_ns;
+  unsigned long long duration_ns;       /* from sending to the reply */
+  int outcome;
+  const redisReply *reply;      /* NULL for a pipeline, or on failure */
+
+  void *span;                   /* for the hooks */
+};
+
+void redis_set_hooks(REDIS *redis, const struct redis_hooks *hooks);
+
 /*
  * Close and deallocate REDIS structure.
  */
@@ -189,6 +369,120 @@ redisReply *redis_command_fast(REDIS *redis, const char *format, ...)
 redisReply *redis_command_fast_unlocked(REDIS *redis, const char *format, ...)
   __attribute__ ((format (printf, 2, 3)));
 
+/*
+ * Like redis_command(), but the whole call finishes within TIMEOUT:
+ * waiting for the REDIS mutex, reconnecting (to every endpoint, and
+ * finding the master), sending the command, and reading the reply.
+ * The timeouts of the hosts still apply if they are shorter.
+ *
+ * If the time runs out, it returns NULL with errno set to ETIMEDOUT,
+ * and the connection is closed if the reply was pending, so that the
+ * next command reconnects.  On other failures, errno is not
+ * ETIMEDOUT.  If TIMEOUT is NULL or zero, it is the same as
+ * redis_command().
+ *
+ * A call with a deadline made while the caller holds the REDIS lock
+ * (e.g. from redis_command_unlocked() within redis_lock()) keeps the
+ * earlier deadline.
+ */
+redisReply *redis_command_deadline(REDIS *redis, const struct timeval *timeout,
+                                   const char *format, ...)
+  __attribute__ ((format (printf, 3, 4)));
+
+/*
+ * Like redis_command() and redis_exec(), but never wait for the
+ * REDIS mutex.  If another thread holds it, they return NULL
+ * immediately with errno set to EBUSY, e.g. to skip a cache read
+ * under overload.  To wait for a bounded time instead, use
+ * redis_command_deadline().
+ */
+redisReply *redis_try_command(REDIS *redis, const char *format, ...)
+  __attribute__ ((format (printf, 2, 3)));
+redisReply *redis_try_exec(REDIS *redis);
+
+/*
+ * Admission control
+ *
+ * Reject a command with EBUSY, instead of queuing it behind the
+ * REDIS mutex, if MAX threads are waiting for the mutex already.
+ * This applies to redis_command(), redis_command_fast(),
+ * redis_command_deadline(), redis_exec() and redis_exec_deadline(),
+ * but not to redis_append() or the blocking commands on the lanes.
+ * If MAX is zero, there is no limit (the default).
+ *
+ * The number of waiting threads, and its peak, are in the statistics
+ * (see redis_stats_snapshot()), and the commands rejected here or by
+ * the try variants are counted in REDIS_COUNTER_REJECTED.
+ *
+ * Returns zero on success, -1 on failure (errno is set to EINVAL).
+ */
+int redis_set_max_waiters(REDIS *redis, int max);
+
+
+#ifdef _PTHREAD
+/*
+ * Configure the lanes for blocking commands.
+ *
+ * Blocking commands (BLPOP, BRPOP, BRPOPLPUSH, BLMOVE, BLMPOP,
+ * BZPOPMIN, BZPOPMAX, BZMPOP, and XREAD/XREADGROUP with BLOCK) sent
+ * via redis_command() or redis_command_fast() do not use the shared
+ * connection.  Instead, they run on a separate connection (a lane) to
+ * the same endpoints, so that they do not hold the REDIS lock while
+ * blocked.  Changing the endpoints closes the lanes; a lane in use is
+ * closed once its command returns.
+ *
+ * MAX is the number of idle lanes to keep; if every lane is busy, a
+ * new one is created and closed after use.  If MAX is zero, blocking
+ * commands use the shared connection as before.  The default is
+ * REDIS_LANES_DEFAULT, which is zero: lanes are used only once they
+ * are configured.
+ *
+ * WAIT and WAITAOF are not sent on lanes; they count the replicas
+ * acknowledging the writes of their own connection.
+ *
+ * If TIMEOUT is non-null, it is the operation timeout of the lanes
+ * instead of o_timeout of the hosts.  It should be longer than the
+ * timeout of the blocking commands.  If TIMEOUT is NULL, lanes have no
+ * operation timeout.
+ *
+ * Note that the command name is detected from the literal format
+ * string (or from the first argument if the format starts with
+ * "%s"), and that the BLOCK option of XREAD should be literal.
+ *
+ * Returns zero on success, -1 on failure (errno is set to EINVAL).
+ */
+int redis_set_blocking_lanes(REDIS *redis, int max,
+                             const struct timeval *timeout);
+
+/*
+ * Coalescing of identical reads
+ *
+ * If ON is nonzero, a read-only command (GET, MGET, HGETALL, LRANGE,
+ * ZRANGE, EXISTS, TTL, ...) sent via redis_command(),
+ * redis_command_fast() or redis_command_deadline() while the same
+ * command, with the same arguments, is waiting for the REDIS lock in
+ * another thread, is not sent again.  The later callers wait for the
+ * reply of the first one and return the very same redisReply,
+ * which is then shared; each caller still calls redis_free() on it,
+ * and the last one frees it.  A shared reply must not be modified.
+ * If the first command fails, the others fail with the same errno.
+ *
+ * Since the first command is sent after the later ones are called, a
+ * caller sees its own earlier writes.  Writes of other threads that
+ * race with the call may or may not be seen, as without coalescing.
+ * A command is never coalesced when the REDIS lock is free, or is
+ * held by the calling thread (see redis_lock()).
+ *
+ * A caller with a deadline does not wait for the first one beyond
+ * it.  Commands within a pipeline, or sent via the _unlocked or the
+ * try variants, are never coalesced.  The coalesced commands are
+ * counted in REDIS_COUNTER_COALESCED.  Coalescing is off by default,
+ * since it costs a formatting of the command per read.
+ *
+ * Returns zero.
+ */
+int redis_set_coalescing(REDIS *redis, int on);
+#endif  /* _PTHREAD */
 
 /*
  * A wrapper to redisAppendCommand().
@@ -213,6 +507,14 @@ int redis_append_unlocked(REDIS *redis, const char *format, ...)
 redisReply *redis_exec(REDIS *redis);
 redisReply *redis_exec_unlocked(REDIS *redis);
 
+/*
+ * Like redis_exec(), but fails with errno set to ETIMEDOUT unless the
+ * whole pipeline is done within TIMEOUT.  See
+ * redis_command_deadline().  If the mutex cannot be taken in time,
+ * the queued commands stay queued.
+ */
+redisReply *redis_exec_deadline(REDIS *redis, const struct timeval *timeout);
+
 /*
  * Start transaction, (a.k.a., redis MULTI command)
  *
@@ -262,10 +564,181 @@ redisReply *redis_multi_reply(REDIS *redis, redisReply *reply, int index);
  *
  * Note that it is okay to pass NULL to this function.  This way, you
  * always call redis_free() after calling either redis_command() or
- * redis_exec().
+ * redis_exec().  A shared reply (see redis_reply_retain() and
+ * redis_set_coalescing()) is freed by the last redis_free().
  */
 void redis_free(redisReply *reply);
 
+/*
+ * Shared replies
+ *
+ * redis_reply_retain() adds a reference to REPLY, so that it can be
+ * handed to another thread or kept in a cache without a copy.  Each
+ * reference is dropped by redis_free(), and the last one frees REPLY.
+ * A shared reply must be treated as immutable.
+ *
+ * redis_reply_slice() returns the INDEX-th element of the array
+ * REPLY (e.g. one reply of a pipeline from redis_exec()) as a reply
+ * of its own, without a copy.  The slice keeps the whole of REPLY
+ * alive until it is released with redis_free(), even if the owner of
+ * REPLY calls redis_free() on it first.  REPLY must be a reply from
+ * sredis (or a slice of it), not an element taken directly from one.
+ *
+ * Both return NULL on failure, with errno set (EINVAL or ENOMEM).
+ * The references are counted in a table guarded by striped locks, so
+ * these are safe to call from any thread.
+ */
+redisReply *redis_reply_retain(redisReply *reply);
+redisReply *redis_reply_slice(redisReply *reply, size_t index);
+
+/*
+ * Flat replies
+ *
+ * A wide array reply (e.g. HGETALL of a big hash) read as a tree of
+ * redisReply costs two allocations per element, and as many frees.
+ * redis_command_flat() reads the reply straight from the socket into
+ * a REDIS_FLAT instead: a single allocation holding an index of the
+ * items and their string payloads.  The items are the scalars of the
+ * reply in order; nested arrays (e.g. the [member, score] pairs of
+ * ZRANGE ... WITHSCORES in RESP3) are flattened, and a scalar reply
+ * is one item.  An error reply is an item of REDIS_REPLY_ERROR.
+ *
+ * redis_exec_flat() and redis_exec_flat_unlocked() read the replies
+ * of a pipeline (see redis_append()) into one REDIS_FLAT.  The items
+ * of the INDEX-th reply are from redis_flat_first(r, INDEX) up to
+ * redis_flat_first(r, INDEX + 1).
+ *
+ * They return NULL on failure, like redis_command() and redis_exec().
+ * Release the result with redis_flat_free().
+ */
+typedef struct redis_flat REDIS_FLAT;
+
+REDIS_FLAT *redis_command_flat(REDIS *redis, const char *format, ...)
+  __attribute__ ((format (printf, 2, 3)));
+REDIS_FLAT *redis_exec_flat(REDIS *redis);
+REDIS_FLAT *redis_exec_flat_unlocked(REDIS *redis);
+void redis_flat_free(REDIS_FLAT *r);
+
+/* the number of items */
+size_t redis_flat_count(const REDIS_FLAT *r);
+
+/* REDIS_REPLY_STRING, REDIS_REPLY_INTEGER, ..., or -1 if out of range */
+int redis_flat_type(const REDIS_FLAT *r, size_t index);
+
+/*
+ * The string of the INDEX-th item, which is NUL-terminated, and its
+ * length.  For a nil, an integer or a boolean, or if INDEX is out of
+ * range, it returns NULL (and the length is zero).
+ */
+const char *redis_flat_str(const REDIS_FLAT *r, size_t index);
+size_t redis_flat_len(const REDIS_FLAT *r, size_t index);
+
+/*
+ * The value of an integer or boolean item, or of a string item
+ * parsed with strtoll().  On error, it returns zero with errno set to
+ * EINVAL (or ERANGE).
+ */
+long long redis_flat_integer(const REDIS_FLAT *r, size_t index);
+
+/* the number of replies, and the first item of the INDEX-th one */
+size_t redis_flat_replies(const REDIS_FLAT *r);
+size_t redis_flat_first(const REDIS_FLAT *r, size_t index);
+
+/*
+ * Raw replies
+ *
+ * A reply that is passed through (e.g. proxied, or written to disk)
+ * without looking at most of it need not be decoded at all.
+ * redis_command_raw() returns the reply as its RESP bytes, copied
+ * verbatim from the socket; no redisReply is built.  The elements
+ * of an array reply are located on the first access, and decoded only
+ * when asked for.  RESP3 attributes are kept in the bytes, but the
+ * other functions look past them, at the item they describe.
+ *
+ * It returns NULL on failure, like redis_command().  Release the
+ * result with redis_raw_free().  The functions taking a non-const
+ * REDIS_RAW may build its index, so a REDIS_RAW should not be shared
+ * between threads without a lock.
+ */
+typedef struct redis_raw REDIS_RAW;
+
+REDIS_RAW *redis_command_raw(REDIS *redis, const char *format, ...)
+  __attribute__ ((format (printf, 2, 3)));
+void redis_raw_free(REDIS_RAW *r);
+
+/* the RESP bytes of the whole reply, e.g. to pass it through */
+const char *redis_raw_data(const REDIS_RAW *r, size_t *len);
+
+/* the type of the reply, as REDIS_REPLY_STRING, ... */
+int redis_raw_type(const REDIS_RAW *r);
+
+/* the number of elements (two per pair of a map), or -1 if not an array */
+long long redis_raw_elements(REDIS_RAW *r);
+
+/*
+ * The RESP bytes of the INDEX-th element, and the payload of it if it
+ * is a string, a status, an error, an integer or a double (not
+ * NUL-terminated).  Both point into R, and return NULL if there is
+ * no such element, or it is a nil or an array.
+ */
+const char *redis_raw_element_data(REDIS_RAW *r, size_t index, size_t *len);
+const char *redis_raw_str(REDIS_RAW *r, size_t index, size_t *len);
+
+/*
+ * Decode the INDEX-th element, or the whole reply, into a redisReply,
+ * which is released with redis_free().  Returns NULL on failure.
+ */
+redisReply *redis_raw_element(REDIS_RAW *r, size_t index);
+redisReply *redis_raw_decode(const REDIS_RAW *r);
+
+/*
+ * Streaming replies
+ *
+ * redis_command_parse() reads the reply without building anything:
+ * the callbacks of HANDLER are called with DATA for each item, as the
+ * item is parsed out of the socket buffer.  The strings passed to
+ * them point into that buffer; they are not NUL-terminated, and they
+ * are valid only during the call.  The callbacks must not use REDIS.
+ *
+ *   on_array_begin   an array, a set or a map, of ELEMENTS items (two
+ *                    per pair of a map); the items follow, then
+ *                    on_array_end.  An empty one calls both at once.
+ *                    A RESP3 attribute (REDIS_REPLY_ATTR) is reported
+ *                    the same way, before the item it describes; it
+ *                    is not counted in the ELEMENTS around it.
+ *   on_bulk          a string, a status, a double, a big number or a
+ *                    verbatim string; TYPE is REDIS_REPLY_STRING, ...
+ *   on_integer       an integer, or a boolean (0 or 1)
+ *   on_nil           a nil, including a nil array
+ *   on_error         an error reply
+ *
+ * Any of them may be NULL, to skip such items.
+ *
+ * redis_exec_parse() and redis_exec_parse_unlocked() do the same for
+ * the replies of a pipeline (see redis_append()), one after another.
+ *
+ * They return zero on success, or -1 on failure.  An error reply is
+ * not a failure; it goes to on_error.  On failure, the callbacks may
+ * have been called for a part of the replies already.
+ */
+struct redis_parse_handler {
+  void (*on_array_begin)(void *data, int type, long long elements);
+  void (*on_array_end)(void *data);
+  void (*on_bulk)(void *data, int type, const char *str, size_t len);
+  void (*on_integer)(void *data, long long value);
+  void (*on_nil)(void *data);
+  void (*on_error)(void *data, const char *str, size_t len);
+};
+
+int redis_command_parse(REDIS *redis, const struct redis_parse_handler *handler,
+                        void *data, const char *format, ...)
+  __attribute__ ((format (printf, 4, 5)));
+int redis_exec_parse(REDIS *redis, const struct redis_parse_handler *handler,
+                     void *data);
+int redis_exec_parse_unlocked(REDIS *redis,
+                              const struct redis_parse_handler *handler,
+                              void *data);
+
 /*
  * Check if the redisReply from either redis_command() or redis_exec()
  * whether the reply failed.
@@ -292,6 +765,557 @@ void redis_dump_reply(const redisReply *reply,
  */
 long long redis_reply_integer(redisReply *reply);
 
+/*
+ * Convenient function to get the floating point value from the
+ * redisReply.
+ *
+ * RESP3 doubles are returned as they are.  Integers and booleans are
+ * converted, and strings are parsed with strtod().
+ *
+ * On error, it returns zero, and errno is set like
+ * redis_reply_integer().
+ */
+double redis_reply_double(redisReply *reply);
+
+/*
+ * Access field/value pairs of a reply regardless of the protocol.
+ *
+ * Commands like HGETALL or CONFIG GET return a REDIS_REPLY_MAP in
+ * RESP3, and a flat REDIS_REPLY_ARRAY in RESP2.  ZRANGE ... WITHSCORES
+ * returns an array of [member, score] arrays in RESP3.  These
+ * functions hide the difference:
+ *
+ *   for (i = 0; i < redis_reply_pairs(reply); i++) {
+ *     redisReply *field = redis_reply_key(reply, i);
+ *     redisReply *value = redis_reply_value(reply, i);
+ *     ...
+ *   }
+ *
+ * redis_reply_key() and redis_reply_value() return NULL if INDEX is
+ * out of bound.
+ */
+size_t redis_reply_pairs(const redisReply *reply);
+redisReply *redis_reply_key(const redisReply *reply, size_t index);
+redisReply *redis_reply_value(const redisReply *reply, size_t index);
+
+
+/*
+ * Latency statistics
+ *
+ * Every command sent by redis_command() and its friends, and every
+ * pipeline sent by redis_exec(), is timed in the phases below.  The
+ * times are recorded in histograms, keyed by the command name (all
+ * pipelines share the name "(pipeline)"), and by the endpoint.
+ */
+enum {
+  REDIS_PHASE_LOCK,             /* waiting for the REDIS mutex */
+  REDIS_PHASE_WRITE,            /* sending the request */
+  REDIS_PHASE_WAIT,             /* until the reply starts to arrive */
+  REDIS_PHASE_PARSE,            /* reading the rest, and parsing */
+  REDIS_PHASE_MAX,
+};
+
+/* 16 buckets for each power of two, up to 2^40 nanoseconds */
+#define REDIS_HIST_BUCKETS      592
+
+struct redis_histogram {
+  unsigned long long count;
+  unsigned long long sum;       /* in nanoseconds */
+  unsigned long long max;
+  unsigned long long buckets[REDIS_HIST_BUCKETS];
+};
+
+/*
+ * Counters, kept for each REDIS and for each endpoint.  They are
+ * 64-bit, and updated atomically.
+ */
+enum {
+  REDIS_COUNTER_COMMANDS,       /* commands, including pipelined ones */
+  REDIS_COUNTER_PIPELINED,      /* commands sent by redis_exec() */
+  REDIS_COUNTER_BYTES_IN,
+  REDIS_COUNTER_BYTES_OUT,
+  REDIS_COUNTER_CONNECTS,       /* successful connections */
+  REDIS_COUNTER_CONNECT_FAILURES,
+  REDIS_COUNTER_RECONNECTS,
+  REDIS_COUNTER_FAILOVERS,      /* reconnected to other endpoint */
+  REDIS_COUNTER_READONLY,       /* -READONLY replies */
+  REDIS_COUNTER_TIMEOUTS,
+  REDIS_COUNTER_ERRORS,         /* error replies */
+  REDIS_COUNTER_REJECTED,       /* not sent since REDIS was busy */
+  REDIS_COUNTER_COALESCED,      /* answered by an identical command */
+  REDIS_COUNTER_MAX,
+};
+
+struct redis_latency {
+  char name[64];                /* the command, or "host:port" */
+  struct redis_histogram phase[REDIS_PHASE_MAX];
+  unsigned long long counters[REDIS_COUNTER_MAX];  /* endpoints only */
+};
+
+struct redis_stats_snapshot {
+  unsigned long long counters[REDIS_COUNTER_MAX];
+  int waiters;                  /* threads waiting for the REDIS mutex */
+  int waiters_peak;             /* since the last redis_stats_reset() */
+  struct redis_latency *commands;
+  size_t ncommands;
+  struct redis_latency *hosts;
+  size_t nhosts;
+};
+
+/*
+ * Copy the current statistics of REDIS into SNAP, which should be
+ * released by redis_stats_snapshot_free().  Returns zero on success.
+ *
+ * The counters are read without stopping other threads, so a
+ * snapshot may include a command partially.
+ */
+int redis_stats_snapshot(REDIS *redis, struct redis_stats_snapshot *snap);
+void redis_stats_snapshot_free(struct redis_stats_snapshot *snap);
+
+/*
+ * Clear the statistics of REDIS.  Safe to call while other threads
+ * are sending commands.
+ */
+void redis_stats_reset(REDIS *redis);
+
+/*
+ * Return the value (in nanoseconds) at PERCENTILE (e.g. 99.9) of H.
+ * The value is accurate to 1/16.
+ */
+unsigned long long redis_histogram_value(const struct redis_histogram *h,
+                                         double percentile);
+
+/*
+ * Record VALUE (in nanoseconds) in H, for applications that keep
+ * their own histograms.  H should be zero-filled before the first use.
+ */
+void redis_histogram_add(struct redis_histogram *h, unsigned long long value);
+
+/*
+ * Return the statistics of REDIS in the Prometheus text format, in a
+ * buffer allocated by malloc(3).  The metric names start with PREFIX
+ * ("sredis" if NULL).  The counters are exported per endpoint, and as
+ * the totals of the client (PREFIX_client_*), which also count what
+ * no endpoint is charged for (e.g. rejected commands).  Latencies are
+ * exported as summaries.
+ *
+ * Returns NULL on failure.
+ */
+char *redis_stats_prometheus(REDIS *redis, const char *prefix);
+
+
+/*
+ * Slow command log
+ *
+ * Commands (and pipelines) that took longer than a threshold, from
+ * waiting for the REDIS mutex to the reply, including the time spent
+ * reconnecting, are recorded in a ring of the last REDIS_SLOWLOG_LEN
+ * entries.  Unlike SLOWLOG of the server, this includes the time on
+ * the network and in the client.
+ */
+#define REDIS_SLOWLOG_LEN       128
+#define REDIS_SLOWLOG_ARGS      8
+#define REDIS_SLOWLOG_ARG_MAX   32
+
+struct redis_slowlog_entry {
+  unsigned long long id;
+  struct timeval time;          /* when it finished */
+  char endpoint[64];
+  size_t commands;              /* more than 1 for a pipeline */
+  int argc;                     /* of the (first) command */
+  char argv[REDIS_SLOWLOG_ARGS][REDIS_SLOWLOG_ARG_MAX];  /* truncated */
+  unsigned long long phase[REDIS_PHASE_MAX];
+  unsigned long long reconnect_ns;
+  unsigned long long total_ns;
+};
+
+/*
+ * Record commands slower than THRESHOLD.  If THRESHOLD is NULL, stop
+ * recording (the default).
+ */
+void redis_set_slowlog(REDIS *redis, const struct timeval *threshold);
+
+/*
+ * Copy at most MAX entries, the newest first, into ENTRIES.  Returns
+ * the number of entries copied.
+ */
+size_t redis_slowlog_get(REDIS *redis, struct redis_slowlog_entry *entries,
+                         size_t max);
+
+/*
+ * Print the entries to FP, the newest first.
+ */
+void redis_slowlog_dump(REDIS *redis, FILE *fp);
+
+/*
+ * Forget the entries recorded so far.
+ */
+void redis_slowlog_reset(REDIS *redis);
+
+
+/*
+ * Client-side sharding
+ *
+ * A REDIS_SHARD spreads the keys over several independent groups of
+ * servers (shards).  Each shard is a REDIS, so it keeps its own
+ * endpoints and the master lookup of a group.
+ *
+ * Keys are mapped to the shards by consistent hashing: every shard
+ * has REDIS_SHARD_POINTS points per weight on a ring of 32-bit
+ * hashes, and a key belongs to the shard of the first point at or
+ * after the hash of the key.  Adding a shard moves only the keys that
+ * the new shard takes over, about 1/N of them.  The points depend
+ * only on the names of the shards, not on the order of addition.
+ *
+ * If a key contains "{...}" with at least one character in between,
+ * only the part between the first '{' and the next '}' is hashed, like
+ * the hash tags of Redis Cluster, so "{user:42}:name" and
+ * "{user:42}:mail" are always on the same shard.
+ */
+#define REDIS_SHARDS_MAX        64
+#define REDIS_SHARD_POINTS      160
+
+typedef struct redis_shard REDIS_SHARD;
+
+REDIS_SHARD *redis_shard_new(void);
+
+/*
+ * Close every shard, and release S.
+ */
+void redis_shard_close(REDIS_SHARD *s);
+
+/*
+ * Add REDIS as the shard NAME with WEIGHT (1 if zero).  S owns REDIS
+ * after this call.  It is okay to add a shard while other threads
+ * are sending commands through S.
+ *
+ * Returns the index of the shard on success.  On failure, it returns
+ * -1 with errno set; EEXIST if NAME is already used, ENOSPC if there
+ * are REDIS_SHARDS_MAX shards already.
+ */
+int redis_shard_add(REDIS_SHARD *s, const char *name, REDIS *redis,
+                    unsigned weight);
+
+/*
+ * Return the number of shards, and the INDEX-th shard (NULL if out of
+ * bound), e.g. to send FLUSHALL to every shard.
+ */
+int redis_shard_count(REDIS_SHARD *s);
+REDIS *redis_shard_at(REDIS_SHARD *s, int index);
+
+/*
+ * Return the shard of KEY, of LEN bytes, or NULL if S has no shard.
+ */
+REDIS *redis_shard_get(REDIS_SHARD *s, const char *key, size_t len);
+
+/*
+ * redis_command() and redis_append() on the shard of the first
+ * argument of the command (the key).  Commands without an argument,
+ * like PING, go to the first shard.  A command with several keys is
+ * sent to the shard of its first key.
+ *
+ * The key is taken from FORMAT if it is literal, or from the
+ * arguments if it is "%s" or "%b".  Otherwise the command is
+ * formatted once more to find the key.
+ */
+redisReply *redis_shard_command(REDIS_SHARD *s, const char *format, ...)
+  __attribute__ ((format (printf, 2, 3)));
+int redis_shard_append(REDIS_SHARD *s, const char *format, ...)
+  __attribute__ ((format (printf, 2, 3)));
+
+/*
+ * Execute the commands queued by redis_shard_append() on every shard
+ * involved, and return their replies in the order of the calls, like
+ * redis_exec().  If any shard fails, it returns NULL.
+ *
+ * Like the pipeline of a REDIS, the pipeline of S should be built by
+ * one thread at a time.  Transactions cannot span shards.
+ */
+redisReply *redis_shard_exec(REDIS_SHARD *s);
+
+/*
+ * MGET, MSET and DEL of N keys spread over the shards.
+ *
+ * The keys are split by shard, and one command is sent to each shard
+ * involved.  All of them are sent before reading any reply, so the
+ * latency is that of the slowest shard.  The same applies to
+ * redis_shard_exec().
+ *
+ * KEYLENS (and VALUELENS) may be NULL if the keys (values) are
+ * strings.  The replies are merged as if the command were sent to a
+ * single server: an array in the order of KEYS for MGET, "OK" for
+ * MSET, and the number of keys deleted for DEL.  If a shard returns
+ * an error reply, it is returned instead.  If any shard fails, NULL
+ * is returned.
+ *
+ * If a shard involved has commands queued by redis_shard_append() (or
+ * redis_append()), NULL is returned with errno set to EBUSY, and the
+ * queued commands are left as they are; call redis_shard_exec() first.
+ *
+ * Note that MSET is atomic only within each shard.
+ */
+redisReply *redis_shard_mget(REDIS_SHARD *s, size_t n,
+                             const char **keys, const size_t *keylens);
+redisReply *redis_shard_mset(REDIS_SHARD *s, size_t n,
+                             const char **keys, const size_t *keylens,
+                             const char **values, const size_t *valuelens);
+redisReply *redis_shard_del(REDIS_SHARD *s, size_t n,
+                            const char **keys, const size_t *keylens);
+
+
+#ifdef _PTHREAD
+/*
+ * Pub/Sub subscriber
+ *
+ * SUBSCRIBE puts a connection in the subscribed state, so it cannot
+ * be issued via redis_command().  A subscriber owns a dedicated
+ * connection (see redis_dup()), and runs two threads; one reads the
+ * messages from the connection, and the other calls the handlers.
+ * When the connection is lost, the subscriber reconnects using the
+ * same endpoints (including the master lookup), and subscribes all
+ * channels and patterns again.
+ *
+ * Note that the handlers are called from the dispatcher thread.  It
+ * is okay to call redis_subscribe() and friends from a handler.
+ */
+typedef struct redis_sub REDIS_SUB;
+
+/*
+ * Message handler.
+ *
+ * PATTERN is NULL unless the message is matched by
+ * redis_psubscribe().  MESSAGE is valid only during the call.
+ */
+typedef void (*redis_sub_handler)(REDIS_SUB *sub,
+                                  const char *channel,
+                                  const char *pattern,
+                                  const char *message, size_t len,
+                                  void *data);
+
+struct redis_sub_stats {
+  unsigned long long received;  /* messages read from the server */
+  unsigned long long dispatched; /* messages passed to the handlers */
+  unsigned long long unmatched; /* messages with no handler */
+  unsigned long long reconnects;
+};
+
+/*
+ * Create a subscriber using the connection information of REDIS.
+ *
+ * REDIS is not used after this call, so it can be closed anytime.
+ */
+REDIS_SUB *redis_sub_new(REDIS *redis);
+
+/*
+ * Stop the threads, close the connection, and release SUB.
+ */
+void redis_sub_close(REDIS_SUB *sub);
+
+/*
+ * Subscribe CHANNEL (or PATTERN), and call HANDLER for each message.
+ *
+ * The request is sent asynchronously by the reader thread.  If
+ * already subscribed, only HANDLER and DATA are replaced.
+ *
+ * Returns zero on success, -1 on failure.
+ */
+int redis_subscribe(REDIS_SUB *sub, const char *channel,
+                    redis_sub_handler handler, void *data);
+int redis_psubscribe(REDIS_SUB *sub, const char *pattern,
+                     redis_sub_handler handler, void *data);
+
+/*
+ * Unsubscribe CHANNEL (or PATTERN).
+ *
+ * Returns zero on success.  If it was not subscribed, it returns -1
+ * with errno set to ENOENT.
+ */
+int redis_unsubscribe(REDIS_SUB *sub, const char *channel);
+int redis_punsubscribe(REDIS_SUB *sub, const char *pattern);
+
+void redis_sub_get_stats(REDIS_SUB *sub, struct redis_sub_stats *stats);
+
+/*
+ * Reliable queue
+ *
+ * Jobs are pushed to the list NAME.  A consumer pops a batch of jobs
+ * in one round trip, moving them atomically to its own processing
+ * list ("NAME:processing:CONSUMER").  Acknowledged jobs are removed
+ * from the processing list in batches, with one pipelined round trip.
+ *
+ * If a job is not acknowledged within the lease time, a background
+ * reaper gives the job back to the queue, so that it is delivered
+ * again (at-least-once delivery).  Jobs left by a crashed consumer
+ * are given back by redis_queue_recover() of the consumer with the
+ * same name.
+ *
+ * All commands go through the REDIS given to redis_queue_new(), so
+ * that a master switch is handled as usual.
+ */
+typedef struct redis_queue REDIS_QUEUE;
+
+struct redis_job {
+  const char *data;             /* valid until acknowledged */
+  size_t len;
+  unsigned long long id;        /* opaque */
+};
+
+/*
+ * Create a consumer named CONSUMER for the queue NAME.
+ *
+ * If LEASE is non-null and non-zero, the jobs that are not
+ * acknowledged within LEASE are given back to the queue by the
+ * reaper thread.
+ *
+ * REDIS should not be closed before the queue.
+ */
+REDIS_QUEUE *redis_queue_new(REDIS *redis, const char *name,
+                             const char *consumer,
+                             const struct timeval *lease);
+
+/*
+ * Flush pending acknowledgements, stop the reaper, and release Q.
+ *
+ * Unacknowledged jobs stay in the processing list.
+ */
+void redis_queue_close(REDIS_QUEUE *q);
+
+/*
+ * Push a job to the queue.  Returns zero on success, -1 on failure.
+ */
+int redis_queue_push(REDIS_QUEUE *q, const void *data, size_t len);
+
+/*
+ * Pop at most COUNT jobs into JOBS.
+ *
+ * Returns the number of jobs popped, which is zero if the queue is
+ * empty.  Returns -1 on failure.
+ *
+ * It does not block.  When it returns zero, wait for a while of your
+ * choice (e.g. 100ms) before polling again.
+ */
+int redis_queue_pop(REDIS_QUEUE *q, struct redis_job *jobs, int count);
+
+/*
+ * Acknowledge JOB.
+ *
+ * Acknowledgements are buffered, and sent when the number of them
+ * reaches the batch size (see redis_queue_set_ack_batch()), or when
+ * redis_queue_flush() is called.  JOB->data is not valid after this
+ * call.
+ *
+ * Returns -1 with errno set to ESTALE if JOB was already acknowledged
+ * or given back to the queue because its lease expired.
+ */
+int redis_queue_ack(REDIS_QUEUE *q, const struct redis_job *job);
+
+/*
+ * Give JOB back to the queue immediately.
+ */
+int redis_queue_nack(REDIS_QUEUE *q, const struct redis_job *job);
+
+/*
+ * Send the buffered acknowledgements.  On failure, they are kept for
+ * the next flush and -1 is returned.
+ */
+int redis_queue_flush(REDIS_QUEUE *q);
+
+/*
+ * Set the number of acknowledgements sent in one round trip.
+ */
+int redis_queue_set_ack_batch(REDIS_QUEUE *q, size_t n);
+
+/*
+ * Give every job in the processing list of this consumer back to the
+ * queue.  Call this on startup, before popping.
+ *
+ * Returns the number of jobs given back, or -1 on failure.
+ */
+int redis_queue_recover(REDIS_QUEUE *q);
+
+/*
+ * Stream consumer group
+ *
+ * A consumer named CONSUMER of the group GROUP of the stream KEY.  It
+ * reads with XREADGROUP on its own connection, so a blocking read
+ * does not block other users of the REDIS given to redis_stream_new().
+ *
+ * Acknowledgements are buffered, and sent in the same round trip with
+ * the next read.  Optionally, the entries that stayed pending (in any
+ * consumer of the group) longer than a given time are claimed with
+ * XAUTOCLAIM, and returned by redis_stream_read().
+ *
+ * A REDIS_STREAM should be used by one thread at a time.
+ */
+typedef struct redis_stream REDIS_STREAM;
+
+struct redis_stream_field {
+  const char *name;
+  size_t name_len;
+  const char *value;
+  size_t value_len;
+};
+
+struct redis_stream_entry {
+  const char *id;
+  const struct redis_stream_field *fields;
+  size_t nfields;
+};
+
+/*
+ * Create a consumer.  The group is created (with MKSTREAM) if it does
+ * not exist, starting from the end of the stream.
+ *
+ * A read blocks up to BLOCK if there is no new entry.  If BLOCK is
+ * NULL, or zero, a read blocks until an entry arrives, and the
+ * connection of the consumer has no operation timeout at all.
+ */
+REDIS_STREAM *redis_stream_new(REDIS *redis, const char *key,
+                               const char *group, const char *consumer,
+                               const struct timeval *block);
+
+/*
+ * Send pending acknowledgements, and release S.
+ */
+void redis_stream_close(REDIS_STREAM *s);
+
+/*
+ * Read at most COUNT new (or claimed) entries.  On success, *ENTRIES
+ * points to the entries, which are valid until the next call of
+ * redis_stream_read() or redis_stream_close().
+ *
+ * Returns the number of entries, zero if timed out, or -1 on failure.
+ */
+int redis_stream_read(REDIS_STREAM *s,
+                      const struct redis_stream_entry **entries, int count);
+
+/*
+ * Acknowledge the entry ID.
+ *
+ * The acknowledgement is sent with the next read, or by itself when
+ * the number of pending ones reaches the batch size.
+ */
+int redis_stream_ack(REDIS_STREAM *s, const char *id);
+
+/*
+ * Send pending acknowledgements now.
+ */
+int redis_stream_flush(REDIS_STREAM *s);
+
+/*
+ * Set the number of pending acknowledgements that triggers a flush.
+ */
+int redis_stream_set_ack_batch(REDIS_STREAM *s, size_t n);
+
+/*
+ * Claim the entries that are pending longer than MIN_IDLE, every
+ * INTERVAL.  If MIN_IDLE is NULL or zero, claiming is disabled (the
+ * default).
+ */
+int redis_stream_set_claim(REDIS_STREAM *s, const struct timeval *min_idle,
+                           const struct timeval *interval);
+#endif  /* _PTHREAD */
+
 END_C_DECLS
 
 #endif  /* SREDIS_H__ */
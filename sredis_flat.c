@@ -0,0 +1,445 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "sredis.h"
+#include "sredis_private.h"
+
+/*
+ * Flat replies.
+ *
+ * While a flat reply is read, the reply object functions of the
+ * hiredis reader are replaced with the ones below, which append each
+ * scalar to two growing buffers (the items and the string payloads)
+ * instead of allocating a redisReply per element.  When the whole
+ * reply (or pipeline) is read, redis_flat_seal() packs both into one
+ * allocation.
+ *
+ * The reader still needs an object per reply and per nested array;
+ * every one of them is TOP of the builder, which mirrors the type of
+ * the current top-level reply, so that the callers in sredis.c can
+ * check the reply as usual.  Its ELEMENT is set to flat_mark, so that
+ * flat_free() can tell it from a real redisReply.
+ *
+ * Push replies of RESP3 are not ours; they are built by the original
+ * functions of the reader, so that they are dispatched as before.
+ */
+
+#define FLAT_ALIGN(n)   (((n) + sizeof(long long) - 1) & ~(sizeof(long long) - 1))
+
+struct redis_flat_item {
+  int type;
+  size_t len;
+  union {
+    size_t off;                 /* of the string in DATA */
+    long long integer;          /* REDIS_REPLY_INTEGER, REDIS_REPLY_BOOL */
+  } u;
+};
+
+struct redis_flat {
+  size_t count;
+  size_t replies;
+  const struct redis_flat_item *items;
+  const size_t *first;          /* the first item of each reply */
+  const char *data;
+};
+
+struct redis_flat_build {
+  redisReply top;               /* see above */
+  redisReplyObjectFunctions fn;
+
+  /* of the reader, while attached */
+  redisReplyObjectFunctions *saved_fn;
+  void *saved_privdata;
+
+  struct redis_flat_item *items;
+  size_t count;
+  size_t items_size;
+
+  char *data;
+  size_t used;
+  size_t data_size;
+
+  size_t *first;
+  size_t replies;
+  size_t first_size;
+};
+
+static redisReply *flat_mark[1];
+
+
+static int
+flat_mine(const redisReadTask *task, struct redis_flat_build *b)
+{
+  if (task->parent)
+    return task->parent->obj == &b->top;
+  return task->type != REDIS_REPLY_PUSH;
+}
+
+
+static int
+flat_grow(void **buf, size_t *size, size_t need, size_t elem)
+{
+  size_t n = *size ? *size : 16;
+  void *p;
+
+  if (need <= *size)
+    return 0;
+  while (n < need)
+    n *= 2;
+  p = realloc(*buf, n * elem);
+  if (!p)
+    return -1;
+  *buf = p;
+  *size = n;
+  return 0;
+}
+
+
+/* Start a new reply if TASK is a top-level one. */
+static int
+flat_begin(const redisReadTask *task, struct redis_flat_build *b)
+{
+  if (task->parent)
+    return 0;
+
+  if (flat_grow((void **)&b->first, &b->first_size, b->replies + 1,
+                sizeof(*b->first)) != 0)
+    return -1;
+  b->first[b->replies++] = b->count;
+  memset(&b->top, 0, sizeof(b->top));
+  b->top.type = task->type;
+  b->top.element = flat_mark;
+  return 0;
+}
+
+
+/* Append a new item for TASK.  Returns the item, or NULL on failure. */
+static struct redis_flat_item *
+flat_item(const redisReadTask *task, struct redis_flat_build *b, int type)
+{
+  struct redis_flat_item *item;
+
+  if (flat_begin(task, b) != 0 ||
+      flat_grow((void **)&b->items, &b->items_size, b->count + 1,
+                sizeof(*b->items)) != 0)
+    return NULL;
+  item = &b->items[b->count++];
+  item->type = type;
+  item->len = 0;
+  item->u.integer = 0;
+  return item;
+}
+
+
+static void *
+flat_string_item(const redisReadTask *task, struct redis_flat_build *b,
+                 int type, const char *str, size_t len)
+{
+  struct redis_flat_item *item = flat_item(task, b, type);
+
+  if (!item ||
+      flat_grow((void **)&b->data, &b->data_size, b->used + len + 1, 1) != 0)
+    return NULL;
+
+  item->len = len;
+  item->u.off = b->used;
+  memcpy(b->data + b->used, str, len);
+  b->data[b->used + len] = '\0';
+  b->used += len + 1;
+
+  if (!task->parent) {
+    b->top.str = b->data + item->u.off;
+    b->top.len = len;
+  }
+  return &b->top;
+}
+
+
+static void *
+flat_create_string(const redisReadTask *task, char *str, size_t len)
+{
+  struct redis_flat_build *b = task->privdata;
+
+  if (!flat_mine(task, b))
+    return b->saved_fn->createString(task, str, len);
+
+  if (task->type == REDIS_REPLY_VERB && len >= 4) {
+    str += 4;                   /* "txt:" */
+    len -= 4;
+  }
+  return flat_string_item(task, b, task->type, str, len);
+}
+
+
+static void *
+flat_create_array(const redisReadTask *task, size_t elements)
+{
+  struct redis_flat_build *b = task->privdata;
+
+  if (!flat_mine(task, b))
+    return b->saved_fn->createArray(task, elements);
+
+  /* no item of its own; make room for the elements */
+  if (flat_begin(task, b) != 0 ||
+      flat_grow((void **)&b->items, &b->items_size, b->count + elements,
+                sizeof(*b->items)) != 0)
+    return NULL;
+  return &b->top;
+}
+
+
+static void *
+flat_create_integer(const redisReadTask *task, long long value)
+{
+  struct redis_flat_build *b = task->privdata;
+  struct redis_flat_item *item;
+
+  if (!flat_mine(task, b))
+    return b->saved_fn->createInteger(task, value);
+
+  item = flat_item(task, b, REDIS_REPLY_INTEGER);
+  if (!item)
+    return NULL;
+  item->u.integer = value;
+  if (!task->parent)
+    b->top.integer = value;
+  return &b->top;
+}
+
+
+static void *
+flat_create_double(const redisReadTask *task, double value, char *str,
+                   size_t len)
+{
+  struct redis_flat_build *b = task->privdata;
+
+  if (!flat_mine(task, b))
+    return b->saved_fn->createDouble(task, value, str, len);
+
+  if (!task->parent)
+    b->top.dval = value;
+  return flat_string_item(task, b, REDIS_REPLY_DOUBLE, str, len);
+}
+
+
+static void *
+flat_create_nil(const redisReadTask *task)
+{
+  struct redis_flat_build *b = task->privdata;
+
+  if (!flat_mine(task, b))
+    return b->saved_fn->createNil(task);
+
+  return flat_item(task, b, REDIS_REPLY_NIL) ? &b->top : NULL;
+}
+
+
+static void *
+flat_create_bool(const redisReadTask *task, int value)
+{
+  struct redis_flat_build *b = task->privdata;
+  struct redis_flat_item *item;
+
+  if (!flat_mine(task, b))
+    return b->saved_fn->createBool(task, value);
+
+  item = flat_item(task, b, REDIS_REPLY_BOOL);
+  if (!item)
+    return NULL;
+  item->u.integer = (value != 0);
+  if (!task->parent)
+    b->top.integer = item->u.integer;
+  return &b->top;
+}
+
+
+static void
+flat_free(void *obj)
+{
+  redisReply *reply = obj;
+
+  if (reply && reply->element != flat_mark)
+    freeReplyObject(reply);
+}
+
+
+struct redis_flat_build *
+redis_flat_build_new(void)
+{
+  struct redis_flat_build *b = calloc(1, sizeof(*b));
+
+  if (!b)
+    return NULL;
+
+  b->fn.createString = flat_create_string;
+  b->fn.createArray = flat_create_array;
+  b->fn.createInteger = flat_create_integer;
+  b->fn.createDouble = flat_create_double;
+  b->fn.createNil = flat_create_nil;
+  b->fn.createBool = flat_create_bool;
+  b->fn.freeObject = flat_free;
+  return b;
+}
+
+
+void
+redis_flat_build_free(struct redis_flat_build *b)
+{
+  if (!b)
+    return;
+  free(b->items);
+  free(b->data);
+  free(b->first);
+  free(b);
+}
+
+
+void
+redis_flat_attach(struct redis_flat_build *b, redisReader *reader)
+{
+  b->saved_fn = reader->fn;
+  b->saved_privdata = reader->privdata;
+  reader->fn = &b->fn;
+  reader->privdata = b;
+}
+
+
+int
+redis_flat_detach(struct redis_flat_build *b, redisReader *reader)
+{
+  if (reader->ridx >= 0)
+    return -1;                  /* a reply is half-read */
+
+  reader->fn = b->saved_fn;
+  reader->privdata = b->saved_privdata;
+  return 0;
+}
+
+
+REDIS_FLAT *
+redis_flat_seal(struct redis_flat_build *b)
+{
+  REDIS_FLAT *flat;
+  size_t items_at, first_at, data_at, size;
+  char *p;
+
+  items_at = FLAT_ALIGN(sizeof(*flat));
+  first_at = FLAT_ALIGN(items_at + b->count * sizeof(*b->items));
+  data_at = first_at + (b->replies + 1) * sizeof(*b->first);
+  size = data_at + b->used;
+
+  p = malloc(size);
+  if (!p)
+    return NULL;
+  flat = (REDIS_FLAT *)p;
+
+  flat->count = b->count;
+  flat->replies = b->replies;
+  flat->items = (struct redis_flat_item *)(p + items_at);
+  flat->first = (size_t *)(p + first_at);
+  flat->data = p + data_at;
+
+  memcpy(p + items_at, b->items, b->count * sizeof(*b->items));
+  memcpy(p + first_at, b->first, b->replies * sizeof(*b->first));
+  ((size_t *)(p + first_at))[b->replies] = b->count;
+  memcpy(p + data_at, b->data, b->used);
+  return flat;
+}
+
+
+size_t
+redis_flat_count(const REDIS_FLAT *flat)
+{
+  return flat->count;
+}
+
+
+int
+redis_flat_type(const REDIS_FLAT *flat, size_t index)
+{
+  if (index >= flat->count)
+    return -1;
+  return flat->items[index].type;
+}
+
+
+size_t
+redis_flat_len(const REDIS_FLAT *flat, size_t index)
+{
+  if (index >= flat->count)
+    return 0;
+  return flat->items[index].len;
+}
+
+
+const char *
+redis_flat_str(const REDIS_FLAT *flat, size_t index)
+{
+  const struct redis_flat_item *item;
+
+  if (index >= flat->count)
+    return NULL;
+  item = &flat->items[index];
+  switch (item->type) {
+  case REDIS_REPLY_NIL:
+  case REDIS_REPLY_INTEGER:
+  case REDIS_REPLY_BOOL:
+    return NULL;
+  default:
+    return flat->data + item->u.off;
+  }
+}
+
+
+long long
+redis_flat_integer(const REDIS_FLAT *flat, size_t index)
+{
+  const char *str;
+  char *end;
+  long long value;
+
+  if (index >= flat->count) {
+    errno = EINVAL;
+    return 0;
+  }
+  if (flat->items[index].type == REDIS_REPLY_INTEGER ||
+      flat->items[index].type == REDIS_REPLY_BOOL)
+    return flat->items[index].u.integer;
+
+  str = redis_flat_str(flat, index);
+  if (!str) {
+    errno = EINVAL;
+    return 0;
+  }
+  errno = 0;
+  value = strtoll(str, &end, 10);
+  if (end == str || *end != '\0') {
+    errno = EINVAL;
+    return 0;
+  }
+  return value;
+}
+
+
+size_t
+redis_flat_replies(const REDIS_FLAT *flat)
+{
+  return flat->replies;
+}
+
+
+size_t
+redis_flat_first(const REDIS_FLAT *flat, size_t reply)
+{
+  if (reply > flat->replies)
+    reply = flat->replies;
+  return flat->first[reply];
+}
+
+
+void
+redis_flat_free(REDIS_FLAT *flat)
+{
+  free(flat);
+}
@@ -0,0 +1,1106 @@
+#include <assert.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <pthread.h>
+
+#include "sredis_mock.h"
+#include "xerror.h"
+
+#define MOCK_HOST               "127.0.0.1"
+#define MOCK_VERSION            "6.2.0"
+#define MOCK_BACKLOG            128
+#define MOCK_CLIENTS_MAX        1024
+#define MOCK_ARGS_MAX           1024    /* for MGET and MSET */
+#define MOCK_READ_SIZE          16384
+#define MOCK_BUCKETS_MIN        1024
+#define MOCK_ERROR_MAX          256
+
+#define ERR_READONLY    "READONLY You can't write against a read only replica."
+
+enum { CTL_NONE, CTL_DROP, CTL_STOP, CTL_START, CTL_QUIT };
+
+struct mock_buf {
+  char *data;
+  size_t len;
+  size_t size;
+};
+
+struct mock_client {
+  int fd;
+  int closing;                  /* close after OUT is written */
+  struct mock_buf in;
+  struct mock_buf out;
+  size_t out_pos;               /* written bytes of OUT */
+};
+
+struct mock_entry {
+  struct mock_entry *next;
+  unsigned hash;
+  char *key;
+  size_t key_len;
+  char *value;
+  size_t value_len;
+};
+
+struct redis_mock {
+  pthread_t thread;
+
+  /* Only the server thread touches the sockets; other threads ask it
+   * through CTL and WAKEUP.  CTL_MUTEX serializes those requests. */
+  pthread_mutex_t ctl_mutex;
+  pthread_mutex_t mutex;        /* protects the members up to ERROR */
+  pthread_cond_t cond;
+  int ctl;
+  int ctl_ret;
+  int ctl_errno;
+
+  char *master_host;            /* NULL if this is the master */
+  int master_port;
+  unsigned latency;             /* in usec */
+  char error[MOCK_ERROR_MAX];
+  int error_count;
+
+  int wakeup[2];
+  char *host;
+  int port;
+  int listener;                 /* -1 if stopped */
+
+  struct mock_client *clients[MOCK_CLIENTS_MAX];
+  int nclients;
+
+  struct mock_entry **buckets;
+  size_t nbuckets;
+  size_t nkeys;
+
+  unsigned long long commands;
+};
+
+static void *mock_main(void *arg);
+
+
+static int
+mock_nonblock(int fd)
+{
+  int flags = fcntl(fd, F_GETFL);
+
+  if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+    return -1;
+  return 0;
+}
+
+
+/*
+ * Open the listening socket on M->host:M->port.  If M->port is zero,
+ * it is updated to the port chosen by the system.
+ */
+static int
+mock_listen(REDIS_MOCK *m)
+{
+  struct addrinfo hints, *res, *ai;
+  struct sockaddr_storage addr;
+  socklen_t addrlen = sizeof(addr);
+  char port[16];
+  int fd = -1, one = 1, ret;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+
+  snprintf(port, sizeof(port), "%d", m->port);
+  ret = getaddrinfo(m->host, port, &hints, &res);
+  if (ret) {
+    xdebug(0, "getaddrinfo(%s) failed: %s", m->host, gai_strerror(ret));
+    errno = EINVAL;
+    return -1;
+  }
+
+  for (ai = res; ai; ai = ai->ai_next) {
+    fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd == -1)
+      continue;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 &&
+        listen(fd, MOCK_BACKLOG) == 0 && mock_nonblock(fd) == 0)
+      break;
+    ret = errno;
+    close(fd);
+    errno = ret;
+    fd = -1;
+  }
+  freeaddrinfo(res);
+
+  if (fd == -1)
+    return -1;
+
+  if (m->port == 0) {
+    if (getsockname(fd, (struct sockaddr *)&addr, &addrlen) == -1) {
+      ret = errno;
+      close(fd);
+      errno = ret;
+      return -1;
+    }
+    if (addr.ss_family == AF_INET6)
+      m->port = ntohs(((struct sockaddr_in6 *)&addr)->sin6_port);
+    else
+      m->port = ntohs(((struct sockaddr_in *)&addr)->sin_port);
+  }
+
+  m->listener = fd;
+  return 0;
+}
+
+
+REDIS_MOCK *
+redis_mock_new(const char *host, int port)
+{
+  REDIS_MOCK *m;
+  int ret;
+
+  m = calloc(1, sizeof(*m));
+  if (!m)
+    return NULL;
+
+  m->listener = m->wakeup[0] = m->wakeup[1] = -1;
+  m->port = port;
+  m->host = strdup(host ? host : MOCK_HOST);
+  m->nbuckets = MOCK_BUCKETS_MIN;
+  m->buckets = calloc(m->nbuckets, sizeof(*m->buckets));
+  if (!m->host || !m->buckets)
+    goto err;
+
+  pthread_mutex_init(&m->ctl_mutex, NULL);
+  pthread_mutex_init(&m->mutex, NULL);
+  pthread_cond_init(&m->cond, NULL);
+
+  if (pipe(m->wakeup) == -1 || mock_nonblock(m->wakeup[0]) == -1)
+    goto err_sync;
+
+  if (mock_listen(m) == -1)
+    goto err_sync;
+
+  ret = pthread_create(&m->thread, NULL, mock_main, m);
+  if (ret) {
+    xerror(0, ret, "pthread_create() failed");
+    errno = ret;
+    goto err_sync;
+  }
+  return m;
+
+ err_sync:
+  ret = errno;
+  if (m->listener != -1)
+    close(m->listener);
+  if (m->wakeup[0] != -1) {
+    close(m->wakeup[0]);
+    close(m->wakeup[1]);
+  }
+  pthread_cond_destroy(&m->cond);
+  pthread_mutex_destroy(&m->mutex);
+  pthread_mutex_destroy(&m->ctl_mutex);
+  errno = ret;
+ err:
+  ret = errno;
+  free(m->buckets);
+  free(m->host);
+  free(m);
+  errno = ret;
+  return NULL;
+}
+
+
+/*
+ * Ask the server thread to do CTL, and wait for it.
+ */
+static int
+mock_control(REDIS_MOCK *m, int ctl)
+{
+  char c = 0;
+  int ret;
+
+  pthread_mutex_lock(&m->ctl_mutex);
+  pthread_mutex_lock(&m->mutex);
+  m->ctl = ctl;
+  while (write(m->wakeup[1], &c, 1) == -1 && errno == EINTR)
+    ;
+  while (m->ctl != CTL_NONE)
+    pthread_cond_wait(&m->cond, &m->mutex);
+  ret = m->ctl_ret;
+  errno = m->ctl_errno;
+  pthread_mutex_unlock(&m->mutex);
+  pthread_mutex_unlock(&m->ctl_mutex);
+
+  return ret;
+}
+
+
+void
+redis_mock_close(REDIS_MOCK *m)
+{
+  struct mock_entry *p, *next;
+  size_t i;
+
+  if (!m)
+    return;
+
+  mock_control(m, CTL_QUIT);
+  pthread_join(m->thread, NULL);
+
+  for (i = 0; i < m->nbuckets; i++) {
+    for (p = m->buckets[i]; p; p = next) {
+      next = p->next;
+      free(p->key);
+      free(p->value);
+      free(p);
+    }
+  }
+  free(m->buckets);
+
+  close(m->wakeup[0]);
+  close(m->wakeup[1]);
+  pthread_cond_destroy(&m->cond);
+  pthread_mutex_destroy(&m->mutex);
+  pthread_mutex_destroy(&m->ctl_mutex);
+  free(m->master_host);
+  free(m->host);
+  free(m);
+}
+
+
+int
+redis_mock_port(REDIS_MOCK *m)
+{
+  return m->port;
+}
+
+
+void
+redis_mock_set_master(REDIS_MOCK *m, const char *host, int port)
+{
+  char *p = host ? strdup(host) : NULL;
+
+  pthread_mutex_lock(&m->mutex);
+  free(m->master_host);
+  m->master_host = p;
+  m->master_port = port;
+  pthread_mutex_unlock(&m->mutex);
+}
+
+
+void
+redis_mock_set_latency(REDIS_MOCK *m, unsigned usec)
+{
+  pthread_mutex_lock(&m->mutex);
+  m->latency = usec;
+  pthread_mutex_unlock(&m->mutex);
+}
+
+
+int
+redis_mock_set_error(REDIS_MOCK *m, const char *error, int count)
+{
+  if (count != 0 && (!error || strlen(error) >= MOCK_ERROR_MAX)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  pthread_mutex_lock(&m->mutex);
+  if (count != 0)
+    strcpy(m->error, error);
+  m->error_count = count;
+  pthread_mutex_unlock(&m->mutex);
+  return 0;
+}
+
+
+void
+redis_mock_drop(REDIS_MOCK *m)
+{
+  mock_control(m, CTL_DROP);
+}
+
+
+int
+redis_mock_stop(REDIS_MOCK *m)
+{
+  return mock_control(m, CTL_STOP);
+}
+
+
+int
+redis_mock_start(REDIS_MOCK *m)
+{
+  return mock_control(m, CTL_START);
+}
+
+
+unsigned long long
+redis_mock_commands(REDIS_MOCK *m)
+{
+  return __sync_add_and_fetch(&m->commands, 0);
+}
+
+
+/*
+ * Keys
+ */
+
+static unsigned
+mock_hash(const char *key, size_t len)
+{
+  unsigned h = 2166136261u;     /* FNV-1a */
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    h ^= (unsigned char)key[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+
+static struct mock_entry **
+mock_lookup(REDIS_MOCK *m, const char *key, size_t len, unsigned hash)
+{
+  struct mock_entry **p;
+
+  for (p = &m->buckets[hash & (m->nbuckets - 1)]; *p; p = &(*p)->next) {
+    if ((*p)->hash == hash && (*p)->key_len == len &&
+        memcmp((*p)->key, key, len) == 0)
+      break;
+  }
+  return p;
+}
+
+
+static void
+mock_rehash(REDIS_MOCK *m)
+{
+  struct mock_entry **buckets, *p, *next;
+  size_t nbuckets = m->nbuckets * 2;
+  size_t i;
+
+  buckets = calloc(nbuckets, sizeof(*buckets));
+  if (!buckets)
+    return;                     /* keep the longer chains */
+
+  for (i = 0; i < m->nbuckets; i++) {
+    for (p = m->buckets[i]; p; p = next) {
+      next = p->next;
+      p->next = buckets[p->hash & (nbuckets - 1)];
+      buckets[p->hash & (nbuckets - 1)] = p;
+    }
+  }
+  free(m->buckets);
+  m->buckets = buckets;
+  m->nbuckets = nbuckets;
+}
+
+
+static int
+mock_set(REDIS_MOCK *m, const char *key, size_t key_len,
+         const char *value, size_t value_len)
+{
+  unsigned hash = mock_hash(key, key_len);
+  struct mock_entry **pos = mock_lookup(m, key, key_len, hash);
+  struct mock_entry *p = *pos;
+  char *v;
+
+  v = malloc(value_len + 1);
+  if (!v)
+    return -1;
+  memcpy(v, value, value_len);
+  v[value_len] = '\0';
+
+  if (p) {
+    free(p->value);
+    p->value = v;
+    p->value_len = value_len;
+    return 0;
+  }
+
+  p = malloc(sizeof(*p));
+  if (!p || (p->key = malloc(key_len + 1)) == NULL) {
+    free(p);
+    free(v);
+    return -1;
+  }
+  memcpy(p->key, key, key_len);
+  p->key[key_len] = '\0';
+  p->key_len = key_len;
+  p->hash = hash;
+  p->value = v;
+  p->value_len = value_len;
+  p->next = NULL;
+  *pos = p;
+
+  if (++m->nkeys > m->nbuckets * 2)
+    mock_rehash(m);
+  return 0;
+}
+
+
+static int
+mock_del(REDIS_MOCK *m, const char *key, size_t key_len)
+{
+  struct mock_entry **pos = mock_lookup(m, key, key_len,
+                                        mock_hash(key, key_len));
+  struct mock_entry *p = *pos;
+
+  if (!p)
+    return 0;
+
+  *pos = p->next;
+  free(p->key);
+  free(p->value);
+  free(p);
+  m->nkeys--;
+  return 1;
+}
+
+
+static void
+mock_flush(REDIS_MOCK *m)
+{
+  struct mock_entry *p, *next;
+  size_t i;
+
+  for (i = 0; i < m->nbuckets; i++) {
+    for (p = m->buckets[i]; p; p = next) {
+      next = p->next;
+      free(p->key);
+      free(p->value);
+      free(p);
+    }
+    m->buckets[i] = NULL;
+  }
+  m->nkeys = 0;
+}
+
+
+/*
+ * Replies
+ */
+
+static int
+mock_reserve(struct mock_buf *b, size_t n)
+{
+  size_t size;
+  char *p;
+
+  if (b->len + n <= b->size)
+    return 0;
+
+  size = b->size ? b->size : MOCK_READ_SIZE;
+  while (size < b->len + n)
+    size *= 2;
+  p = realloc(b->data, size);
+  if (!p)
+    return -1;
+  b->data = p;
+  b->size = size;
+  return 0;
+}
+
+
+static void
+mock_write(struct mock_client *c, const void *data, size_t len)
+{
+  if (mock_reserve(&c->out, len) == -1) {
+    c->closing = 1;             /* can't answer; give up the client */
+    return;
+  }
+  memcpy(c->out.data + c->out.len, data, len);
+  c->out.len += len;
+}
+
+
+static void
+mock_reply(struct mock_client *c, const char *format, ...)
+  __attribute__((format (printf, 2, 3)));
+
+static void
+mock_reply(struct mock_client *c, const char *format, ...)
+{
+  char buf[MOCK_ERROR_MAX + 64];
+  va_list ap;
+  int n;
+
+  va_start(ap, format);
+  n = vsnprintf(buf, sizeof(buf) - 2, format, ap);
+  va_end(ap);
+
+  if (n < 0)
+    return;
+  if ((size_t)n > sizeof(buf) - 3)
+    n = sizeof(buf) - 3;
+  buf[n++] = '\r';
+  buf[n++] = '\n';
+  mock_write(c, buf, n);
+}
+
+
+static void
+mock_bulk(struct mock_client *c, const char *data, size_t len)
+{
+  mock_reply(c, "$%zu", len);
+  mock_write(c, data, len);
+  mock_write(c, "\r\n", 2);
+}
+
+
+/*
+ * Commands
+ */
+
+#define ARG_IS(i, name) (argl[i] == sizeof(name) - 1 &&                 \
+                         strncasecmp(argv[i], name, argl[i]) == 0)
+
+static void
+mock_info(REDIS_MOCK *m, struct mock_client *c)
+{
+  char buf[512];
+  int n;
+
+  pthread_mutex_lock(&m->mutex);
+  if (m->master_host)
+    n = snprintf(buf, sizeof(buf),
+                 "# Server\r\n"
+                 "redis_version:" MOCK_VERSION "\r\n"
+                 "tcp_port:%d\r\n"
+                 "\r\n"
+                 "# Replication\r\n"
+                 "role:slave\r\n"
+                 "master_host:%s\r\n"
+                 "master_port:%d\r\n"
+                 "master_link_status:up\r\n",
+                 m->port, m->master_host, m->master_port);
+  else
+    n = snprintf(buf, sizeof(buf),
+                 "# Server\r\n"
+                 "redis_version:" MOCK_VERSION "\r\n"
+                 "tcp_port:%d\r\n"
+                 "\r\n"
+                 "# Replication\r\n"
+                 "role:master\r\n"
+                 "connected_slaves:0\r\n",
+                 m->port);
+  pthread_mutex_unlock(&m->mutex);
+
+  if (n >= (int)sizeof(buf))
+    n = sizeof(buf) - 1;
+  mock_bulk(c, buf, n);
+}
+
+
+static void
+mock_config(REDIS_MOCK *m, struct mock_client *c,
+            int argc, char **argv, size_t *argl)
+{
+  char buf[512];
+  int n = 0;
+
+  if (argc < 2 || !ARG_IS(1, "GET")) {
+    mock_reply(c, "+OK");       /* CONFIG SET and others are ignored */
+    return;
+  }
+  if (argc != 3) {
+    mock_reply(c, "-ERR wrong number of arguments for 'config|get' command");
+    return;
+  }
+  if (!ARG_IS(2, "slaveof") && !ARG_IS(2, "replicaof")) {
+    mock_reply(c, "*0");
+    return;
+  }
+
+  pthread_mutex_lock(&m->mutex);
+  if (m->master_host)
+    n = snprintf(buf, sizeof(buf), "%s %d", m->master_host, m->master_port);
+  pthread_mutex_unlock(&m->mutex);
+  if (n >= (int)sizeof(buf))
+    n = sizeof(buf) - 1;
+
+  mock_reply(c, "*2");
+  mock_bulk(c, argv[2], argl[2]);
+  mock_bulk(c, buf, n);
+}
+
+
+static void
+mock_slaveof(REDIS_MOCK *m, struct mock_client *c,
+             int argc, char **argv, size_t *argl)
+{
+  char host[256];
+
+  if (argc != 3) {
+    mock_reply(c, "-ERR wrong number of arguments for '%.*s' command",
+               (int)argl[0], argv[0]);
+    return;
+  }
+  if (ARG_IS(1, "NO") && ARG_IS(2, "ONE"))
+    redis_mock_set_master(m, NULL, 0);
+  else {
+    snprintf(host, sizeof(host), "%.*s", (int)argl[1], argv[1]);
+    redis_mock_set_master(m, host, atoi(argv[2]));
+  }
+  mock_reply(c, "+OK");
+}
+
+
+/*
+ * Returns nonzero if an injected error was sent instead.
+ */
+static int
+mock_inject(REDIS_MOCK *m, struct mock_client *c)
+{
+  char error[MOCK_ERROR_MAX];
+
+  pthread_mutex_lock(&m->mutex);
+  if (m->error_count == 0) {
+    pthread_mutex_unlock(&m->mutex);
+    return 0;
+  }
+  if (m->error_count > 0)
+    m->error_count--;
+  strcpy(error, m->error);
+  pthread_mutex_unlock(&m->mutex);
+
+  mock_reply(c, "-%s", error);
+  return 1;
+}
+
+
+static int
+mock_readonly(REDIS_MOCK *m, struct mock_client *c)
+{
+  int replica;
+
+  pthread_mutex_lock(&m->mutex);
+  replica = (m->master_host != NULL);
+  pthread_mutex_unlock(&m->mutex);
+
+  if (replica)
+    mock_reply(c, "-" ERR_READONLY);
+  return replica;
+}
+
+
+static void
+mock_execute(REDIS_MOCK *m, struct mock_client *c,
+             int argc, char **argv, size_t *argl)
+{
+  struct mock_entry *p;
+  unsigned latency;
+  int i, n;
+
+  pthread_mutex_lock(&m->mutex);
+  latency = m->latency;
+  pthread_mutex_unlock(&m->mutex);
+  if (latency)
+    usleep(latency);
+
+  __sync_fetch_and_add(&m->commands, 1);
+
+  /* Connection set-up; not affected by redis_mock_set_error(). */
+  if (ARG_IS(0, "HELLO")) {
+    mock_reply(c, "-ERR unknown command 'HELLO'");
+    return;
+  }
+  else if (ARG_IS(0, "AUTH") || ARG_IS(0, "CLIENT") || ARG_IS(0, "SELECT")) {
+    mock_reply(c, "+OK");
+    return;
+  }
+  else if (ARG_IS(0, "INFO")) {
+    mock_info(m, c);
+    return;
+  }
+  else if (ARG_IS(0, "CONFIG")) {
+    mock_config(m, c, argc, argv, argl);
+    return;
+  }
+  else if (ARG_IS(0, "SLAVEOF") || ARG_IS(0, "REPLICAOF")) {
+    mock_slaveof(m, c, argc, argv, argl);
+    return;
+  }
+  else if (ARG_IS(0, "QUIT")) {
+    mock_reply(c, "+OK");
+    c->closing = 1;
+    return;
+  }
+
+  if (mock_inject(m, c))
+    return;
+
+  if (ARG_IS(0, "PING")) {
+    if (argc > 1)
+      mock_bulk(c, argv[1], argl[1]);
+    else
+      mock_reply(c, "+PONG");
+  }
+  else if (ARG_IS(0, "ECHO") && argc == 2)
+    mock_bulk(c, argv[1], argl[1]);
+  else if (ARG_IS(0, "GET") && argc == 2) {
+    p = *mock_lookup(m, argv[1], argl[1], mock_hash(argv[1], argl[1]));
+    if (p)
+      mock_bulk(c, p->value, p->value_len);
+    else
+      mock_reply(c, "$-1");
+  }
+  else if (ARG_IS(0, "SET") && argc >= 3) {
+    /* Options such as EX or NX are accepted but ignored. */
+    if (mock_readonly(m, c))
+      return;
+    if (mock_set(m, argv[1], argl[1], argv[2], argl[2]) == -1)
+      mock_reply(c, "-OOM command not allowed when used memory > 'maxmemory'.");
+    else
+      mock_reply(c, "+OK");
+  }
+  else if (ARG_IS(0, "MGET") && argc >= 2) {
+    mock_reply(c, "*%d", argc - 1);
+    for (i = 1; i < argc; i++) {
+      p = *mock_lookup(m, argv[i], argl[i], mock_hash(argv[i], argl[i]));
+      if (p)
+        mock_bulk(c, p->value, p->value_len);
+      else
+        mock_reply(c, "$-1");
+    }
+  }
+  else if (ARG_IS(0, "MSET") && argc >= 3 && argc % 2 == 1) {
+    if (mock_readonly(m, c))
+      return;
+    for (i = 1; i < argc; i += 2) {
+      if (mock_set(m, argv[i], argl[i], argv[i + 1], argl[i + 1]) == -1)
+        break;
+    }
+    if (i < argc)
+      mock_reply(c, "-OOM command not allowed when used memory > 'maxmemory'.");
+    else
+      mock_reply(c, "+OK");
+  }
+  else if (ARG_IS(0, "DEL") && argc >= 2) {
+    if (mock_readonly(m, c))
+      return;
+    for (i = 1, n = 0; i < argc; i++)
+      n += mock_del(m, argv[i], argl[i]);
+    mock_reply(c, ":%d", n);
+  }
+  else if (ARG_IS(0, "DBSIZE"))
+    mock_reply(c, ":%zu", m->nkeys);
+  else if (ARG_IS(0, "FLUSHALL") || ARG_IS(0, "FLUSHDB")) {
+    if (mock_readonly(m, c))
+      return;
+    mock_flush(m);
+    mock_reply(c, "+OK");
+  }
+  else if (ARG_IS(0, "PING") || ARG_IS(0, "ECHO") || ARG_IS(0, "GET") ||
+           ARG_IS(0, "SET") || ARG_IS(0, "DEL") || ARG_IS(0, "MGET") ||
+           ARG_IS(0, "MSET"))
+    mock_reply(c, "-ERR wrong number of arguments for '%.*s' command",
+               (int)argl[0], argv[0]);
+  else
+    mock_reply(c, "-ERR unknown command '%.*s'", (int)argl[0], argv[0]);
+}
+
+
+/*
+ * Parse one command at BUF.  On success, returns the number of bytes
+ * of the command, and fills ARGC, ARGV and ARGL.  Returns zero if the
+ * command is not complete yet, and -1 on a protocol error.
+ */
+static ssize_t
+mock_parse(char *buf, size_t len, int *argc, char **argv, size_t *argl)
+{
+  char *p = buf, *end = buf + len, *eol;
+  long n, i, l;
+
+  *argc = 0;
+
+  if (len == 0)
+    return 0;
+
+  if (*p != '*') {              /* inline command */
+    eol = memchr(p, '\n', len);
+    if (!eol)
+      return 0;
+    while (p < eol) {
+      p += strspn(p, " \t\r");
+      if (p >= eol)
+        break;
+      if (*argc == MOCK_ARGS_MAX)
+        return -1;
+      argv[*argc] = p;
+      while (p < eol && *p != ' ' && *p != '\t' && *p != '\r')
+        p++;
+      argl[*argc] = p - argv[*argc];
+      (*argc)++;
+    }
+    return eol + 1 - buf;
+  }
+
+  eol = memchr(p, '\n', len);
+  if (!eol)
+    return 0;
+  n = strtol(p + 1, NULL, 10);
+  if (n > MOCK_ARGS_MAX)
+    return -1;
+  p = eol + 1;
+
+  for (i = 0; i < n; i++) {
+    if (p >= end)
+      return 0;
+    if (*p != '$')
+      return -1;
+    eol = memchr(p, '\n', end - p);
+    if (!eol)
+      return 0;
+    l = strtol(p + 1, NULL, 10);
+    if (l < 0)
+      return -1;
+    p = eol + 1;
+    if (end - p < l + 2)
+      return 0;
+    argv[i] = p;
+    argl[i] = l;
+    p += l + 2;
+  }
+  *argc = n > 0 ? n : 0;
+  return p - buf;
+}
+
+
+/*
+ * Read from the client C and answer every complete command.  Returns
+ * -1 if C should be closed.
+ */
+static int
+mock_read(REDIS_MOCK *m, struct mock_client *c)
+{
+  char *argv[MOCK_ARGS_MAX];
+  size_t argl[MOCK_ARGS_MAX];
+  size_t pos = 0;
+  ssize_t n;
+  int argc;
+
+  if (mock_reserve(&c->in, MOCK_READ_SIZE) == -1)
+    return -1;
+
+  n = read(c->fd, c->in.data + c->in.len, c->in.size - c->in.len);
+  if (n == 0)
+    return -1;
+  if (n < 0)
+    return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+  c->in.len += n;
+
+  while (!c->closing) {
+    n = mock_parse(c->in.data + pos, c->in.len - pos, &argc, argv, argl);
+    if (n == 0)
+      break;
+    if (n < 0) {
+      mock_reply(c, "-ERR Protocol error");
+      c->closing = 1;
+      break;
+    }
+    pos += n;
+    if (argc > 0)
+      mock_execute(m, c, argc, argv, argl);
+  }
+
+  memmove(c->in.data, c->in.data + pos, c->in.len - pos);
+  c->in.len -= pos;
+  return 0;
+}
+
+
+/*
+ * Write the pending replies to C.  Returns -1 if C should be closed.
+ */
+static int
+mock_flush_client(struct mock_client *c)
+{
+  ssize_t n;
+
+  while (c->out_pos < c->out.len) {
+    n = send(c->fd, c->out.data + c->out_pos, c->out.len - c->out_pos,
+             MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN)
+        return 0;
+      return -1;
+    }
+    c->out_pos += n;
+  }
+  c->out.len = c->out_pos = 0;
+  return c->closing ? -1 : 0;
+}
+
+
+static void
+mock_close_client(struct mock_client *c)
+{
+  close(c->fd);
+  free(c->in.data);
+  free(c->out.data);
+  free(c);
+}
+
+
+static void
+mock_close_clients(REDIS_MOCK *m)
+{
+  int i;
+
+  for (i = 0; i < m->nclients; i++)
+    mock_close_client(m->clients[i]);
+  m->nclients = 0;
+}
+
+
+static void
+mock_accept(REDIS_MOCK *m)
+{
+  struct mock_client *c;
+  int fd, one = 1;
+
+  while ((fd = accept(m->listener, NULL, NULL)) != -1) {
+    if (m->nclients == MOCK_CLIENTS_MAX || mock_nonblock(fd) == -1 ||
+        (c = calloc(1, sizeof(*c))) == NULL) {
+      xdebug(0, "mock: can't accept more clients");
+      close(fd);
+      continue;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    c->fd = fd;
+    m->clients[m->nclients++] = c;
+  }
+}
+
+
+/*
+ * Handle a request from mock_control().  Returns nonzero if the
+ * server thread should exit.
+ */
+static int
+mock_handle_control(REDIS_MOCK *m)
+{
+  char buf[64];
+  int ctl, ret = 0, err = 0;
+
+  while (read(m->wakeup[0], buf, sizeof(buf)) > 0)
+    ;
+
+  pthread_mutex_lock(&m->mutex);
+  ctl = m->ctl;
+  pthread_mutex_unlock(&m->mutex);
+
+  switch (ctl) {
+  case CTL_NONE:
+    return 0;
+  case CTL_DROP:
+    mock_close_clients(m);
+    break;
+  case CTL_STOP:
+  case CTL_QUIT:
+    mock_close_clients(m);
+    if (m->listener != -1) {
+      close(m->listener);
+      m->listener = -1;
+    }
+    break;
+  case CTL_START:
+    if (m->listener == -1 && mock_listen(m) == -1) {
+      ret = -1;
+      err = errno;
+    }
+    break;
+  }
+
+  pthread_mutex_lock(&m->mutex);
+  m->ctl_ret = ret;
+  m->ctl_errno = err;
+  m->ctl = CTL_NONE;
+  pthread_cond_broadcast(&m->cond);
+  pthread_mutex_unlock(&m->mutex);
+
+  return ctl == CTL_QUIT;
+}
+
+
+static void *
+mock_main(void *arg)
+{
+  REDIS_MOCK *m = (REDIS_MOCK *)arg;
+  struct pollfd fds[MOCK_CLIENTS_MAX + 2];
+  int base, nfds, i, j;
+
+  xthread_set_name("sredis-mock");
+
+  while (1) {
+    fds[0].fd = m->wakeup[0];
+    fds[0].events = POLLIN;
+    fds[1].fd = m->listener;    /* ignored by poll(2) if negative */
+    fds[1].events = POLLIN;
+    base = 2;
+    for (i = 0; i < m->nclients; i++) {
+      fds[base + i].fd = m->clients[i]->fd;
+      fds[base + i].events = POLLIN;
+      if (m->clients[i]->out.len > m->clients[i]->out_pos)
+        fds[base + i].events |= POLLOUT;
+    }
+    nfds = base + m->nclients;
+
+    if (poll(fds, nfds, -1) == -1) {
+      if (errno == EINTR)
+        continue;
+      xerror(0, errno, "mock: poll(2) failed");
+      break;
+    }
+
+    if (fds[0].revents && mock_handle_control(m))
+      break;
+    /* Clients may be closed by mock_handle_control(); look at the
+     * listener and clients only if none were. */
+    if (fds[0].revents)
+      continue;
+
+    for (i = 0; i < nfds - base; i++) {
+      struct mock_client *c = m->clients[i];
+      short ev = fds[base + i].revents;
+
+      if (!ev)
+        continue;
+      if ((ev & (POLLIN | POLLHUP | POLLERR)) && mock_read(m, c) == -1) {
+        c->closing = 1;
+        c->out.len = c->out_pos = 0;
+      }
+      if (mock_flush_client(c) == -1) {
+        mock_close_client(c);
+        m->clients[i] = NULL;
+      }
+    }
+    for (i = j = 0; i < m->nclients; i++) {
+      if (m->clients[i])
+        m->clients[j++] = m->clients[i];
+    }
+    m->nclients = j;
+
+    if (m->listener != -1 && (fds[1].revents & POLLIN))
+      mock_accept(m);
+  }
+
+  mock_close_clients(m);
+  return NULL;
+}
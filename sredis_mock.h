@@ -0,0 +1,81 @@
+#ifndef SREDIS_MOCK_H__
+#define SREDIS_MOCK_H__
+
+/*
+ * In-process mock redis server; not installed.
+ *
+ * It speaks just enough RESP2 for the benchmarks and for exercising
+ * the failover path of sredis on one machine: PING, ECHO, GET, SET,
+ * MGET, MSET, DEL, INFO, CONFIG GET slaveof, SLAVEOF/REPLICAOF and
+ * QUIT.  HELLO is rejected, so the clients fall back to RESP2.
+ *
+ * Each server runs one thread that serves all of its clients, like
+ * the real redis.  Keys live in memory and are not shared between
+ * servers; there is no replication.
+ */
+
+#include <sys/types.h>
+
+typedef struct redis_mock REDIS_MOCK;
+
+/*
+ * Start a server listening on HOST:PORT.  If PORT is zero, an
+ * ephemeral port is chosen; see redis_mock_port().  The server starts
+ * as a master.
+ *
+ * Returns NULL on failure with errno set.
+ */
+REDIS_MOCK *redis_mock_new(const char *host, int port);
+
+/*
+ * Stop the server, close all client connections and release M.
+ */
+void redis_mock_close(REDIS_MOCK *m);
+
+int redis_mock_port(REDIS_MOCK *m);
+
+/*
+ * Make M a replica of HOST:PORT, or a master if HOST is NULL.  A
+ * replica answers writes with -READONLY, and reports its master in
+ * INFO and CONFIG GET slaveof.
+ */
+void redis_mock_set_master(REDIS_MOCK *m, const char *host, int port);
+
+/*
+ * Delay every reply by USEC microseconds.  Since one thread serves
+ * all clients, this delays the other clients too.
+ */
+void redis_mock_set_latency(REDIS_MOCK *m, unsigned usec);
+
+/*
+ * Answer the next COUNT data commands with the error ERROR (without
+ * the leading '-', e.g. "LOADING Redis is loading the dataset in
+ * memory").  If COUNT is negative, keep answering until it is called
+ * again with zero COUNT.  Connection set-up commands (INFO, CONFIG,
+ * HELLO, AUTH, CLIENT, SLAVEOF) are not affected.
+ *
+ * Returns zero on success, -1 on failure.
+ */
+int redis_mock_set_error(REDIS_MOCK *m, const char *error, int count);
+
+/*
+ * Close the connection of every client; the server keeps listening.
+ */
+void redis_mock_drop(REDIS_MOCK *m);
+
+/*
+ * Emulate a dead server: close the listening socket and every client,
+ * so that new connections are refused.  redis_mock_start() listens
+ * on the same port again.  The keys survive.
+ *
+ * Both return zero on success, -1 on failure with errno set.
+ */
+int redis_mock_stop(REDIS_MOCK *m);
+int redis_mock_start(REDIS_MOCK *m);
+
+/*
+ * The number of commands answered so far.
+ */
+unsigned long long redis_mock_commands(REDIS_MOCK *m);
+
+#endif  /* SREDIS_MOCK_H__ */
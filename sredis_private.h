@@ -0,0 +1,127 @@
+#ifndef SREDIS_PRIVATE_H__
+#define SREDIS_PRIVATE_H__
+
+/*
+ * Internal functions of sredis.c, exposed for the other modules and
+ * for the micro-benchmarks; not installed.
+ */
+
+#include <stdarg.h>
+
+#include "sredis.h"
+
+/*
+ * va_list versions of redis_command() (or redis_command_fast() if
+ * REOPEN is zero) and redis_append_unlocked().
+ */
+redisReply *redis_vcommand(REDIS *redis, int reopen,
+                           const char *format, va_list ap);
+int redis_vappend(REDIS *redis, const char *format, va_list ap);
+
+/*
+ * Like redis_append_unlocked(), with the arguments in ARGV (see
+ * redisAppendCommandArgv()).
+ */
+int redis_append_argv_unlocked(REDIS *redis, int argc, const char **argv,
+                               const size_t *argvlen);
+
+/*
+ * Send the queued commands of REDIS without waiting for the replies,
+ * which are read by redis_exec_unlocked() later.  This way, the
+ * requests to several servers are in flight at the same time.  The
+ * write time is not recorded in the phases of the pipeline.
+ *
+ * On failure, the following redis_exec_unlocked() fails, and
+ * reconnects as usual.
+ */
+int redis_send_unlocked(REDIS *redis);
+
+/*
+ * Share REPLY, held by the caller, among REFS holders (see
+ * redis_set_coalescing()).  Each holder calls redis_free() on it, and
+ * the last one frees it.  Returns zero on success, -1 on failure.
+ */
+int redis_reply_share(redisReply *reply, int refs);
+
+/*
+ * Drop a reference to REPLY if it is shared, and free it if it was
+ * the last one.  Returns nonzero if REPLY was shared, zero otherwise.
+ */
+int redis_reply_release(redisReply *reply);
+
+/*
+ * Builder of a flat reply (see redis_command_flat()).  While it is
+ * attached to READER, the replies read are appended to it.  Detaching
+ * fails if a reply is half-read; then the reader still refers to the
+ * builder, and must be freed (e.g. with the connection) before it.
+ */
+struct redis_flat_build *redis_flat_build_new(void);
+void redis_flat_build_free(struct redis_flat_build *b);
+void redis_flat_attach(struct redis_flat_build *b, redisReader *reader);
+int redis_flat_detach(struct redis_flat_build *b, redisReader *reader);
+REDIS_FLAT *redis_flat_seal(struct redis_flat_build *b);
+
+/*
+ * RESP scanning (see sredis_raw.c).
+ *
+ * redis_resp_type() returns the reply type of the type byte C, or -1.
+ * redis_resp_line() parses the header line of an item.
+ *
+ * redis_resp_scan() finds the end of the reply at BUF of LEN bytes.
+ * It returns 1 when the reply is complete (S->off is its length), 0
+ * if more bytes are needed, or -1 on a protocol error.  S, zeroed for
+ * a new reply, keeps the progress, so it can be called again with
+ * more bytes in the same buffer.  If S->handler is set, it is called
+ * for each item as the item is scanned (see redis_command_parse()).
+ */
+#define REDIS_RESP_DEPTH_MAX    32
+
+struct redis_resp_scan {
+  size_t off;                   /* scanned bytes */
+  int depth;
+  long long left[REDIS_RESP_DEPTH_MAX]; /* elements left per aggregate */
+  char attr[REDIS_RESP_DEPTH_MAX];      /* nonzero for an attribute */
+
+  const struct redis_parse_handler *handler;
+  void *data;
+};
+
+int redis_resp_type(char c);
+int redis_resp_line(const char *p, size_t avail, size_t *line,
+                    long long *num);
+int redis_resp_scan(struct redis_resp_scan *s, const char *buf, size_t len);
+
+/*
+ * Reading a raw reply (see redis_command_raw()), or parsing it with
+ * RR->scan.handler.  In place of redisGetReplyFromReader(),
+ * redis_raw_get() sets *REPLY to a stand-in for the reply once it is
+ * complete, and RR->raw to the reply unless there is a handler.
+ */
+struct redis_raw_read {
+  struct redis_resp_scan scan;
+  REDIS_RAW *raw;
+  redisReply top;               /* the stand-in */
+  char msg[256];                /* the status or error line of TOP */
+};
+
+int redis_raw_get(struct redis_raw_read *rr, redisContext *ctx, void **reply);
+
+/*
+ * Called for each "FIELD:VALUE" line of INFO.  SECTION is the name
+ * of the current section (e.g. "Replication"), or NULL.  Returning
+ * zero stops the parsing.
+ */
+typedef int (*redis_info_handler)(REDIS *redis,
+                                  char *section,
+                                  char *field,
+                                  char *value,
+                                  void *data);
+
+/*
+ * Send INFO to the current connection of RD, and call HANDLER for
+ * each field.  Returns -1 on failure, otherwise the last return value
+ * of HANDLER.
+ */
+int redis_parse_info(REDIS *rd, redis_info_handler handler, void *data);
+
+#endif  /* SREDIS_PRIVATE_H__ */
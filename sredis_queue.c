@@ -0,0 +1,753 @@
+#define _GNU_SOURCE     1       /* asprintf(3) */
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "sredis.h"
+#include "sredis_private.h"
+
+#ifdef _PTHREAD
+
+/*
+ * Reliable queue.
+ *
+ * Producers push jobs to the head of the list NAME.  A consumer moves
+ * jobs from the tail of NAME to its own processing list,
+ * "NAME:processing:CONSUMER", in one round trip per batch (a Lua
+ * script calling RPOPLPUSH up to COUNT times).  Acknowledged jobs are
+ * removed from the processing list with pipelined LREM, again one
+ * round trip per batch.
+ *
+ * Every popped job is tracked in the in-flight table with its lease
+ * deadline.  The reaper thread moves the jobs whose lease expired back
+ * to the tail of NAME, so that they are delivered again.  If the
+ * consumer process dies, the jobs stay in the processing list until
+ * redis_queue_recover() is called by a consumer with the same name.
+ *
+ * LMPOP is not used since it cannot move the jobs to the processing
+ * list atomically.
+ *
+ * Jobs are binary, so the commands carrying them are built with
+ * redis_append_argv_unlocked().
+ */
+
+#define QUEUE_POP_MAX           1024
+#define QUEUE_ACK_BATCH         128
+#define QUEUE_REAP_MIN_MSEC     10
+
+#define ERR_NOSCRIPT            "NOSCRIPT"
+
+enum { SLOT_FREE, SLOT_INFLIGHT, SLOT_ACKED };
+
+/* KEYS[1]: queue, KEYS[2]: processing list, ARGV[1]: count */
+static const char queue_pop_script[] =
+  "local jobs = {}\n"
+  "for i = 1, tonumber(ARGV[1]) do\n"
+  "  local job = redis.call('RPOPLPUSH', KEYS[1], KEYS[2])\n"
+  "  if not job then break end\n"
+  "  jobs[i] = job\n"
+  "end\n"
+  "return jobs\n";
+
+/* KEYS[1]: queue, KEYS[2]: processing list
+ *
+ * Popping from the head of the processing list gives the newest job
+ * first, so after this the oldest one is at the tail of the queue,
+ * which is the next to be delivered. */
+static const char queue_recover_script[] =
+  "local n = 0\n"
+  "while true do\n"
+  "  local job = redis.call('LPOP', KEYS[2])\n"
+  "  if not job then break end\n"
+  "  redis.call('RPUSH', KEYS[1], job)\n"
+  "  n = n + 1\n"
+  "end\n"
+  "return n\n";
+
+/* KEYS[1]: queue, KEYS[2]: processing list, ARGV[1]: job */
+static const char queue_requeue_script[] =
+  "if redis.call('LREM', KEYS[2], -1, ARGV[1]) > 0 then\n"
+  "  redis.call('RPUSH', KEYS[1], ARGV[1])\n"
+  "  return 1\n"
+  "end\n"
+  "return 0\n";
+
+/* payload of a job, copied out of the in-flight table */
+struct queue_payload {
+  const char *data;
+  size_t len;
+};
+
+struct queue_slot {
+  char *data;
+  size_t len;
+  struct timespec deadline;
+  unsigned gen;
+  int state;
+  size_t next_free;
+};
+
+struct redis_queue {
+  REDIS *redis;
+  char *name;
+  char *processing;
+
+  struct timeval lease;
+
+  char pop_sha[41];
+
+  pthread_mutex_t mutex;
+
+  /* in-flight table */
+  struct queue_slot *slots;
+  size_t nslots;
+  size_t free_head;             /* == nslots if none */
+
+  /* acknowledged, but not yet flushed */
+  size_t *acks;
+  size_t nacks;
+  size_t acks_cap;
+  size_t ack_batch;
+
+  /* reaper */
+  pthread_t reaper;
+  int has_reaper;
+  pthread_mutex_t reaper_mutex;
+  pthread_cond_t reaper_cond;
+  int stop;
+};
+
+
+#define JOB_ID(index, gen)      (((unsigned long long)(gen) << 32) | (index))
+#define JOB_INDEX(id)           ((size_t)((id) & 0xffffffffULL))
+#define JOB_GEN(id)             ((unsigned)((id) >> 32))
+
+
+static void
+timespec_after(struct timespec *ts, const struct timeval *tv)
+{
+  clock_gettime(CLOCK_MONOTONIC, ts);
+  ts->tv_sec += tv->tv_sec;
+  ts->tv_nsec += tv->tv_usec * 1000L;
+  if (ts->tv_nsec >= 1000000000L) {
+    ts->tv_sec++;
+    ts->tv_nsec -= 1000000000L;
+  }
+}
+
+
+static int
+timespec_passed(const struct timespec *deadline, const struct timespec *now)
+{
+  if (now->tv_sec != deadline->tv_sec)
+    return now->tv_sec > deadline->tv_sec;
+  return now->tv_nsec >= deadline->tv_nsec;
+}
+
+
+/*
+ * Allocate a slot in the in-flight table.  Called with Q->mutex.
+ * Returns the index of the slot, or (size_t)-1 on failure.
+ */
+static size_t
+queue_slot_alloc(REDIS_QUEUE *q)
+{
+  struct queue_slot *p;
+  size_t i, n;
+
+  if (q->free_head == q->nslots) {
+    n = q->nslots ? q->nslots * 2 : 64;
+    if (n > 0xffffffffUL)
+      return (size_t)-1;
+
+    p = realloc(q->slots, sizeof(*p) * n);
+    if (!p)
+      return (size_t)-1;
+    for (i = q->nslots; i < n; i++) {
+      p[i].data = NULL;
+      p[i].gen = 0;
+      p[i].state = SLOT_FREE;
+      p[i].next_free = i + 1;
+    }
+    q->slots = p;
+    q->free_head = q->nslots;
+    q->nslots = n;
+    /* the last slot's next_free is already 'n' (== none) */
+  }
+
+  i = q->free_head;
+  q->free_head = q->slots[i].next_free;
+  return i;
+}
+
+
+/* Called with Q->mutex. */
+static void
+queue_slot_free(REDIS_QUEUE *q, size_t index)
+{
+  struct queue_slot *p = &q->slots[index];
+
+  free(p->data);
+  p->data = NULL;
+  p->state = SLOT_FREE;
+  p->gen++;
+  p->next_free = q->free_head;
+  q->free_head = index;
+}
+
+
+/*
+ * Find the in-flight slot of JOB.  Called with Q->mutex.
+ */
+static struct queue_slot *
+queue_slot_of(REDIS_QUEUE *q, const struct redis_job *job)
+{
+  size_t index = JOB_INDEX(job->id);
+
+  if (index >= q->nslots || q->slots[index].gen != JOB_GEN(job->id) ||
+      q->slots[index].state != SLOT_INFLIGHT) {
+    /* already acknowledged, or the lease expired and the job was
+     * given back to the queue. */
+    errno = ESTALE;
+    return NULL;
+  }
+  return &q->slots[index];
+}
+
+
+static int
+queue_load_script(REDIS_QUEUE *q)
+{
+  redisReply *reply;
+  int ret = -1;
+
+  reply = redis_command(q->redis, "SCRIPT LOAD %s", queue_pop_script);
+  if (reply && reply->type == REDIS_REPLY_STRING &&
+      reply->len < sizeof(q->pop_sha)) {
+    pthread_mutex_lock(&q->mutex);
+    memcpy(q->pop_sha, reply->str, reply->len + 1);
+    pthread_mutex_unlock(&q->mutex);
+    ret = 0;
+  }
+  else
+    xdebug(0, "queue: SCRIPT LOAD failed: %s",
+           (reply && reply->str) ? reply->str : "null reply");
+
+  redis_free(reply);
+  return ret;
+}
+
+
+static redisReply *
+queue_pop_command(REDIS_QUEUE *q, int count)
+{
+  redisReply *reply = NULL;
+  char sha[sizeof(q->pop_sha)];
+
+  pthread_mutex_lock(&q->mutex);
+  memcpy(sha, q->pop_sha, sizeof(sha));
+  pthread_mutex_unlock(&q->mutex);
+
+  if (sha[0] == '\0' && queue_load_script(q) == 0) {
+    pthread_mutex_lock(&q->mutex);
+    memcpy(sha, q->pop_sha, sizeof(sha));
+    pthread_mutex_unlock(&q->mutex);
+  }
+
+  if (sha[0] != '\0') {
+    reply = redis_command(q->redis, "EVALSHA %s 2 %s %s %d",
+                          sha, q->name, q->processing, count);
+    if (!reply || reply->type != REDIS_REPLY_ERROR ||
+        strncmp(reply->str, ERR_NOSCRIPT, sizeof(ERR_NOSCRIPT) - 1) != 0)
+      return reply;
+
+    /* The script cache is empty (e.g. the master was switched). */
+    redis_free(reply);
+    pthread_mutex_lock(&q->mutex);
+    q->pop_sha[0] = '\0';
+    pthread_mutex_unlock(&q->mutex);
+  }
+
+  /* EVAL also puts the script in the cache of the server. */
+  return redis_command(q->redis, "EVAL %s 2 %s %s %d",
+                       queue_pop_script, q->name, q->processing, count);
+}
+
+
+int
+redis_queue_pop(REDIS_QUEUE *q, struct redis_job *jobs, int count)
+{
+  redisReply *reply;
+  struct queue_slot *slot;
+  struct timespec deadline;
+  size_t i, index;
+  int n = 0;
+
+  if (count <= 0 || count > QUEUE_POP_MAX) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  reply = queue_pop_command(q, count);
+  if (redis_iserror(reply) || reply->type != REDIS_REPLY_ARRAY) {
+    xdebug(0, "queue: pop failed: %s",
+           (reply && reply->str) ? reply->str : "null reply");
+    redis_free(reply);
+    return -1;
+  }
+
+  timespec_after(&deadline, &q->lease);
+
+  pthread_mutex_lock(&q->mutex);
+  for (i = 0; i < reply->elements; i++) {
+    redisReply *elm = reply->element[i];
+
+    index = queue_slot_alloc(q);
+    if (index == (size_t)-1) {
+      /* The job is in the processing list; redis_queue_recover()
+       * will find it later. */
+      xerror(0, ENOMEM, "queue: can't track in-flight job");
+      continue;
+    }
+    slot = &q->slots[index];
+    slot->data = malloc(elm->len + 1);
+    if (!slot->data) {
+      xerror(0, ENOMEM, "queue: can't track in-flight job");
+      queue_slot_free(q, index);
+      continue;
+    }
+    memcpy(slot->data, elm->str, elm->len + 1);
+    slot->len = elm->len;
+    slot->deadline = deadline;
+    slot->state = SLOT_INFLIGHT;
+
+    jobs[n].data = slot->data;
+    jobs[n].len = slot->len;
+    jobs[n].id = JOB_ID(index, slot->gen);
+    n++;
+  }
+  pthread_mutex_unlock(&q->mutex);
+
+  redis_free(reply);
+  return n;
+}
+
+
+/*
+ * Append INDICES to the acknowledgement buffer.  Called with Q->mutex.
+ */
+static int
+queue_ack_push(REDIS_QUEUE *q, const size_t *indices, size_t n)
+{
+  size_t *p, cap;
+
+  if (q->nacks + n > q->acks_cap) {
+    cap = q->acks_cap ? q->acks_cap : q->ack_batch;
+    while (cap < q->nacks + n)
+      cap *= 2;
+    p = realloc(q->acks, sizeof(*p) * cap);
+    if (!p)
+      return -1;
+    q->acks = p;
+    q->acks_cap = cap;
+  }
+  memcpy(q->acks + q->nacks, indices, sizeof(*indices) * n);
+  q->nacks += n;
+  return 0;
+}
+
+
+/*
+ * Copy the payloads of the slots in INDICES.  Called with Q->mutex.
+ *
+ * The slots should not be SLOT_INFLIGHT, so the payloads stay valid
+ * after Q->mutex is released, even if q->slots is reallocated.
+ */
+static struct queue_payload *
+queue_payloads(REDIS_QUEUE *q, const size_t *indices, size_t n)
+{
+  struct queue_payload *p;
+  size_t i;
+
+  p = malloc(sizeof(*p) * n);
+  if (!p)
+    return NULL;
+
+  for (i = 0; i < n; i++) {
+    p[i].data = q->slots[indices[i]].data;
+    p[i].len = q->slots[indices[i]].len;
+  }
+  return p;
+}
+
+
+int
+redis_queue_flush(REDIS_QUEUE *q)
+{
+  struct queue_payload *payloads;
+  redisReply *reply = NULL;
+  size_t *acks, nacks, i;
+
+  pthread_mutex_lock(&q->mutex);
+  acks = q->acks;
+  nacks = q->nacks;
+  if (nacks == 0) {
+    pthread_mutex_unlock(&q->mutex);
+    return 0;
+  }
+  payloads = queue_payloads(q, acks, nacks);
+  q->acks = NULL;
+  q->nacks = q->acks_cap = 0;
+  pthread_mutex_unlock(&q->mutex);
+
+  if (payloads) {
+    redis_lock(q->redis);
+    for (i = 0; i < nacks; i++) {
+      const char *argv[] = { "LREM", q->processing, "-1", payloads[i].data };
+      size_t argvlen[] = { 4, strlen(q->processing), 2, payloads[i].len };
+
+      if (redis_append_argv_unlocked(q->redis, 4, argv,
+                                     argvlen) != REDIS_OK)
+        break;
+    }
+    reply = redis_exec_unlocked(q->redis);
+    if (i < nacks) {
+      redis_free(reply);
+      reply = NULL;
+    }
+    redis_unlock(q->redis);
+    free(payloads);
+  }
+
+  pthread_mutex_lock(&q->mutex);
+  if (reply) {
+    for (i = 0; i < nacks; i++)
+      queue_slot_free(q, acks[i]);
+  }
+  else if (queue_ack_push(q, acks, nacks) != 0) {
+    /* The jobs will be delivered again after redis_queue_recover(). */
+    xerror(0, ENOMEM, "queue: %zu acknowledgement(s) lost", nacks);
+    for (i = 0; i < nacks; i++)
+      queue_slot_free(q, acks[i]);
+  }
+  pthread_mutex_unlock(&q->mutex);
+
+  free(acks);
+
+  if (!reply)
+    return -1;
+  redis_free(reply);
+  return 0;
+}
+
+
+int
+redis_queue_ack(REDIS_QUEUE *q, const struct redis_job *job)
+{
+  struct queue_slot *slot;
+  size_t index = JOB_INDEX(job->id);
+  int flush;
+
+  pthread_mutex_lock(&q->mutex);
+  slot = queue_slot_of(q, job);
+  if (!slot || queue_ack_push(q, &index, 1) != 0) {
+    pthread_mutex_unlock(&q->mutex);
+    return -1;
+  }
+  slot->state = SLOT_ACKED;
+  flush = (q->nacks >= q->ack_batch);
+  pthread_mutex_unlock(&q->mutex);
+
+  if (flush)
+    return redis_queue_flush(q);
+  return 0;
+}
+
+
+/*
+ * Move the jobs in INDICES back to the queue in one pipeline, and
+ * release their slots.  The slots should not be SLOT_INFLIGHT anymore,
+ * so that nobody else touches them.  The jobs that could not be moved
+ * are marked SLOT_INFLIGHT again, to be retried later.
+ */
+static int
+queue_requeue(REDIS_QUEUE *q, const size_t *indices, size_t n)
+{
+  struct queue_payload *payloads;
+  redisReply *reply = NULL;
+  size_t i, done = 0;
+
+  pthread_mutex_lock(&q->mutex);
+  payloads = queue_payloads(q, indices, n);
+  pthread_mutex_unlock(&q->mutex);
+
+  if (payloads) {
+    redis_lock(q->redis);
+    for (i = 0; i < n; i++) {
+      const char *argv[] = { "EVAL", queue_requeue_script, "2", q->name,
+                             q->processing, payloads[i].data };
+      size_t argvlen[] = { 4, sizeof(queue_requeue_script) - 1, 1,
+                           strlen(q->name), strlen(q->processing),
+                           payloads[i].len };
+
+      if (redis_append_argv_unlocked(q->redis, 6, argv,
+                                     argvlen) != REDIS_OK)
+        break;
+    }
+    /* REPLY covers only the commands that were actually sent. */
+    reply = redis_exec_unlocked(q->redis);
+    redis_unlock(q->redis);
+    free(payloads);
+  }
+
+  pthread_mutex_lock(&q->mutex);
+  for (i = 0; i < n; i++) {
+    if (reply && reply->type == REDIS_REPLY_ARRAY && i < reply->elements
+        && reply->element[i]
+        && reply->element[i]->type != REDIS_REPLY_ERROR) {
+      queue_slot_free(q, indices[i]);
+      done++;
+    }
+    else
+      q->slots[indices[i]].state = SLOT_INFLIGHT; /* retry later */
+  }
+  pthread_mutex_unlock(&q->mutex);
+
+  redis_free(reply);
+  return (done == n) ? 0 : -1;
+}
+
+
+int
+redis_queue_nack(REDIS_QUEUE *q, const struct redis_job *job)
+{
+  struct queue_slot *slot;
+  size_t index;
+
+  pthread_mutex_lock(&q->mutex);
+  slot = queue_slot_of(q, job);
+  if (!slot) {
+    pthread_mutex_unlock(&q->mutex);
+    return -1;
+  }
+  slot->state = SLOT_ACKED;     /* keep the reaper away */
+  index = JOB_INDEX(job->id);
+  pthread_mutex_unlock(&q->mutex);
+
+  return queue_requeue(q, &index, 1);
+}
+
+
+int
+redis_queue_push(REDIS_QUEUE *q, const void *data, size_t len)
+{
+  const char *argv[] = { "LPUSH", q->name, data };
+  size_t argvlen[] = { 5, strlen(q->name), len };
+  redisReply *reply = NULL;
+  int ret = -1;
+
+  redis_lock(q->redis);
+  if (redis_append_argv_unlocked(q->redis, 3, argv, argvlen) == REDIS_OK)
+    reply = redis_exec_unlocked(q->redis);
+  redis_unlock(q->redis);
+
+  if (reply && reply->elements == 1 && !redis_iserror(reply->element[0]))
+    ret = 0;
+  redis_free(reply);
+  return ret;
+}
+
+
+int
+redis_queue_recover(REDIS_QUEUE *q)
+{
+  redisReply *reply;
+  int n;
+
+  reply = redis_command(q->redis, "EVAL %s 2 %s %s", queue_recover_script,
+                        q->name, q->processing);
+  if (redis_iserror(reply) || reply->type != REDIS_REPLY_INTEGER) {
+    xdebug(0, "queue: recover failed: %s",
+           (reply && reply->str) ? reply->str : "null reply");
+    redis_free(reply);
+    return -1;
+  }
+  n = (int)reply->integer;
+  redis_free(reply);
+
+  if (n > 0)
+    xdebug(0, "queue: %d job(s) recovered from %s", n, q->processing);
+  return n;
+}
+
+
+static void *
+queue_reaper_main(void *arg)
+{
+  REDIS_QUEUE *q = (REDIS_QUEUE *)arg;
+  struct timespec now, ts;
+  size_t *expired = NULL, nexpired, cap = 0, i;
+  long interval;
+
+  xthread_set_name("sredis-reaper");
+
+  interval = (q->lease.tv_sec * 1000L + q->lease.tv_usec / 1000) / 4;
+  if (interval < QUEUE_REAP_MIN_MSEC)
+    interval = QUEUE_REAP_MIN_MSEC;
+
+  pthread_mutex_lock(&q->reaper_mutex);
+  while (!q->stop) {
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += interval / 1000;
+    ts.tv_nsec += (interval % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(&q->reaper_cond, &q->reaper_mutex, &ts);
+    if (q->stop)
+      break;
+    pthread_mutex_unlock(&q->reaper_mutex);
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    nexpired = 0;
+
+    pthread_mutex_lock(&q->mutex);
+    for (i = 0; i < q->nslots; i++) {
+      if (q->slots[i].state != SLOT_INFLIGHT ||
+          !timespec_passed(&q->slots[i].deadline, &now))
+        continue;
+
+      if (nexpired == cap) {
+        size_t *p = realloc(expired, sizeof(*p) * (cap ? cap * 2 : 64));
+        if (!p)
+          break;
+        expired = p;
+        cap = cap ? cap * 2 : 64;
+      }
+      q->slots[i].state = SLOT_ACKED;   /* keep others away */
+      expired[nexpired++] = i;
+    }
+    pthread_mutex_unlock(&q->mutex);
+
+    if (nexpired > 0) {
+      xdebug(0, "queue: requeueing %zu expired job(s)", nexpired);
+      queue_requeue(q, expired, nexpired);
+    }
+
+    pthread_mutex_lock(&q->reaper_mutex);
+  }
+  pthread_mutex_unlock(&q->reaper_mutex);
+
+  free(expired);
+  return NULL;
+}
+
+
+REDIS_QUEUE *
+redis_queue_new(REDIS *redis, const char *name, const char *consumer,
+                const struct timeval *lease)
+{
+  REDIS_QUEUE *q;
+  int ret;
+
+  if (!name || !consumer) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  q = calloc(1, sizeof(*q));
+  if (!q)
+    return NULL;
+
+  q->redis = redis;
+  q->name = strdup(name);
+  if (!q->name || asprintf(&q->processing, "%s:processing:%s",
+                           name, consumer) == -1) {
+    free(q->name);
+    free(q);
+    return NULL;
+  }
+
+  if (lease)
+    q->lease = *lease;
+  q->ack_batch = QUEUE_ACK_BATCH;
+
+  pthread_mutex_init(&q->mutex, NULL);
+  pthread_mutex_init(&q->reaper_mutex, NULL);
+  pthread_cond_init(&q->reaper_cond, NULL);
+
+  /* Not fatal: the script is loaded by the first pop if the server is
+   * not available now. */
+  queue_load_script(q);
+
+  if (q->lease.tv_sec != 0 || q->lease.tv_usec != 0) {
+    ret = pthread_create(&q->reaper, NULL, queue_reaper_main, q);
+    if (ret) {
+      xerror(0, ret, "pthread_create() failed");
+      redis_queue_close(q);
+      return NULL;
+    }
+    q->has_reaper = 1;
+  }
+
+  return q;
+}
+
+
+int
+redis_queue_set_ack_batch(REDIS_QUEUE *q, size_t n)
+{
+  if (n == 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (redis_queue_flush(q) != 0)
+    return -1;
+
+  pthread_mutex_lock(&q->mutex);
+  q->ack_batch = n;
+  pthread_mutex_unlock(&q->mutex);
+  return 0;
+}
+
+
+void
+redis_queue_close(REDIS_QUEUE *q)
+{
+  size_t i;
+
+  if (!q)
+    return;
+
+  if (q->has_reaper) {
+    pthread_mutex_lock(&q->reaper_mutex);
+    q->stop = 1;
+    pthread_cond_signal(&q->reaper_cond);
+    pthread_mutex_unlock(&q->reaper_mutex);
+    pthread_join(q->reaper, NULL);
+  }
+
+  if (redis_queue_flush(q) != 0)
+    xerror(0, 0, "queue: %zu acknowledgement(s) were not sent", q->nacks);
+
+  /* Unacknowledged jobs stay in the processing list; see
+   * redis_queue_recover(). */
+  for (i = 0; i < q->nslots; i++)
+    free(q->slots[i].data);
+  free(q->slots);
+  free(q->acks);
+
+  pthread_cond_destroy(&q->reaper_cond);
+  pthread_mutex_destroy(&q->reaper_mutex);
+  pthread_mutex_destroy(&q->mutex);
+
+  free(q->processing);
+  free(q->name);
+  free(q);
+}
+
+#endif  /* _PTHREAD */
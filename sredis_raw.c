@@ -0,0 +1,568 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "sredis.h"
+#include "sredis_private.h"
+
+/*
+ * Raw replies.
+ *
+ * A raw reply is read without the reply objects of hiredis: the bytes
+ * are left in the buffer of the reader, and redis_resp_scan() only
+ * finds where the reply ends.  Then they are copied verbatim into a
+ * REDIS_RAW, and skipped in the reader.  The scanner keeps its state
+ * between reads, so a big reply arriving in many pieces is scanned
+ * once.
+ *
+ * Push replies of RESP3 are still parsed by hiredis, so that they are
+ * dispatched as before.
+ *
+ * The index of the elements of an array reply is built on the first
+ * access to an element.
+ *
+ * With a handler (see redis_command_parse()), the scanner calls it for
+ * each item as soon as the item is complete in the buffer, and the
+ * bytes are not copied at all.  Since the scanner never goes back, each
+ * item is reported once even if the reply arrives in pieces.
+ */
+
+/* see redisReaderGetReply() of hiredis */
+#define RAW_COMPACT_MIN         1024
+
+struct redis_raw {
+  size_t len;
+  const char *data;             /* the RESP bytes of the reply */
+
+  /* built on demand; see raw_index() */
+  long long count;              /* elements, -1 if not an aggregate,
+                                 * or -2 if not indexed yet */
+  size_t *index;                /* COUNT + 1 offsets in DATA */
+};
+
+
+int
+redis_resp_type(char c)
+{
+  switch (c) {
+  case '+': return REDIS_REPLY_STATUS;
+  case '-': return REDIS_REPLY_ERROR;
+  case ':': return REDIS_REPLY_INTEGER;
+  case '$': return REDIS_REPLY_STRING;
+  case '*': return REDIS_REPLY_ARRAY;
+#ifdef SREDIS_HAVE_RESP3
+  case ',': return REDIS_REPLY_DOUBLE;
+  case '#': return REDIS_REPLY_BOOL;
+  case '_': return REDIS_REPLY_NIL;
+  case '(': return REDIS_REPLY_BIGNUM;
+  case '=': return REDIS_REPLY_VERB;
+  case '!': return REDIS_REPLY_ERROR;
+  case '%': return REDIS_REPLY_MAP;
+  case '~': return REDIS_REPLY_SET;
+  case '>': return REDIS_REPLY_PUSH;
+  case '|': return REDIS_REPLY_ATTR;
+#endif
+  default: return -1;
+  }
+}
+
+
+/*
+ * Parse the header line at P of AVAIL bytes.  On success, *LINE is
+ * the length of the line without CRLF, and *NUM is the number in it
+ * for a bulk string or an aggregate.
+ *
+ * Returns 1 on success, 0 if the line is incomplete, or -1 on a
+ * protocol error.
+ */
+int
+redis_resp_line(const char *p, size_t avail, size_t *line, long long *num)
+{
+  const char *cr;
+  char *end;
+
+  cr = memchr(p, '\r', avail);
+  if (!cr || (size_t)(cr - p) + 2 > avail)
+    return 0;
+  if (cr[1] != '\n')
+    return -1;
+  *line = cr - p;
+
+  switch (redis_resp_type(p[0])) {
+  case REDIS_REPLY_STRING:
+  case REDIS_REPLY_ARRAY:
+#ifdef SREDIS_HAVE_RESP3
+  case REDIS_REPLY_VERB:
+  case REDIS_REPLY_MAP:
+  case REDIS_REPLY_SET:
+  case REDIS_REPLY_PUSH:
+  case REDIS_REPLY_ATTR:
+#endif
+    *num = strtoll(p + 1, &end, 10);
+    if (end != cr)
+      return -1;
+    break;
+  case REDIS_REPLY_ERROR:
+    if (p[0] == '!') {          /* a bulk error */
+      *num = strtoll(p + 1, &end, 10);
+      if (end != cr)
+        return -1;
+    }
+    break;
+  case -1:
+    return -1;
+  }
+  return 1;
+}
+
+
+/* nonzero if the header at P starts an aggregate of elements */
+static int
+resp_is_aggregate(char c)
+{
+  return c == '*' || c == '%' || c == '~' || c == '>' || c == '|';
+}
+
+
+/* nonzero if the header at P is followed by a payload */
+static int
+resp_is_bulk(char c)
+{
+  return c == '$' || c == '=' || c == '!';
+}
+
+
+/* Report the complete scalar item at P to the handler of S. */
+static void
+resp_emit(struct redis_resp_scan *s, const char *p, size_t line,
+          long long num)
+{
+  const struct redis_parse_handler *h = s->handler;
+  const char *payload = p + line + 2;
+
+  switch (p[0]) {
+  case '$':
+  case '=':
+    if (num < 0) {
+      if (h->on_nil)
+        h->on_nil(s->data);
+    }
+    else if (h->on_bulk) {
+      if (p[0] == '=' && num >= 4) {
+        payload += 4;           /* "txt:" */
+        num -= 4;
+      }
+      h->on_bulk(s->data, redis_resp_type(p[0]), payload, num);
+    }
+    break;
+  case '!':
+    if (h->on_error)
+      h->on_error(s->data, payload, num);
+    break;
+  case '-':
+    if (h->on_error)
+      h->on_error(s->data, p + 1, line - 1);
+    break;
+  case '+':
+  case ',':
+  case '(':
+    if (h->on_bulk)
+      h->on_bulk(s->data, redis_resp_type(p[0]), p + 1, line - 1);
+    break;
+  case ':':
+    if (h->on_integer)
+      h->on_integer(s->data, strtoll(p + 1, NULL, 10));
+    break;
+  case '#':
+    if (h->on_integer)
+      h->on_integer(s->data, p[1] == 't');
+    break;
+  case '_':
+    if (h->on_nil)
+      h->on_nil(s->data);
+    break;
+  default:                      /* an aggregate */
+    if (num < 0) {
+      if (h->on_nil)
+        h->on_nil(s->data);
+    }
+    else {
+      /* empty; a non-empty one is reported by redis_resp_scan() */
+      if (h->on_array_begin)
+        h->on_array_begin(s->data, redis_resp_type(p[0]), 0);
+      if (h->on_array_end)
+        h->on_array_end(s->data);
+    }
+    break;
+  }
+}
+
+
+/*
+ * An attribute of RESP3 ('|') is not a reply by itself: it describes
+ * the item that follows it, so it is not counted as an element of the
+ * aggregate around it, and the reply goes on after it.
+ */
+int
+redis_resp_scan(struct redis_resp_scan *s, const char *buf, size_t len)
+{
+  const struct redis_parse_handler *h = s->handler;
+  const char *p;
+  size_t line, item;
+  long long num = 0;
+  int ret, attr;
+
+  while (1) {
+    p = buf + s->off;
+    ret = redis_resp_line(p, len - s->off, &line, &num);
+    if (ret <= 0)
+      return ret;
+
+    item = line + 2;
+    if (resp_is_bulk(p[0]) && num >= 0) {
+      if (s->off + item + num + 2 > len)
+        return 0;
+      item += num + 2;
+    }
+    s->off += item;
+
+    if (resp_is_aggregate(p[0]) && num > 0) {
+      if (s->depth >= REDIS_RESP_DEPTH_MAX)
+        return -1;
+      if (p[0] == '%' || p[0] == '|')
+        num *= 2;
+      s->attr[s->depth] = (p[0] == '|');
+      s->left[s->depth++] = num;
+      if (h && h->on_array_begin)
+        h->on_array_begin(s->data, redis_resp_type(p[0]), num);
+      continue;
+    }
+    if (h)
+      resp_emit(s, p, line, num);
+    if (p[0] == '|')            /* an empty attribute */
+      continue;
+
+    /* an item is complete; so may be the aggregates around it */
+    attr = 0;
+    while (s->depth > 0 && --s->left[s->depth - 1] == 0) {
+      s->depth--;
+      if (h && h->on_array_end)
+        h->on_array_end(s->data);
+      if (s->attr[s->depth]) {
+        attr = 1;               /* its item is still to come */
+        break;
+      }
+    }
+    if (s->depth == 0 && !attr)
+      return 1;
+  }
+}
+
+
+/*
+ * The offset of the item in the LEN bytes at P, after the attributes
+ * in front of it, if any.
+ */
+static size_t
+resp_skip_attrs(const char *p, size_t len)
+{
+  struct redis_resp_scan s;
+  size_t off = 0, line;
+  long long num, i;
+
+  while (off < len && p[off] == '|') {
+    if (redis_resp_line(p + off, len - off, &line, &num) != 1)
+      break;
+    off += line + 2;
+    for (i = 0; i < num * 2; i++) {
+      memset(&s, 0, sizeof(s));
+      if (redis_resp_scan(&s, p + off, len - off) != 1)
+        return len;
+      off += s.off;
+    }
+  }
+  return off;
+}
+
+
+/*
+ * Drop the consumed part of the buffer of READER, as hiredis does in
+ * redisReaderGetReply().
+ */
+static void
+raw_compact(redisReader *reader)
+{
+  if (reader->pos >= RAW_COMPACT_MIN) {
+    sdsrange(reader->buf, reader->pos, -1);
+    reader->pos = 0;
+    reader->len = sdslen(reader->buf);
+  }
+}
+
+
+/* Set up the stand-in of RR for the complete reply at P of LEN bytes. */
+static void
+raw_stand_in(struct redis_raw_read *rr, const char *p, size_t len)
+{
+  size_t line, skip;
+  long long num;
+
+  skip = resp_skip_attrs(p, len);
+  p += skip;
+  len -= skip;
+
+  memset(&rr->top, 0, sizeof(rr->top));
+  rr->top.type = redis_resp_type(p[0]);
+  if (redis_resp_line(p, len, &line, &num) != 1)
+    return;
+
+  if ((resp_is_bulk(p[0]) || resp_is_aggregate(p[0])) && num < 0)
+    rr->top.type = REDIS_REPLY_NIL;
+  else if (p[0] == '+' || p[0] == '-') {
+    if (line - 1 >= sizeof(rr->msg))
+      line = sizeof(rr->msg);
+    memcpy(rr->msg, p + 1, line - 1);
+    rr->msg[line - 1] = '\0';
+    rr->top.str = rr->msg;
+    rr->top.len = line - 1;
+  }
+  else if (p[0] == '!') {       /* a bulk error */
+    if ((size_t)num >= sizeof(rr->msg))
+      num = sizeof(rr->msg) - 1;
+    memcpy(rr->msg, p + line + 2, num);
+    rr->msg[num] = '\0';
+    rr->top.str = rr->msg;
+    rr->top.len = num;
+  }
+}
+
+
+int
+redis_raw_get(struct redis_raw_read *rr, redisContext *ctx, void **reply)
+{
+  redisReader *reader = ctx->reader;
+  const char *buf = reader->buf + reader->pos;
+  size_t len = reader->len - reader->pos;
+  REDIS_RAW *raw;
+  char *p;
+  int ret;
+
+  *reply = NULL;
+
+  /* hiredis is in the middle of a push reply, or one begins */
+  if (reader->ridx >= 0 || (rr->scan.off == 0 && len > 0 && buf[0] == '>'))
+    return redisGetReplyFromReader(ctx, reply);
+
+  if (len == 0)
+    return REDIS_OK;
+  ret = redis_resp_scan(&rr->scan, buf, len);
+  if (ret < 0) {
+    ctx->err = REDIS_ERR_PROTOCOL;
+    snprintf(ctx->errstr, sizeof(ctx->errstr), "Protocol error");
+    return REDIS_ERR;
+  }
+  if (ret == 0)
+    return REDIS_OK;
+
+  len = rr->scan.off;
+  if (!rr->scan.handler) {
+    p = malloc(sizeof(*raw) + len + 1);
+    if (!p) {
+      ctx->err = REDIS_ERR_OOM;
+      snprintf(ctx->errstr, sizeof(ctx->errstr), "Out of memory");
+      return REDIS_ERR;
+    }
+    raw = (REDIS_RAW *)p;
+    raw->len = len;
+    raw->data = p + sizeof(*raw);
+    raw->count = -2;            /* not indexed yet */
+    raw->index = NULL;
+    memcpy(p + sizeof(*raw), buf, len);
+    p[sizeof(*raw) + len] = '\0';
+    rr->raw = raw;
+  }
+
+  /* a stand-in, so that the callers can check the reply as usual */
+  raw_stand_in(rr, buf, len);
+  *reply = &rr->top;
+
+  reader->pos += len;
+  raw_compact(reader);
+  rr->scan.off = 0;
+  rr->scan.depth = 0;
+  return REDIS_OK;
+}
+
+
+/*
+ * Index the elements of RAW.  Returns the number of elements, or -1
+ * if RAW is not an aggregate (or on failure).
+ */
+static long long
+raw_index(REDIS_RAW *raw)
+{
+  struct redis_resp_scan s;
+  size_t line, off;
+  long long num, i;
+
+  if (raw->count != -2)
+    return raw->count;
+
+  raw->count = -1;
+  off = resp_skip_attrs(raw->data, raw->len);
+  if (off >= raw->len || !resp_is_aggregate(raw->data[off]) ||
+      redis_resp_line(raw->data + off, raw->len - off, &line, &num) != 1 ||
+      num < 0)
+    return -1;
+  if (raw->data[off] == '%')
+    num *= 2;
+
+  raw->index = malloc((num + 1) * sizeof(*raw->index));
+  if (!raw->index)
+    return -1;
+
+  off += line + 2;
+  for (i = 0; i < num; i++) {
+    raw->index[i] = off;
+    memset(&s, 0, sizeof(s));
+    if (redis_resp_scan(&s, raw->data + off, raw->len - off) != 1) {
+      free(raw->index);
+      raw->index = NULL;
+      return -1;
+    }
+    off += s.off;
+  }
+  raw->index[num] = off;
+  raw->count = num;
+  return num;
+}
+
+
+const char *
+redis_raw_data(const REDIS_RAW *raw, size_t *len)
+{
+  *len = raw->len;
+  return raw->data;
+}
+
+
+int
+redis_raw_type(const REDIS_RAW *raw)
+{
+  size_t line, off;
+  long long num;
+
+  off = resp_skip_attrs(raw->data, raw->len);
+  if (off >= raw->len)
+    return -1;
+  if ((resp_is_bulk(raw->data[off]) || resp_is_aggregate(raw->data[off])) &&
+      redis_resp_line(raw->data + off, raw->len - off, &line, &num) == 1 &&
+      num < 0)
+    return REDIS_REPLY_NIL;
+  return redis_resp_type(raw->data[off]);
+}
+
+
+long long
+redis_raw_elements(REDIS_RAW *raw)
+{
+  return raw_index(raw);
+}
+
+
+const char *
+redis_raw_element_data(REDIS_RAW *raw, size_t index, size_t *len)
+{
+  if (raw_index(raw) < 0 || index >= (size_t)raw->count) {
+    errno = EINVAL;
+    return NULL;
+  }
+  *len = raw->index[index + 1] - raw->index[index];
+  return raw->data + raw->index[index];
+}
+
+
+const char *
+redis_raw_str(REDIS_RAW *raw, size_t index, size_t *len)
+{
+  const char *p;
+  size_t elen, line, skip;
+  long long num;
+
+  p = redis_raw_element_data(raw, index, &elen);
+  if (!p)
+    return NULL;
+  skip = resp_skip_attrs(p, elen);
+  p += skip;
+  elen -= skip;
+  if (redis_resp_line(p, elen, &line, &num) != 1)
+    return NULL;
+
+  switch (p[0]) {
+  case '+': case '-': case ':': case ',': case '(':
+    *len = line - 1;
+    return p + 1;
+  case '$': case '!':
+    if (num < 0)
+      return NULL;
+    *len = num;
+    return p + line + 2;
+  case '=':                     /* "txt:" */
+    if (num < 4)
+      return NULL;
+    *len = num - 4;
+    return p + line + 2 + 4;
+  default:
+    errno = EINVAL;
+    return NULL;
+  }
+}
+
+
+/* Decode the LEN bytes at P, which hold one reply. */
+static redisReply *
+raw_decode(const char *p, size_t len)
+{
+  redisReader *reader;
+  void *reply = NULL;
+
+  reader = redisReaderCreate();
+  if (!reader)
+    return NULL;
+  if (redisReaderFeed(reader, p, len) != REDIS_OK ||
+      redisReaderGetReply(reader, &reply) != REDIS_OK)
+    reply = NULL;
+  redisReaderFree(reader);
+  return reply;
+}
+
+
+redisReply *
+redis_raw_element(REDIS_RAW *raw, size_t index)
+{
+  const char *p;
+  size_t len;
+
+  p = redis_raw_element_data(raw, index, &len);
+  if (!p)
+    return NULL;
+  return raw_decode(p, len);
+}
+
+
+redisReply *
+redis_raw_decode(const REDIS_RAW *raw)
+{
+  return raw_decode(raw->data, raw->len);
+}
+
+
+void
+redis_raw_free(REDIS_RAW *raw)
+{
+  if (!raw)
+    return;
+  free(raw->index);
+  free(raw);
+}
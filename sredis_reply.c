@@ -0,0 +1,228 @@
+#include <stdlib.h>
+#include <errno.h>
+
+#include "sredis.h"
+#include "sredis_private.h"
+
+#ifndef FALSE
+#define FALSE   0
+#define TRUE    (!FALSE)
+#endif
+
+/*
+ * Shared replies.
+ *
+ * A redisReply of hiredis has no room for a reference count, so the
+ * counts of the shared replies are kept in a hash table keyed by the
+ * address of the reply.  redis_free() looks up the table only if
+ * there is any shared reply at all, so unshared replies cost one
+ * load.
+ *
+ * A slice (see redis_reply_slice()) has its own entry, whose ROOT is
+ * the top-level reply it belongs to.  The entry holds one reference
+ * to ROOT, which is dropped when the slice is released for the last
+ * time; the slice itself is freed along with ROOT.
+ */
+
+#define SHARED_BUCKETS          1024    /* must be a power of 2 */
+#define SHARED_LOCKS            64      /* must be a power of 2 */
+
+struct shared_reply {
+  struct shared_reply *next;
+  const redisReply *reply;
+  redisReply *root;             /* NULL if REPLY is the top-level one */
+  int refs;
+};
+
+static struct shared_reply *shared[SHARED_BUCKETS];
+static unsigned shared_count;   /* entries in SHARED */
+
+#ifdef _PTHREAD
+static pthread_mutex_t shared_locks[SHARED_LOCKS] = {
+  [0 ... SHARED_LOCKS - 1] = PTHREAD_MUTEX_INITIALIZER,
+};
+# define shared_mutex(b)        (&shared_locks[(b) & (SHARED_LOCKS - 1)])
+# define shared_lock(b)         pthread_mutex_lock(shared_mutex(b))
+# define shared_unlock(b)       pthread_mutex_unlock(shared_mutex(b))
+#else
+# define shared_lock(b)         (void)0
+# define shared_unlock(b)       (void)0
+#endif  /* _PTHREAD */
+
+
+static unsigned
+shared_bucket(const redisReply *reply)
+{
+  unsigned long p = (unsigned long)reply;
+
+  p ^= p >> 17;
+  p *= 0x9e3779b1UL;
+  return (unsigned)(p >> 7) & (SHARED_BUCKETS - 1);
+}
+
+
+/* Called with the lock of bucket B held. */
+static struct shared_reply *
+shared_find(unsigned b, const redisReply *reply)
+{
+  struct shared_reply *ent;
+
+  for (ent = shared[b]; ent; ent = ent->next) {
+    if (ent->reply == reply)
+      return ent;
+  }
+  return NULL;
+}
+
+
+/*
+ * Add REFS references to REPLY.  If REPLY is not shared yet, it has
+ * OWNERS references already (1 for a reply held by the caller, 0 for
+ * a new slice of ROOT).
+ *
+ * Returns 1 if a new entry is created, 0 if REPLY was shared already,
+ * or -1 on failure.
+ */
+static int
+shared_add(redisReply *reply, redisReply *root, int owners, int refs)
+{
+  struct shared_reply *ent;
+  unsigned b = shared_bucket(reply);
+
+  shared_lock(b);
+  ent = shared_find(b, reply);
+  if (ent) {
+    ent->refs += refs;
+    shared_unlock(b);
+    return 0;
+  }
+
+  ent = malloc(sizeof(*ent));
+  if (!ent) {
+    shared_unlock(b);
+    return -1;
+  }
+  ent->reply = reply;
+  ent->root = root;
+  ent->refs = owners + refs;
+  ent->next = shared[b];
+  shared[b] = ent;
+  __sync_fetch_and_add(&shared_count, 1);
+  shared_unlock(b);
+  return 1;
+}
+
+
+/* Return the top-level reply of REPLY, which may be a slice. */
+static redisReply *
+shared_root(redisReply *reply)
+{
+  struct shared_reply *ent;
+  redisReply *root = reply;
+  unsigned b;
+
+  if (*(volatile unsigned *)&shared_count == 0)
+    return reply;
+
+  b = shared_bucket(reply);
+  shared_lock(b);
+  ent = shared_find(b, reply);
+  if (ent && ent->root)
+    root = ent->root;
+  shared_unlock(b);
+  return root;
+}
+
+
+int
+redis_reply_share(redisReply *reply, int refs)
+{
+  if (!reply || refs < 1) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (refs == 1)
+    return 0;
+  return (shared_add(reply, NULL, 1, refs - 1) < 0) ? -1 : 0;
+}
+
+
+int
+redis_reply_release(redisReply *reply)
+{
+  struct shared_reply **pp, *ent = NULL;
+  redisReply *root = NULL;
+  unsigned b;
+  int last = FALSE;
+
+  if (*(volatile unsigned *)&shared_count == 0)
+    return FALSE;
+
+  b = shared_bucket(reply);
+  shared_lock(b);
+  for (pp = &shared[b]; *pp; pp = &(*pp)->next) {
+    if ((*pp)->reply == reply) {
+      ent = *pp;
+      if (--ent->refs == 0) {
+        *pp = ent->next;
+        __sync_fetch_and_sub(&shared_count, 1);
+        root = ent->root;
+        last = TRUE;
+      }
+      break;
+    }
+  }
+  shared_unlock(b);
+
+  if (!ent)
+    return FALSE;
+  if (last) {
+    free(ent);
+    if (root)
+      redis_free(root);         /* a slice is freed along with ROOT */
+    else
+      freeReplyObject(reply);
+  }
+  return TRUE;
+}
+
+
+redisReply *
+redis_reply_retain(redisReply *reply)
+{
+  if (!reply) {
+    errno = EINVAL;
+    return NULL;
+  }
+  if (shared_add(reply, NULL, 1, 1) < 0)
+    return NULL;
+  return reply;
+}
+
+
+redisReply *
+redis_reply_slice(redisReply *reply, size_t index)
+{
+  redisReply *root, *elem;
+  int ret;
+
+  if (!reply || !reply->element || index >= reply->elements) {
+    errno = EINVAL;
+    return NULL;
+  }
+  elem = reply->element[index];
+  root = shared_root(reply);
+
+  /* The entry of ELEM holds a reference to ROOT; take it first, so
+   * that ROOT stays alive whatever happens to ELEM meanwhile. */
+  if (!redis_reply_retain(root))
+    return NULL;
+  ret = shared_add(elem, root, 0, 1);
+  if (ret < 0) {
+    redis_free(root);
+    return NULL;
+  }
+  if (ret == 0)
+    redis_free(root);           /* ELEM holds a reference already */
+  return elem;
+}
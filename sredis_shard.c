@@ -0,0 +1,780 @@
+#include <assert.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "sredis.h"
+#include "sredis_stats.h"
+#include "sredis_private.h"
+
+#ifndef FALSE
+#define FALSE   0
+#define TRUE    (!FALSE)
+#endif
+
+/*
+ * Client-side sharding.
+ *
+ * The ring is a sorted array of points.  A point of the shard NAME is
+ * the hash of "NAME-I" for I in [0, weight * REDIS_SHARD_POINTS), as
+ * in ketama.  A lookup is a binary search for the first point at or
+ * after the hash of the key, wrapping around to the first point.
+ *
+ * Adding a shard builds a new ring and swaps it under the write lock.
+ * Shards are never removed, so a REDIS returned by a lookup stays
+ * valid until redis_shard_close().
+ *
+ * The pipeline of a REDIS_SHARD is the pipelines of its shards, plus
+ * ORDER, the shard of each queued command, so that redis_shard_exec()
+ * can put the replies back in the order of redis_shard_append().
+ */
+
+#define SHARD_NAME_MAX          64
+#define SHARD_ORDER_MIN         64
+
+#ifdef _PTHREAD
+# define shard_rdlock(s)        pthread_rwlock_rdlock(&(s)->lock)
+# define shard_wrlock(s)        pthread_rwlock_wrlock(&(s)->lock)
+# define shard_unlock(s)        pthread_rwlock_unlock(&(s)->lock)
+#else
+# define shard_rdlock(s)        (void)0
+# define shard_wrlock(s)        (void)0
+# define shard_unlock(s)        (void)0
+#endif  /* _PTHREAD */
+
+struct shard_point {
+  unsigned hash;
+  unsigned tie;                 /* the hash of the name of SHARD */
+  int shard;
+};
+
+struct shard_ent {
+  REDIS *redis;
+  char *name;
+  unsigned weight;
+};
+
+struct redis_shard {
+  struct shard_ent shards[REDIS_SHARDS_MAX];
+  int nshards;
+
+  struct shard_point *ring;
+  size_t npoints;
+
+  int *order;                   /* see the top of this file */
+  size_t norder;
+  size_t order_size;
+
+#ifdef _PTHREAD
+  pthread_rwlock_t lock;        /* for SHARDS and RING */
+#endif
+};
+
+
+/* FNV-1a, with the finalizer of MurmurHash3 for short similar keys */
+static unsigned
+shard_hash(const char *key, size_t len)
+{
+  unsigned long long h = 0xcbf29ce484222325ULL;
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    h ^= (unsigned char)key[i];
+    h *= 0x100000001b3ULL;
+  }
+
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return (unsigned)(h >> 32);
+}
+
+
+/*
+ * Return the hash of KEY, or of its hash tag if any.
+ */
+static unsigned
+shard_key_hash(const char *key, size_t len)
+{
+  const char *open, *close;
+
+  open = memchr(key, '{', len);
+  if (open) {
+    close = memchr(open + 1, '}', len - (open + 1 - key));
+    if (close && close > open + 1)
+      return shard_hash(open + 1, close - open - 1);
+  }
+  return shard_hash(key, len);
+}
+
+
+static int
+shard_point_cmp(const void *a, const void *b)
+{
+  const struct shard_point *p = a, *q = b;
+
+  if (p->hash != q->hash)
+    return p->hash < q->hash ? -1 : 1;
+  /* ties are broken by the names, to be independent of the order */
+  if (p->tie != q->tie)
+    return p->tie < q->tie ? -1 : 1;
+  return 0;
+}
+
+
+/*
+ * Build the ring of the shards in S, plus the shard NEW of WEIGHT
+ * named NAME.  Returns NULL on failure.
+ */
+static struct shard_point *
+shard_ring(struct redis_shard *s, const char *name, unsigned weight,
+           int new, size_t *npoints)
+{
+  struct shard_point *ring;
+  char buf[SHARD_NAME_MAX + 16];
+  size_t n, total = 0;
+  unsigned i, tie = shard_hash(name, strlen(name));
+  int j;
+
+  for (j = 0; j < s->nshards; j++)
+    total += (size_t)s->shards[j].weight * REDIS_SHARD_POINTS;
+  total += (size_t)weight * REDIS_SHARD_POINTS;
+
+  ring = malloc(total * sizeof(*ring));
+  if (!ring)
+    return NULL;
+
+  if (s->npoints > 0)
+    memcpy(ring, s->ring, s->npoints * sizeof(*ring));
+  n = s->npoints;
+
+  for (i = 0; i < weight * REDIS_SHARD_POINTS; i++) {
+    int len = snprintf(buf, sizeof(buf), "%s-%u", name, i);
+
+    ring[n].hash = shard_hash(buf, len);
+    ring[n].tie = tie;
+    ring[n].shard = new;
+    n++;
+  }
+  assert(n == total);
+
+  *npoints = n;
+  return ring;
+}
+
+
+REDIS_SHARD *
+redis_shard_new(void)
+{
+  struct redis_shard *s;
+
+  s = calloc(1, sizeof(*s));
+  if (!s)
+    return NULL;
+
+#ifdef _PTHREAD
+  {
+    int ret = pthread_rwlock_init(&s->lock, NULL);
+    if (ret) {
+      free(s);
+      errno = ret;
+      return NULL;
+    }
+  }
+#endif
+
+  return s;
+}
+
+
+void
+redis_shard_close(REDIS_SHARD *s)
+{
+  int i;
+
+  if (!s)
+    return;
+
+  for (i = 0; i < s->nshards; i++) {
+    redis_close(s->shards[i].redis);
+    free(s->shards[i].name);
+  }
+  free(s->ring);
+  free(s->order);
+#ifdef _PTHREAD
+  pthread_rwlock_destroy(&s->lock);
+#endif
+  free(s);
+}
+
+
+int
+redis_shard_add(REDIS_SHARD *s, const char *name, REDIS *redis,
+                unsigned weight)
+{
+  struct shard_point *ring, *old;
+  size_t npoints;
+  char *dup;
+  int i, index;
+
+  if (!name || !redis || strlen(name) >= SHARD_NAME_MAX) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (weight == 0)
+    weight = 1;
+
+  dup = strdup(name);
+  if (!dup)
+    return -1;
+
+  shard_wrlock(s);
+
+  for (i = 0; i < s->nshards; i++) {
+    if (strcmp(s->shards[i].name, name) == 0) {
+      shard_unlock(s);
+      free(dup);
+      errno = EEXIST;
+      return -1;
+    }
+  }
+  if (s->nshards >= REDIS_SHARDS_MAX) {
+    shard_unlock(s);
+    free(dup);
+    errno = ENOSPC;
+    return -1;
+  }
+
+  index = s->nshards;
+  ring = shard_ring(s, name, weight, index, &npoints);
+  if (!ring) {
+    shard_unlock(s);
+    free(dup);
+    return -1;
+  }
+
+  s->shards[index].redis = redis;
+  s->shards[index].name = dup;
+  s->shards[index].weight = weight;
+  s->nshards++;
+
+  qsort(ring, npoints, sizeof(*ring), shard_point_cmp);
+  old = s->ring;
+  s->ring = ring;
+  s->npoints = npoints;
+
+  shard_unlock(s);
+
+  free(old);
+  xdebug(0, "shard %s added with %zu points", name,
+         (size_t)weight * REDIS_SHARD_POINTS);
+  return index;
+}
+
+
+int
+redis_shard_count(REDIS_SHARD *s)
+{
+  int n;
+
+  shard_rdlock(s);
+  n = s->nshards;
+  shard_unlock(s);
+  return n;
+}
+
+
+REDIS *
+redis_shard_at(REDIS_SHARD *s, int index)
+{
+  REDIS *redis = NULL;
+
+  shard_rdlock(s);
+  if (index >= 0 && index < s->nshards)
+    redis = s->shards[index].redis;
+  shard_unlock(s);
+  return redis;
+}
+
+
+/*
+ * Return the index of the shard of KEY, or -1 if S has no shard.  If
+ * KEY is NULL, the first shard.
+ */
+static int
+shard_lookup(struct redis_shard *s, const char *key, size_t len)
+{
+  size_t lo, hi, mid;
+  unsigned h;
+  int shard;
+
+  shard_rdlock(s);
+
+  if (s->nshards == 0)
+    shard = -1;
+  else if (!key)
+    shard = 0;
+  else {
+    h = shard_key_hash(key, len);
+    lo = 0;
+    hi = s->npoints;
+    while (lo < hi) {
+      mid = lo + (hi - lo) / 2;
+      if (s->ring[mid].hash < h)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    if (lo == s->npoints)
+      lo = 0;
+    shard = s->ring[lo].shard;
+  }
+
+  shard_unlock(s);
+  return shard;
+}
+
+
+REDIS *
+redis_shard_get(REDIS_SHARD *s, const char *key, size_t len)
+{
+  int shard = shard_lookup(s, key, len);
+
+  if (shard < 0)
+    return NULL;
+  return redis_shard_at(s, shard);
+}
+
+
+/*
+ * Find the first argument of the command in FORMAT, without
+ * formatting it if possible.  See redis_shard_command() in sredis.h.
+ *
+ * Returns the index of the shard, or -1 with errno set.
+ */
+static int
+shard_vroute(struct redis_shard *s, const char *format, va_list ap)
+{
+  const char *p = format, *key = NULL;
+  size_t len = 0;
+  char *cmd = NULL;
+  va_list aq;
+  int shard;
+
+  va_copy(aq, ap);
+
+  /* the command */
+  p += strspn(p, " ");
+  if (strncmp(p, "%s", 2) == 0 && (p[2] == ' ' || p[2] == '\0')) {
+    (void)va_arg(aq, const char *);
+    p += 2;
+  }
+  else {
+    len = strcspn(p, " ");
+    if (memchr(p, '%', len))
+      goto slow;
+    p += len;
+  }
+
+  /* the key */
+  p += strspn(p, " ");
+  len = strcspn(p, " ");
+  if (len == 0)
+    key = NULL;
+  else if (len == 2 && strncmp(p, "%s", 2) == 0) {
+    key = va_arg(aq, const char *);
+    len = key ? strlen(key) : 0;
+  }
+  else if (len == 2 && strncmp(p, "%b", 2) == 0) {
+    key = va_arg(aq, const char *);
+    len = va_arg(aq, size_t);
+  }
+  else if (!memchr(p, '%', len))
+    key = p;
+  else
+    goto slow;
+
+  va_end(aq);
+  shard = shard_lookup(s, key, len);
+  if (shard < 0)
+    errno = ENOENT;
+  return shard;
+
+ slow:
+  va_end(aq);
+  va_copy(aq, ap);
+  if (redisvFormatCommand(&cmd, format, aq) < 0) {
+    va_end(aq);
+    errno = EINVAL;
+    return -1;
+  }
+  va_end(aq);
+
+  key = redis_stats_argp(cmd, 1, &len);
+  shard = shard_lookup(s, key, len);
+  redisFreeCommand(cmd);
+
+  if (shard < 0)
+    errno = ENOENT;
+  return shard;
+}
+
+
+redisReply *
+redis_shard_command(REDIS_SHARD *s, const char *format, ...)
+{
+  va_list ap;
+  redisReply *reply = NULL;
+  int shard;
+
+  va_start(ap, format);
+  shard = shard_vroute(s, format, ap);
+  if (shard >= 0)
+    reply = redis_vcommand(redis_shard_at(s, shard), TRUE, format, ap);
+  va_end(ap);
+
+  return reply;
+}
+
+
+int
+redis_shard_append(REDIS_SHARD *s, const char *format, ...)
+{
+  va_list ap;
+  REDIS *redis;
+  int shard, ret;
+
+  if (s->norder == s->order_size) {
+    size_t size = s->order_size ? s->order_size * 2 : SHARD_ORDER_MIN;
+    int *order = realloc(s->order, size * sizeof(*order));
+
+    if (!order)
+      return REDIS_ERR;
+    s->order = order;
+    s->order_size = size;
+  }
+
+  va_start(ap, format);
+  shard = shard_vroute(s, format, ap);
+  if (shard < 0) {
+    va_end(ap);
+    return REDIS_ERR;
+  }
+
+  redis = redis_shard_at(s, shard);
+  redis_lock(redis);
+  ret = redis_vappend(redis, format, ap);
+  redis_unlock(redis);
+  va_end(ap);
+
+  if (ret == REDIS_OK)
+    s->order[s->norder++] = shard;
+  return ret;
+}
+
+
+/*
+ * Lock the shards with COUNT[i] > 0, in the order of the index, so
+ * that two callers never wait for each other.
+ */
+static void
+shard_lock_all(struct redis_shard *s, const size_t *count, int nshards)
+{
+  int shard;
+
+  for (shard = 0; shard < nshards; shard++) {
+    if (count[shard] > 0)
+      redis_lock(redis_shard_at(s, shard));
+  }
+}
+
+
+static void
+shard_unlock_all(struct redis_shard *s, const size_t *count, int nshards)
+{
+  int shard;
+
+  for (shard = 0; shard < nshards; shard++) {
+    if (count[shard] > 0)
+      redis_unlock(redis_shard_at(s, shard));
+  }
+}
+
+
+/*
+ * Send the pipelines of the shards locked by shard_lock_all() at
+ * once, then read the replies of each into REPLIES, and unlock the
+ * shards.  So the latency is that of the slowest shard, not the sum.
+ *
+ * Returns zero if every shard returned COUNT[i] replies, otherwise -1.
+ */
+static int
+shard_exec_locked(struct redis_shard *s, const size_t *count,
+                  redisReply **replies, int nshards)
+{
+  REDIS *redis;
+  int shard, ret = 0;
+
+  for (shard = 0; shard < nshards; shard++) {
+    if (count[shard] > 0)
+      redis_send_unlocked(redis_shard_at(s, shard));
+  }
+
+  for (shard = 0; shard < nshards; shard++) {
+    if (count[shard] == 0)
+      continue;
+    redis = redis_shard_at(s, shard);
+    replies[shard] = redis_exec_unlocked(redis);
+    redis_unlock(redis);
+
+    /* a reconnection while appending drops the queued commands */
+    if (!replies[shard] || replies[shard]->elements != count[shard])
+      ret = -1;
+  }
+  return ret;
+}
+
+
+static redisReply *
+shard_array(size_t elements)
+{
+  redisReply *r = calloc(1, sizeof(*r));
+
+  if (!r)
+    return NULL;
+  r->type = REDIS_REPLY_ARRAY;
+  r->element = calloc(elements, sizeof(redisReply *));
+  if (!r->element) {
+    free(r);
+    return NULL;
+  }
+  r->elements = elements;
+  return r;
+}
+
+
+redisReply *
+redis_shard_exec(REDIS_SHARD *s)
+{
+  redisReply *packed = NULL, *replies[REDIS_SHARDS_MAX] = { NULL, };
+  size_t count[REDIS_SHARDS_MAX] = { 0, }, next[REDIS_SHARDS_MAX] = { 0, };
+  size_t i;
+  int shard, nshards;
+
+  if (s->norder == 0)
+    return NULL;
+
+  for (i = 0; i < s->norder; i++)
+    count[s->order[i]]++;
+
+  nshards = redis_shard_count(s);
+  shard_lock_all(s, count, nshards);
+  if (shard_exec_locked(s, count, replies, nshards) == 0) {
+    packed = shard_array(s->norder);
+    if (!packed)
+      xerror(0, errno, "can't allocate memory for redisReply *");
+  }
+
+  if (packed) {
+    /* move the replies; the per-shard arrays are freed empty */
+    for (i = 0; i < s->norder; i++) {
+      shard = s->order[i];
+      packed->element[i] = replies[shard]->element[next[shard]];
+      replies[shard]->element[next[shard]++] = NULL;
+    }
+  }
+
+  for (shard = 0; shard < nshards; shard++)
+    redis_free(replies[shard]);
+  s->norder = 0;
+
+  return packed;
+}
+
+
+/* how shard_scatter() merges the replies of the shards */
+enum { MERGE_ARRAY, MERGE_STATUS, MERGE_SUM };
+
+/*
+ * Split the command COMMAND with N keys (and N values if VALUES is
+ * non-null) by shard, send one command to each shard at once, and
+ * merge the replies.  See redis_shard_mget() in sredis.h.
+ */
+static redisReply *
+shard_scatter(struct redis_shard *s, const char *command, int merge,
+              size_t n, const char **keys, const size_t *keylens,
+              const char **values, const size_t *valuelens)
+{
+  redisReply *merged = NULL, *replies[REDIS_SHARDS_MAX] = { NULL, };
+  redisReply *sub;
+  size_t count[REDIS_SHARDS_MAX] = { 0, }, next[REDIS_SHARDS_MAX] = { 0, };
+  size_t start[REDIS_SHARDS_MAX];
+  size_t stride = values ? 2 : 1;
+  size_t i, pos, len;
+  const char **argv = NULL;
+  size_t *argvlen = NULL;
+  int *shard_of = NULL;
+  int shard, nshards, ret;
+
+  if (n == 0 || !keys) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  shard_of = malloc(n * sizeof(*shard_of));
+  argv = malloc((n * stride + REDIS_SHARDS_MAX) * sizeof(*argv));
+  argvlen = malloc((n * stride + REDIS_SHARDS_MAX) * sizeof(*argvlen));
+  if (!shard_of || !argv || !argvlen)
+    goto end;
+
+  for (i = 0; i < n; i++) {
+    len = keylens ? keylens[i] : strlen(keys[i]);
+    shard_of[i] = shard_lookup(s, keys[i], len);
+    if (shard_of[i] < 0) {
+      errno = ENOENT;
+      goto end;
+    }
+    count[shard_of[i]]++;
+  }
+
+  /* the arguments of the command to each shard are contiguous */
+  nshards = redis_shard_count(s);
+  for (shard = 0, pos = 0; shard < nshards; shard++) {
+    start[shard] = pos;
+    if (count[shard] == 0)
+      continue;
+    argv[pos] = command;
+    argvlen[pos] = strlen(command);
+    pos += 1 + count[shard] * stride;
+    next[shard] = start[shard] + 1;
+  }
+  for (i = 0; i < n; i++) {
+    pos = next[shard_of[i]];
+    argv[pos] = keys[i];
+    argvlen[pos] = keylens ? keylens[i] : strlen(keys[i]);
+    if (values) {
+      argv[pos + 1] = values[i];
+      argvlen[pos + 1] = valuelens ? valuelens[i] : strlen(values[i]);
+    }
+    next[shard_of[i]] += stride;
+  }
+
+  shard_lock_all(s, count, nshards);
+
+  /* The commands queued by redis_shard_append() (or redis_append())
+   * would be sent along with ours, and their replies taken. */
+  for (shard = 0; shard < nshards; shard++) {
+    if (count[shard] > 0 && redis_shard_at(s, shard)->stacked != 0) {
+      shard_unlock_all(s, count, nshards);
+      errno = EBUSY;
+      goto end;
+    }
+  }
+
+  for (shard = 0; shard < nshards; shard++) {
+    if (count[shard] == 0)
+      continue;
+    /* on failure, the shard returns no reply in shard_exec_locked() */
+    redis_append_argv_unlocked(redis_shard_at(s, shard),
+                               1 + count[shard] * stride,
+                               argv + start[shard], argvlen + start[shard]);
+    count[shard] = 1;           /* one reply from each shard */
+  }
+  ret = shard_exec_locked(s, count, replies, nshards);
+  if (ret != 0)
+    goto end;
+
+  /* an error reply of any shard is the result */
+  for (shard = 0; shard < nshards; shard++) {
+    if (!replies[shard])
+      continue;
+    sub = replies[shard]->element[0];
+    if (sub->type == REDIS_REPLY_ERROR) {
+      merged = sub;
+      replies[shard]->element[0] = NULL;
+      goto end;
+    }
+  }
+
+  if (merge == MERGE_ARRAY) {
+    merged = shard_array(n);
+    if (!merged)
+      goto end;
+
+    memset(next, 0, sizeof(next));
+    for (i = 0; i < n; i++) {
+      sub = replies[shard_of[i]]->element[0];
+      if (sub->type != REDIS_REPLY_ARRAY ||
+          next[shard_of[i]] >= sub->elements) {
+        xdebug(0, "unexpected reply of %s from shard %d", command,
+               shard_of[i]);
+        redis_free(merged);
+        merged = NULL;
+        goto end;
+      }
+      merged->element[i] = sub->element[next[shard_of[i]]];
+      sub->element[next[shard_of[i]]++] = NULL;
+    }
+  }
+  else {
+    /* reuse the reply of the first shard */
+    for (shard = 0; shard < nshards; shard++) {
+      if (!replies[shard])
+        continue;
+      sub = replies[shard]->element[0];
+      if (merge == MERGE_SUM && sub->type != REDIS_REPLY_INTEGER) {
+        xdebug(0, "unexpected reply of %s from shard %d", command, shard);
+        redis_free(merged);
+        merged = NULL;
+        goto end;
+      }
+      if (!merged) {
+        merged = sub;
+        replies[shard]->element[0] = NULL;
+      }
+      else if (merge == MERGE_SUM)
+        merged->integer += sub->integer;
+    }
+  }
+
+ end:
+  for (shard = 0; shard < REDIS_SHARDS_MAX; shard++)
+    redis_free(replies[shard]);
+  free(argvlen);
+  free(argv);
+  free(shard_of);
+  return merged;
+}
+
+
+redisReply *
+redis_shard_mget(REDIS_SHARD *s, size_t n,
+                 const char **keys, const size_t *keylens)
+{
+  return shard_scatter(s, "MGET", MERGE_ARRAY, n, keys, keylens, NULL, NULL);
+}
+
+
+redisReply *
+redis_shard_mset(REDIS_SHARD *s, size_t n,
+                 const char **keys, const size_t *keylens,
+                 const char **values, const size_t *valuelens)
+{
+  if (!values) {
+    errno = EINVAL;
+    return NULL;
+  }
+  return shard_scatter(s, "MSET", MERGE_STATUS, n, keys, keylens,
+                       values, valuelens);
+}
+
+
+redisReply *
+redis_shard_del(REDIS_SHARD *s, size_t n,
+                const char **keys, const size_t *keylens)
+{
+  return shard_scatter(s, "DEL", MERGE_SUM, n, keys, keylens, NULL, NULL);
+}
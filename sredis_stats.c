@@ -0,0 +1,863 @@
+#define _GNU_SOURCE     1       /* open_memstream(3) */
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+
+#include "sredis.h"
+#include "sredis_stats.h"
+
+/*
+ * Latency statistics.
+ *
+ * A histogram has 16 linear sub-buckets for each power of two of
+ * nanoseconds (HdrHistogram with 4 sub-bucket bits), so that every
+ * recorded value is within 1/16 (6.25%) of the real one.  Values
+ * below 16ns are exact, and values of 2^40ns (about 18 minutes) or
+ * more are clamped.
+ *
+ * Every counter is updated with an atomic add, since the statistics
+ * are shared by the lanes of a REDIS (see redis_set_blocking_lanes()),
+ * which run without the REDIS mutex.  Latencies are allocated on the
+ * first use of the command, or the host.
+ *
+ * The slow log is a ring of REDIS_SLOWLOG_LEN slots.  A writer takes
+ * an id with an atomic increment, and owns the slot (id % LEN) while
+ * its sequence number is odd.  A reader copies a slot, and keeps the
+ * copy only if the sequence number was the same, and even, before and
+ * after the copy.  If two writers race for a slot, the later one
+ * drops its entry.
+ */
+
+#define HIST_SUB_BITS           4
+#define HIST_SUB_COUNT          (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS           40
+
+#define STATS_COMMANDS_MAX      64      /* must be a power of 2 */
+#define STATS_NAME_MAX          24
+#define STATS_PIPELINE          "(pipeline)"
+#define STATS_OTHER             "(other)"
+
+enum { SLOT_EMPTY, SLOT_BUSY, SLOT_READY };
+
+struct stats_latency {
+  struct redis_histogram phase[REDIS_PHASE_MAX];
+};
+
+struct stats_command {
+  int state;
+  char name[STATS_NAME_MAX];
+  struct stats_latency *lat;
+};
+
+struct redis_stats {
+  struct stats_command commands[STATS_COMMANDS_MAX];
+  struct stats_latency *other;  /* commands that do not fit */
+  struct stats_latency *hosts[REDIS_HOSTS_MAX];
+
+  unsigned long long counters[REDIS_COUNTER_MAX];
+  unsigned long long host_counters[REDIS_HOSTS_MAX][REDIS_COUNTER_MAX];
+  int last_host;                /* the host of the last connection */
+
+  unsigned long long slow_ns;   /* 0 if the slow log is off */
+  unsigned long long slow_next; /* the next id */
+  unsigned long long slow_reset; /* ids below this are forgotten */
+  struct slowlog_slot *slowlog;
+};
+
+struct slowlog_slot {
+  unsigned long long seq;
+  struct redis_slowlog_entry entry;
+};
+
+static const char *phase_names[REDIS_PHASE_MAX] = {
+  "lock", "write", "wait", "parse",
+};
+
+static const struct {
+  const char *name;
+  const char *help;
+} counter_names[REDIS_COUNTER_MAX] = {
+  { "commands_total", "Commands sent, including pipelined ones." },
+  { "pipelined_commands_total", "Commands sent in pipelines." },
+  { "received_bytes_total", "Bytes received." },
+  { "sent_bytes_total", "Bytes sent." },
+  { "connects_total", "Successful connections." },
+  { "connect_failures_total", "Failed connection attempts." },
+  { "reconnects_total", "Successful reconnections." },
+  { "failovers_total", "Reconnections to a different endpoint." },
+  { "readonly_total", "READONLY error replies." },
+  { "timeouts_total", "Commands timed out." },
+  { "errors_total", "Error replies." },
+  { "rejected_total", "Commands rejected since the client was busy." },
+  { "coalesced_total", "Commands answered with the reply of an identical one." },
+};
+
+
+unsigned long long
+redis_clock_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+static int
+hist_index(unsigned long long value)
+{
+  int e;
+
+  if (value < HIST_SUB_COUNT)
+    return (int)value;
+  if (value >= (1ULL << HIST_MAX_BITS))
+    value = (1ULL << HIST_MAX_BITS) - 1;
+
+  e = 63 - __builtin_clzll(value);
+  return HIST_SUB_COUNT * (e - HIST_SUB_BITS + 1) +
+    (int)((value >> (e - HIST_SUB_BITS)) & (HIST_SUB_COUNT - 1));
+}
+
+
+/* the highest value that falls into the bucket INDEX */
+static unsigned long long
+hist_value(int index)
+{
+  int e, sub;
+
+  if (index < HIST_SUB_COUNT)
+    return index;
+
+  e = index / HIST_SUB_COUNT + HIST_SUB_BITS - 1;
+  sub = index % HIST_SUB_COUNT;
+  return (((unsigned long long)(HIST_SUB_COUNT + sub + 1)) <<
+          (e - HIST_SUB_BITS)) - 1;
+}
+
+
+static void
+hist_record(struct redis_histogram *h, unsigned long long value)
+{
+  unsigned long long max;
+
+  __sync_fetch_and_add(&h->buckets[hist_index(value)], 1);
+  __sync_fetch_and_add(&h->count, 1);
+  __sync_fetch_and_add(&h->sum, value);
+
+  max = h->max;
+  while (value > max) {
+    if (__sync_bool_compare_and_swap(&h->max, max, value))
+      break;
+    max = h->max;
+  }
+}
+
+
+static void
+hist_reset(struct redis_histogram *h)
+{
+  int i;
+
+  /* not a memset(3), so that no concurrent increment is torn */
+  for (i = 0; i < REDIS_HIST_BUCKETS; i++)
+    __sync_fetch_and_and(&h->buckets[i], 0);
+  __sync_fetch_and_and(&h->count, 0);
+  __sync_fetch_and_and(&h->sum, 0);
+  __sync_fetch_and_and(&h->max, 0);
+}
+
+
+void
+redis_histogram_add(struct redis_histogram *h, unsigned long long value)
+{
+  hist_record(h, value);
+}
+
+
+unsigned long long
+redis_histogram_value(const struct redis_histogram *h, double percentile)
+{
+  unsigned long long rank, seen = 0;
+  int i;
+
+  if (h->count == 0)
+    return 0;
+
+  if (percentile >= 100.0)
+    return h->max;
+  rank = (unsigned long long)(h->count * (percentile / 100.0) + 0.5);
+  if (rank == 0)
+    rank = 1;
+
+  for (i = 0; i < REDIS_HIST_BUCKETS; i++) {
+    seen += h->buckets[i];
+    if (seen >= rank)
+      return (hist_value(i) < h->max) ? hist_value(i) : h->max;
+  }
+  return h->max;
+}
+
+
+static struct stats_latency *
+stats_latency(struct stats_latency **slot)
+{
+  struct stats_latency *p = *(struct stats_latency *volatile *)slot;
+
+  if (p)
+    return p;
+
+  p = calloc(1, sizeof(*p));
+  if (!p)
+    return NULL;
+  if (!__sync_bool_compare_and_swap(slot, NULL, p)) {
+    free(p);
+    p = *(struct stats_latency *volatile *)slot;
+  }
+  return p;
+}
+
+
+static unsigned
+stats_hash(const char *name)
+{
+  unsigned h = 5381;
+
+  while (*name)
+    h = h * 33 + (unsigned char)*name++;
+  return h;
+}
+
+
+static struct stats_latency *
+stats_command(struct redis_stats *stats, const char *name)
+{
+  struct stats_command *cmd;
+  unsigned h;
+  int i, state;
+
+  if (strlen(name) >= STATS_NAME_MAX)
+    return stats_latency(&stats->other);
+
+  h = stats_hash(name);
+  for (i = 0; i < STATS_COMMANDS_MAX; i++) {
+    cmd = &stats->commands[(h + i) & (STATS_COMMANDS_MAX - 1)];
+
+    while ((state = *(volatile int *)&cmd->state) == SLOT_BUSY)
+      ;                         /* being claimed by other lane */
+
+    if (state == SLOT_EMPTY) {
+      if (!__sync_bool_compare_and_swap(&cmd->state, SLOT_EMPTY, SLOT_BUSY)) {
+        i--;                    /* look at this slot again */
+        continue;
+      }
+      strcpy(cmd->name, name);
+      stats_latency(&cmd->lat);
+      __sync_synchronize();
+      cmd->state = SLOT_READY;
+    }
+
+    if (strcmp(cmd->name, name) == 0)
+      return cmd->lat ? cmd->lat : stats_latency(&cmd->lat);
+  }
+  return stats_latency(&stats->other);
+}
+
+
+const char *
+redis_stats_argp(const char *buf, int index, size_t *len)
+{
+  const char *p;
+  char *end;
+  long argc;
+  int i;
+
+  /* "*<argc>\r\n$<len>\r\n<arg>\r\n..." */
+  if (!buf || buf[0] != '*')
+    return NULL;
+  argc = strtol(buf + 1, &end, 10);
+  if (index >= argc || end[0] != '\r' || end[1] != '\n')
+    return NULL;
+
+  p = end + 2;
+  for (i = 0; ; i++) {
+    if (p[0] != '$')
+      return NULL;
+    *len = strtoul(p + 1, &end, 10);
+    if (end[0] != '\r' || end[1] != '\n')
+      return NULL;
+    p = end + 2;
+    if (i == index)
+      break;
+    p += *len + 2;
+  }
+  return p;
+}
+
+
+ssize_t
+redis_stats_arg(const char *buf, int index, char *arg, size_t size)
+{
+  const char *p;
+  size_t len;
+
+  p = redis_stats_argp(buf, index, &len);
+  if (!p)
+    return -1;
+
+  if (size > 0) {
+    size_t n = (len < size - 1) ? len : size - 1;
+
+    memcpy(arg, p, n);
+    arg[n] = '\0';
+  }
+  return (ssize_t)len;
+}
+
+
+void
+redis_stats_name(const char *buf, char *name, size_t size)
+{
+  ssize_t len = redis_stats_arg(buf, 0, name, size);
+  size_t i;
+
+  if (len < 0 || (size_t)len >= size) {
+    name[0] = '\0';
+    return;
+  }
+  for (i = 0; i < (size_t)len; i++)
+    name[i] = toupper((unsigned char)name[i]);
+}
+
+
+void
+redis_stats_record(struct redis_stats *stats, const char *name,
+                   int host, const unsigned long long *phase)
+{
+  struct stats_latency *lat[2];
+  int i, j;
+
+  if (!stats)
+    return;
+
+  lat[0] = stats_command(stats, name[0] ? name : STATS_PIPELINE);
+  lat[1] = (host >= 0 && host < REDIS_HOSTS_MAX)
+    ? stats_latency(&stats->hosts[host]) : NULL;
+
+  for (i = 0; i < 2; i++) {
+    if (!lat[i])
+      continue;
+    for (j = 0; j < REDIS_PHASE_MAX; j++)
+      hist_record(&lat[i]->phase[j], phase[j]);
+  }
+}
+
+
+void
+redis_stats_count(struct redis_stats *stats, int host, int counter,
+                  unsigned long long n)
+{
+  if (!stats)
+    return;
+
+  __sync_fetch_and_add(&stats->counters[counter], n);
+  if (host >= 0 && host < REDIS_HOSTS_MAX)
+    __sync_fetch_and_add(&stats->host_counters[host][counter], n);
+}
+
+
+void
+redis_stats_connected(struct redis_stats *stats, int host, int reconnect)
+{
+  int last;
+
+  if (!stats)
+    return;
+
+  redis_stats_count(stats, host, REDIS_COUNTER_CONNECTS, 1);
+  if (reconnect)
+    redis_stats_count(stats, host, REDIS_COUNTER_RECONNECTS, 1);
+
+  last = __sync_lock_test_and_set(&stats->last_host, host);
+  if (last >= 0 && last != host)
+    redis_stats_count(stats, host, REDIS_COUNTER_FAILOVERS, 1);
+}
+
+
+struct redis_stats *
+redis_stats_new(void)
+{
+  struct redis_stats *stats = calloc(1, sizeof(*stats));
+
+  if (stats)
+    stats->last_host = -1;
+  return stats;
+}
+
+
+void
+redis_stats_free(struct redis_stats *stats)
+{
+  int i;
+
+  if (!stats)
+    return;
+
+  free(stats->slowlog);
+  for (i = 0; i < STATS_COMMANDS_MAX; i++)
+    free(stats->commands[i].lat);
+  for (i = 0; i < REDIS_HOSTS_MAX; i++)
+    free(stats->hosts[i]);
+  free(stats->other);
+  free(stats);
+}
+
+
+static void
+stats_latency_reset(struct stats_latency *lat)
+{
+  int i;
+
+  if (!lat)
+    return;
+  for (i = 0; i < REDIS_PHASE_MAX; i++)
+    hist_reset(&lat->phase[i]);
+}
+
+
+void
+redis_stats_reset(REDIS *redis)
+{
+  struct redis_stats *stats = redis->stats;
+  int i;
+
+  if (!stats)
+    return;
+
+  for (i = 0; i < STATS_COMMANDS_MAX; i++) {
+    if (*(volatile int *)&stats->commands[i].state == SLOT_READY)
+      stats_latency_reset(stats->commands[i].lat);
+  }
+  for (i = 0; i < REDIS_HOSTS_MAX; i++)
+    stats_latency_reset(stats->hosts[i]);
+  stats_latency_reset(stats->other);
+
+  for (i = 0; i < REDIS_COUNTER_MAX; i++)
+    __sync_fetch_and_and(&stats->counters[i], 0);
+  for (i = 0; i < REDIS_HOSTS_MAX * REDIS_COUNTER_MAX; i++)
+    __sync_fetch_and_and(&stats->host_counters[0][i], 0);
+  __sync_fetch_and_and(&redis->waiters_peak, 0);
+}
+
+
+static void
+stats_copy(struct redis_latency *dst, const char *name,
+           const struct stats_latency *src)
+{
+  snprintf(dst->name, sizeof(dst->name), "%s", name);
+  if (src)
+    memcpy(dst->phase, src->phase, sizeof(dst->phase));
+  else
+    memset(dst->phase, 0, sizeof(dst->phase));
+  memset(dst->counters, 0, sizeof(dst->counters));
+}
+
+
+static void
+stats_copy_counters(unsigned long long *dst, const unsigned long long *src)
+{
+  int i;
+
+  for (i = 0; i < REDIS_COUNTER_MAX; i++)
+    dst[i] = *(volatile unsigned long long *)&src[i];
+}
+
+
+int
+redis_stats_snapshot(REDIS *redis, struct redis_stats_snapshot *snap)
+{
+  struct redis_stats *stats = redis->stats;
+  char name[sizeof(snap->hosts[0].name)];
+  int i;
+
+  memset(snap, 0, sizeof(*snap));
+  if (!stats)
+    return 0;
+
+  stats_copy_counters(snap->counters, stats->counters);
+  snap->waiters = *(volatile int *)&redis->waiters;
+  snap->waiters_peak = *(volatile int *)&redis->waiters_peak;
+
+  snap->commands = malloc(sizeof(*snap->commands) * (STATS_COMMANDS_MAX + 1));
+  snap->hosts = malloc(sizeof(*snap->hosts) * REDIS_HOSTS_MAX);
+  if (!snap->commands || !snap->hosts) {
+    redis_stats_snapshot_free(snap);
+    return -1;
+  }
+
+  for (i = 0; i < STATS_COMMANDS_MAX; i++) {
+    if (*(volatile int *)&stats->commands[i].state == SLOT_READY &&
+        stats->commands[i].lat)
+      stats_copy(&snap->commands[snap->ncommands++],
+                 stats->commands[i].name, stats->commands[i].lat);
+  }
+  if (stats->other)
+    stats_copy(&snap->commands[snap->ncommands++], STATS_OTHER, stats->other);
+
+  redis_lock(redis);
+  for (i = 0; i < REDIS_HOSTS_MAX; i++) {
+    if (!redis->hosts[i])
+      continue;
+    snprintf(name, sizeof(name), "%s:%d",
+             redis->hosts[i]->host, redis->hosts[i]->port);
+    stats_copy(&snap->hosts[snap->nhosts], name, stats->hosts[i]);
+    stats_copy_counters(snap->hosts[snap->nhosts].counters,
+                        stats->host_counters[i]);
+    snap->nhosts++;
+  }
+  redis_unlock(redis);
+
+  return 0;
+}
+
+
+void
+redis_stats_snapshot_free(struct redis_stats_snapshot *snap)
+{
+  free(snap->commands);
+  free(snap->hosts);
+  memset(snap, 0, sizeof(*snap));
+}
+
+
+static const double prom_quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+
+/*
+ * Copy VALUE to BUF of SIZE bytes, escaping it as a label value of the
+ * Prometheus text format.  Returns BUF.
+ */
+static const char *
+prom_escape(const char *value, char *buf, size_t size)
+{
+  size_t n = 0;
+
+  for (; *value && n + 3 <= size; value++) {
+    switch (*value) {
+    case '\\':
+    case '"':
+      buf[n++] = '\\';
+      buf[n++] = *value;
+      break;
+    case '\n':
+      buf[n++] = '\\';
+      buf[n++] = 'n';
+      break;
+    default:
+      buf[n++] = *value;
+      break;
+    }
+  }
+  buf[n] = '\0';
+  return buf;
+}
+
+
+static void
+prom_summary(FILE *fp, const char *metric, const char *label,
+             const char *raw, const struct redis_latency *lat)
+{
+  const struct redis_histogram *h;
+  char value[sizeof(lat->name) * 2];
+  size_t q;
+  int i;
+
+  prom_escape(raw, value, sizeof(value));
+  for (i = 0; i < REDIS_PHASE_MAX; i++) {
+    h = &lat->phase[i];
+    if (h->count == 0)
+      continue;
+
+    for (q = 0; q < sizeof(prom_quantiles) / sizeof(prom_quantiles[0]); q++)
+      fprintf(fp, "%s{%s=\"%s\",phase=\"%s\",quantile=\"%g\"} %.9f\n",
+              metric, label, value, phase_names[i], prom_quantiles[q],
+              redis_histogram_value(h, prom_quantiles[q] * 100.0) / 1e9);
+    fprintf(fp, "%s_sum{%s=\"%s\",phase=\"%s\"} %.9f\n",
+            metric, label, value, phase_names[i], h->sum / 1e9);
+    fprintf(fp, "%s_count{%s=\"%s\",phase=\"%s\"} %llu\n",
+            metric, label, value, phase_names[i], h->count);
+  }
+}
+
+
+char *
+redis_stats_prometheus(REDIS *redis, const char *prefix)
+{
+  struct redis_stats_snapshot snap;
+  char metric[128];
+  char endpoint[sizeof(snap.hosts->name) * 2];
+  char *buf = NULL;
+  size_t len, i;
+  FILE *fp;
+  int c;
+
+  if (!prefix)
+    prefix = "sredis";
+
+  if (redis_stats_snapshot(redis, &snap) != 0)
+    return NULL;
+
+  fp = open_memstream(&buf, &len);
+  if (!fp) {
+    redis_stats_snapshot_free(&snap);
+    return NULL;
+  }
+
+  for (c = 0; c < REDIS_COUNTER_MAX; c++) {
+    snprintf(metric, sizeof(metric), "%s_%s", prefix, counter_names[c].name);
+    fprintf(fp, "# HELP %s %s\n# TYPE %s counter\n",
+            metric, counter_names[c].help, metric);
+    for (i = 0; i < snap.nhosts; i++)
+      fprintf(fp, "%s{endpoint=\"%s\"} %llu\n", metric,
+              prom_escape(snap.hosts[i].name, endpoint, sizeof(endpoint)),
+              snap.hosts[i].counters[c]);
+  }
+
+  /* the totals of the client, including what no endpoint is charged */
+  for (c = 0; c < REDIS_COUNTER_MAX; c++) {
+    snprintf(metric, sizeof(metric), "%s_client_%s", prefix,
+             counter_names[c].name);
+    fprintf(fp, "# HELP %s %s Of the whole client.\n"
+            "# TYPE %s counter\n%s %llu\n",
+            metric, counter_names[c].help, metric, metric, snap.counters[c]);
+  }
+
+  snprintf(metric, sizeof(metric), "%s_lock_waiters", prefix);
+  fprintf(fp, "# HELP %s Threads waiting for the client.\n"
+          "# TYPE %s gauge\n%s %d\n", metric, metric, metric, snap.waiters);
+  snprintf(metric, sizeof(metric), "%s_lock_waiters_peak", prefix);
+  fprintf(fp, "# HELP %s Peak of %s_lock_waiters since reset.\n"
+          "# TYPE %s gauge\n%s %d\n", metric, prefix, metric, metric,
+          snap.waiters_peak);
+
+  snprintf(metric, sizeof(metric), "%s_command_latency_seconds", prefix);
+  fprintf(fp, "# HELP %s Latency of commands by phase.\n"
+          "# TYPE %s summary\n", metric, metric);
+  for (i = 0; i < snap.ncommands; i++)
+    prom_summary(fp, metric, "command", snap.commands[i].name,
+                 &snap.commands[i]);
+
+  snprintf(metric, sizeof(metric), "%s_endpoint_latency_seconds", prefix);
+  fprintf(fp, "# HELP %s Latency of commands by phase.\n"
+          "# TYPE %s summary\n", metric, metric);
+  for (i = 0; i < snap.nhosts; i++)
+    prom_summary(fp, metric, "endpoint", snap.hosts[i].name, &snap.hosts[i]);
+
+  redis_stats_snapshot_free(&snap);
+
+  if (fclose(fp) != 0) {
+    free(buf);
+    return NULL;
+  }
+  return buf;
+}
+
+
+int
+redis_stats_slowlog_on(struct redis_stats *stats)
+{
+  return stats && *(volatile unsigned long long *)&stats->slow_ns != 0;
+}
+
+
+/*
+ * Like redis_stats_arg(), but for the first LEN bytes of BUF only,
+ * copying every argument into ENTRY.
+ */
+static void
+slowlog_args(struct redis_slowlog_entry *entry, const char *buf, size_t len)
+{
+  const char *p = buf, *end = buf + len;
+  char *next;
+  size_t alen, n;
+  long argc;
+  int i;
+
+  entry->argc = 0;
+  if (len < 4 || buf[0] != '*')
+    return;
+
+  argc = strtol(buf + 1, &next, 10);
+  if (argc <= 0 || next >= end)
+    return;
+  entry->argc = (int)argc;
+  p = next + 2;
+
+  for (i = 0; i < argc && i < REDIS_SLOWLOG_ARGS && p < end; i++) {
+    if (*p != '$' || !memchr(p, '\n', end - p))
+      break;
+    alen = strtoul(p + 1, &next, 10);
+    p = next + 2;
+    if (p > end)
+      break;
+
+    n = alen;
+    if (n > (size_t)(end - p))
+      n = end - p;
+    if (n > REDIS_SLOWLOG_ARG_MAX - 1)
+      n = REDIS_SLOWLOG_ARG_MAX - 1;
+    memcpy(entry->argv[i], p, n);
+    entry->argv[i][n] = '\0';
+    p += alen + 2;
+  }
+}
+
+
+void
+redis_stats_slowlog(struct redis_stats *stats, const char *head, size_t len,
+                    size_t commands, const struct redis_hostent *ent,
+                    const unsigned long long *phase,
+                    unsigned long long reconnect_ns)
+{
+  struct slowlog_slot *slots, *slot;
+  unsigned long long total, id, seq;
+  int i;
+
+  if (!stats || stats->slow_ns == 0)
+    return;
+
+  total = reconnect_ns;
+  for (i = 0; i < REDIS_PHASE_MAX; i++)
+    total += phase[i];
+  if (total < stats->slow_ns)
+    return;
+
+  slots = *(struct slowlog_slot *volatile *)&stats->slowlog;
+  if (!slots) {
+    slots = calloc(REDIS_SLOWLOG_LEN, sizeof(*slots));
+    if (!slots)
+      return;
+    if (!__sync_bool_compare_and_swap(&stats->slowlog, NULL, slots)) {
+      free(slots);
+      slots = stats->slowlog;
+    }
+  }
+
+  id = __sync_fetch_and_add(&stats->slow_next, 1);
+  slot = &slots[id % REDIS_SLOWLOG_LEN];
+
+  seq = slot->seq;
+  if ((seq & 1) || !__sync_bool_compare_and_swap(&slot->seq, seq, seq + 1))
+    return;                     /* being written by other thread */
+
+  memset(&slot->entry, 0, sizeof(slot->entry));
+  slot->entry.id = id;
+  gettimeofday(&slot->entry.time, NULL);
+  if (ent)
+    snprintf(slot->entry.endpoint, sizeof(slot->entry.endpoint), "%s:%d",
+             ent->host, ent->port);
+  slot->entry.commands = commands;
+  slowlog_args(&slot->entry, head, len);
+  memcpy(slot->entry.phase, phase, sizeof(slot->entry.phase));
+  slot->entry.reconnect_ns = reconnect_ns;
+  slot->entry.total_ns = total;
+
+  __sync_synchronize();
+  slot->seq = seq + 2;
+}
+
+
+void
+redis_set_slowlog(REDIS *redis, const struct timeval *threshold)
+{
+  unsigned long long ns = 0;
+
+  if (threshold) {
+    ns = threshold->tv_sec * 1000000000ULL + threshold->tv_usec * 1000ULL;
+    if (ns == 0)
+      ns = 1;
+  }
+  if (redis->stats)
+    redis->stats->slow_ns = ns;
+}
+
+
+size_t
+redis_slowlog_get(REDIS *redis, struct redis_slowlog_entry *entries,
+                  size_t max)
+{
+  struct redis_stats *stats = redis->stats;
+  struct slowlog_slot *slots;
+  unsigned long long next, id, seq;
+  size_t n = 0;
+
+  if (!stats)
+    return 0;
+  slots = *(struct slowlog_slot *volatile *)&stats->slowlog;
+  if (!slots)
+    return 0;
+
+  next = *(volatile unsigned long long *)&stats->slow_next;
+  for (id = next; id > 0 && n < max; id--) {
+    const struct slowlog_slot *slot = &slots[(id - 1) % REDIS_SLOWLOG_LEN];
+
+    if (id - 1 < stats->slow_reset || next - id >= REDIS_SLOWLOG_LEN)
+      break;
+
+    seq = *(volatile unsigned long long *)&slot->seq;
+    __sync_synchronize();
+    memcpy(&entries[n], &slot->entry, sizeof(entries[n]));
+    __sync_synchronize();
+    if ((seq & 1) || seq != *(volatile unsigned long long *)&slot->seq ||
+        entries[n].id != id - 1)
+      continue;                 /* being written, or dropped */
+    n++;
+  }
+  return n;
+}
+
+
+void
+redis_slowlog_dump(REDIS *redis, FILE *fp)
+{
+  struct redis_slowlog_entry *entries;
+  size_t i, n;
+  int j;
+
+  entries = malloc(sizeof(*entries) * REDIS_SLOWLOG_LEN);
+  if (!entries)
+    return;
+
+  n = redis_slowlog_get(redis, entries, REDIS_SLOWLOG_LEN);
+  for (i = 0; i < n; i++) {
+    struct redis_slowlog_entry *e = &entries[i];
+
+    fprintf(fp, "%llu %ld.%06ld %s total=%lluus lock=%lluus reconnect=%lluus "
+            "write=%lluus wait=%lluus parse=%lluus",
+            e->id, (long)e->time.tv_sec, (long)e->time.tv_usec, e->endpoint,
+            e->total_ns / 1000, e->phase[REDIS_PHASE_LOCK] / 1000,
+            e->reconnect_ns / 1000, e->phase[REDIS_PHASE_WRITE] / 1000,
+            e->phase[REDIS_PHASE_WAIT] / 1000,
+            e->phase[REDIS_PHASE_PARSE] / 1000);
+    if (e->commands > 1)
+      fprintf(fp, " pipeline=%zu", e->commands);
+    fputs(" :", fp);
+    for (j = 0; j < e->argc && j < REDIS_SLOWLOG_ARGS; j++)
+      fprintf(fp, " %s", e->argv[j]);
+    if (e->argc > REDIS_SLOWLOG_ARGS)
+      fprintf(fp, " ... (%d more)", e->argc - REDIS_SLOWLOG_ARGS);
+    fputc('\n', fp);
+  }
+  free(entries);
+}
+
+
+void
+redis_slowlog_reset(REDIS *redis)
+{
+  if (redis->stats)
+    redis->stats->slow_reset = redis->stats->slow_next;
+}
@@ -0,0 +1,74 @@
+#ifndef SREDIS_STATS_H__
+#define SREDIS_STATS_H__
+
+/*
+ * Internal interface of the statistics; not installed.
+ */
+
+#include <sys/types.h>
+
+#include "sredis.h"
+
+struct redis_stats *redis_stats_new(void);
+void redis_stats_free(struct redis_stats *stats);
+
+/* CLOCK_MONOTONIC in nanoseconds */
+unsigned long long redis_clock_ns(void);
+
+/*
+ * Copy the command name in BUF, the output buffer of hiredis holding
+ * one or more commands, into NAME.  NAME is empty if unknown.
+ */
+void redis_stats_name(const char *buf, char *name, size_t size);
+
+/*
+ * Copy the argument INDEX of the first command in BUF into ARG,
+ * truncated to SIZE - 1 bytes.  Returns the length of the argument,
+ * or -1 if there is no such argument.
+ */
+ssize_t redis_stats_arg(const char *buf, int index, char *arg, size_t size);
+
+/*
+ * Like redis_stats_arg(), but return the argument in place, and its
+ * length in LEN.  Returns NULL if there is no such argument.
+ */
+const char *redis_stats_argp(const char *buf, int index, size_t *len);
+
+/*
+ * Add N to the counter COUNTER of STATS, and of the host HOST (an
+ * index to REDIS->hosts, or -1).
+ */
+void redis_stats_count(struct redis_stats *stats, int host, int counter,
+                       unsigned long long n);
+
+/*
+ * Record a successful connection to HOST.  RECONNECT is nonzero if
+ * the REDIS was connected before.
+ */
+void redis_stats_connected(struct redis_stats *stats, int host,
+                           int reconnect);
+
+/*
+ * Nonzero if the slow log is enabled.
+ */
+int redis_stats_slowlog_on(struct redis_stats *stats);
+
+/*
+ * Record a command in the slow log if it took long enough.  HEAD is
+ * the (possibly truncated) output buffer of hiredis holding the
+ * command, LEN is its length.
+ */
+void redis_stats_slowlog(struct redis_stats *stats, const char *head,
+                         size_t len, size_t commands,
+                         const struct redis_hostent *ent,
+                         const unsigned long long *phase,
+                         unsigned long long reconnect_ns);
+
+/*
+ * Record the phases of one command NAME (or a pipeline if NAME is
+ * empty) sent to the host HOST (an index to REDIS->hosts, or -1).
+ */
+void redis_stats_record(struct redis_stats *stats, const char *name,
+                        int host, const unsigned long long *phase);
+
+#endif  /* SREDIS_STATS_H__ */
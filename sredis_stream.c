@@ -0,0 +1,501 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "sredis.h"
+
+#ifdef _PTHREAD
+
+/*
+ * Stream consumer group.
+ *
+ * The consumer has its own connection (a redis_dup() of the REDIS
+ * given to redis_stream_new()), so a blocking XREADGROUP never holds
+ * the mutex of the shared REDIS.  The socket timeout of the connection
+ * is extended by the BLOCK time.
+ *
+ * Pending acknowledgements are pipelined in front of the next read, so
+ * that a read-process-ack loop costs one round trip per batch.  When
+ * claiming is enabled, XAUTOCLAIM is issued (in the same way) once the
+ * claim interval has passed, and the claimed entries are returned
+ * before any new one.
+ *
+ * Entries are decoded into two arrays reused across reads; the strings
+ * point into the reply, which is kept until the next read.
+ */
+
+#define STREAM_ID_MAX           48      /* "<ms>-<seq>" is at most 41 */
+#define STREAM_ACK_BATCH        128
+#define STREAM_READ_MAX         1024
+
+struct redis_stream {
+  REDIS *conn;
+  char *key;
+  char *group;
+  char *consumer;
+
+  int block_msec;
+
+  /* the last batch */
+  redisReply *reply;
+  struct redis_stream_entry *entries;
+  size_t entries_cap;
+  struct redis_stream_field *fields;
+  size_t fields_cap;
+
+  /* acknowledged, but not yet sent */
+  char (*acks)[STREAM_ID_MAX];
+  size_t nacks;
+  size_t acks_cap;
+  size_t ack_batch;
+
+  /* XAUTOCLAIM */
+  long claim_idle_msec;         /* 0 if disabled */
+  struct timeval claim_interval;
+  struct timespec claim_next;
+  char claim_cursor[STREAM_ID_MAX];
+};
+
+
+static void
+timespec_after(struct timespec *ts, const struct timeval *tv)
+{
+  clock_gettime(CLOCK_MONOTONIC, ts);
+  ts->tv_sec += tv->tv_sec;
+  ts->tv_nsec += tv->tv_usec * 1000L;
+  if (ts->tv_nsec >= 1000000000L) {
+    ts->tv_sec++;
+    ts->tv_nsec -= 1000000000L;
+  }
+}
+
+
+static int
+stream_claim_due(REDIS_STREAM *s)
+{
+  struct timespec now;
+
+  if (s->claim_idle_msec == 0)
+    return 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (now.tv_sec != s->claim_next.tv_sec)
+    return now.tv_sec > s->claim_next.tv_sec;
+  return now.tv_nsec >= s->claim_next.tv_nsec;
+}
+
+
+static int
+stream_grow(void **array, size_t *cap, size_t need, size_t size)
+{
+  size_t ncap;
+  void *p;
+
+  if (need <= *cap)
+    return 0;
+
+  ncap = *cap ? *cap : 16;
+  while (ncap < need)
+    ncap *= 2;
+
+  p = realloc(*array, ncap * size);
+  if (!p) {
+    xerror(0, errno, "stream: can't allocate memory");
+    return -1;
+  }
+  *array = p;
+  *cap = ncap;
+  return 0;
+}
+
+
+/*
+ * Decode ENTRIES, an array of [ID, [NAME, VALUE, ...]], into
+ * S->entries and S->fields.  Returns the number of entries.
+ */
+static int
+stream_decode(REDIS_STREAM *s, const redisReply *entries)
+{
+  const redisReply *e, *fv;
+  size_t i, j, nfields = 0, n = 0;
+
+  if (!entries || entries->type != REDIS_REPLY_ARRAY)
+    return 0;
+
+  for (i = 0; i < entries->elements; i++) {
+    fv = entries->element[i]->elements == 2
+      ? entries->element[i]->element[1] : NULL;
+    if (fv && fv->type == REDIS_REPLY_ARRAY)
+      nfields += fv->elements / 2;
+  }
+
+  if (stream_grow((void **)&s->entries, &s->entries_cap,
+                  entries->elements, sizeof(*s->entries)) != 0 ||
+      stream_grow((void **)&s->fields, &s->fields_cap,
+                  nfields, sizeof(*s->fields)) != 0)
+    return -1;
+
+  nfields = 0;
+  for (i = 0; i < entries->elements; i++) {
+    e = entries->element[i];
+    if (e->type != REDIS_REPLY_ARRAY || e->elements != 2 ||
+        e->element[0]->type != REDIS_REPLY_STRING)
+      continue;
+
+    s->entries[n].id = e->element[0]->str;
+    s->entries[n].fields = s->fields + nfields;
+    s->entries[n].nfields = 0;
+
+    /* The fields are nil if the entry was deleted (XAUTOCLAIM of
+     * Redis 6.2 returns such entries). */
+    fv = e->element[1];
+    if (fv->type == REDIS_REPLY_ARRAY) {
+      for (j = 0; j + 1 < fv->elements; j += 2) {
+        s->fields[nfields].name = fv->element[j]->str;
+        s->fields[nfields].name_len = fv->element[j]->len;
+        s->fields[nfields].value = fv->element[j + 1]->str;
+        s->fields[nfields].value_len = fv->element[j + 1]->len;
+        nfields++;
+        s->entries[n].nfields++;
+      }
+    }
+    n++;
+  }
+  return (int)n;
+}
+
+
+/*
+ * Pipeline the pending acknowledgements.  Called with S->conn locked.
+ */
+static int
+stream_append_acks(REDIS_STREAM *s)
+{
+  size_t i;
+
+  for (i = 0; i < s->nacks; i++) {
+    if (redis_append_unlocked(s->conn, "XACK %s %s %s",
+                              s->key, s->group, s->acks[i]) != REDIS_OK)
+      return -1;
+  }
+  return 0;
+}
+
+
+/*
+ * Send the commands appended to S->conn, with the pending
+ * acknowledgements in front of them.  Returns the reply of the last
+ * command, which is owned by S->reply.
+ */
+static redisReply *
+stream_exec(REDIS_STREAM *s)
+{
+  redisReply *packed;
+  size_t i;
+
+  packed = redis_exec_unlocked(s->conn);
+  if (!packed)
+    return NULL;
+
+  for (i = 0; i < s->nacks && i < packed->elements; i++) {
+    if (redis_iserror(packed->element[i]))
+      xerror(0, 0, "stream: XACK %s failed: %s", s->acks[i],
+             packed->element[i] ? packed->element[i]->str : "no reply");
+  }
+  /* An error reply is not retried: the entry is no longer pending, or
+   * the group was destroyed. */
+  s->nacks = 0;
+
+  s->reply = packed;
+  return packed->elements ? packed->element[packed->elements - 1] : NULL;
+}
+
+
+static void
+stream_release(REDIS_STREAM *s)
+{
+  if (s->reply) {
+    redis_free(s->reply);
+    s->reply = NULL;
+  }
+}
+
+
+static int
+stream_claim(REDIS_STREAM *s, int count)
+{
+  redisReply *reply;
+  int n;
+
+  redis_lock(s->conn);
+  if (stream_append_acks(s) != 0 ||
+      redis_append_unlocked(s->conn, "XAUTOCLAIM %s %s %s %ld %s COUNT %d",
+                            s->key, s->group, s->consumer,
+                            s->claim_idle_msec, s->claim_cursor,
+                            count) != REDIS_OK) {
+    redis_free(redis_exec_unlocked(s->conn));     /* discard */
+    redis_unlock(s->conn);
+    return -1;
+  }
+  reply = stream_exec(s);
+  redis_unlock(s->conn);
+
+  if (redis_iserror(reply) || reply->type != REDIS_REPLY_ARRAY ||
+      reply->elements < 2 || reply->element[0]->type != REDIS_REPLY_STRING ||
+      reply->element[0]->len >= STREAM_ID_MAX) {
+    xerror(0, 0, "stream: XAUTOCLAIM failed: %s",
+           (reply && reply->type == REDIS_REPLY_ERROR) ? reply->str
+           : "unexpected reply");
+    /* not again until the next interval */
+    timespec_after(&s->claim_next, &s->claim_interval);
+    return -1;
+  }
+
+  memcpy(s->claim_cursor, reply->element[0]->str, reply->element[0]->len + 1);
+  if (strcmp(s->claim_cursor, "0-0") == 0)
+    timespec_after(&s->claim_next, &s->claim_interval);
+
+  n = stream_decode(s, reply->element[1]);
+  if (n > 0)
+    xdebug(0, "stream: claimed %d entr%s from %s", n, n == 1 ? "y" : "ies",
+           s->key);
+  return n;
+}
+
+
+int
+redis_stream_read(REDIS_STREAM *s, const struct redis_stream_entry **entries,
+                  int count)
+{
+  redisReply *reply, *list = NULL;
+  int n;
+
+  if (count <= 0 || count > STREAM_READ_MAX) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  stream_release(s);
+
+  if (stream_claim_due(s)) {
+    n = stream_claim(s, count);
+    if (n > 0) {
+      *entries = s->entries;
+      return n;
+    }
+    stream_release(s);
+  }
+
+  redis_lock(s->conn);
+  if (stream_append_acks(s) != 0 ||
+      redis_append_unlocked(s->conn,
+                            "XREADGROUP GROUP %s %s COUNT %d BLOCK %d "
+                            "STREAMS %s >", s->group, s->consumer, count,
+                            s->block_msec, s->key) != REDIS_OK) {
+    redis_free(redis_exec_unlocked(s->conn));     /* discard */
+    redis_unlock(s->conn);
+    return -1;
+  }
+  reply = stream_exec(s);
+  redis_unlock(s->conn);
+
+  if (!reply || reply->type == REDIS_REPLY_ERROR) {
+    xerror(0, 0, "stream: XREADGROUP failed: %s",
+           reply ? reply->str : "connection lost");
+    return -1;
+  }
+
+  /* {KEY: ENTRIES} in RESP3, [[KEY, ENTRIES]] in RESP2, or nil if
+   * timed out */
+  if (redis_reply_pairs(reply) == 1)
+    list = redis_reply_value(reply, 0);
+  else if (reply->type == REDIS_REPLY_ARRAY && reply->elements == 1 &&
+           reply->element[0]->type == REDIS_REPLY_ARRAY &&
+           reply->element[0]->elements == 2)
+    list = reply->element[0]->element[1];
+
+  n = stream_decode(s, list);
+  if (n >= 0)
+    *entries = s->entries;
+  return n;
+}
+
+
+int
+redis_stream_flush(REDIS_STREAM *s)
+{
+  int ret = 0;
+
+  redis_lock(s->conn);
+  if (s->nacks > 0) {
+    if (stream_append_acks(s) != 0) {
+      redis_free(redis_exec_unlocked(s->conn));   /* discard */
+      ret = -1;
+    }
+    else {
+      /* the reply of the last read is still in use */
+      redisReply *saved = s->reply;
+
+      s->reply = NULL;
+      if (!stream_exec(s))
+        ret = -1;
+      stream_release(s);
+      s->reply = saved;
+    }
+  }
+  redis_unlock(s->conn);
+  return ret;
+}
+
+
+int
+redis_stream_ack(REDIS_STREAM *s, const char *id)
+{
+  size_t len = strlen(id);
+
+  if (len >= STREAM_ID_MAX) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (stream_grow((void **)&s->acks, &s->acks_cap, s->nacks + 1,
+                  sizeof(*s->acks)) != 0)
+    return -1;
+  memcpy(s->acks[s->nacks++], id, len + 1);
+
+  if (s->nacks >= s->ack_batch)
+    return redis_stream_flush(s);
+  return 0;
+}
+
+
+int
+redis_stream_set_ack_batch(REDIS_STREAM *s, size_t n)
+{
+  if (n == 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  s->ack_batch = n;
+  if (s->nacks >= s->ack_batch)
+    return redis_stream_flush(s);
+  return 0;
+}
+
+
+int
+redis_stream_set_claim(REDIS_STREAM *s, const struct timeval *min_idle,
+                       const struct timeval *interval)
+{
+  if (!min_idle || (min_idle->tv_sec == 0 && min_idle->tv_usec == 0)) {
+    s->claim_idle_msec = 0;
+    return 0;
+  }
+  if (!interval) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  s->claim_idle_msec = min_idle->tv_sec * 1000 + min_idle->tv_usec / 1000;
+  if (s->claim_idle_msec == 0)
+    s->claim_idle_msec = 1;
+  s->claim_interval = *interval;
+  strcpy(s->claim_cursor, "0-0");
+  /* the first read claims what the last run left */
+  clock_gettime(CLOCK_MONOTONIC, &s->claim_next);
+  return 0;
+}
+
+
+REDIS_STREAM *
+redis_stream_new(REDIS *redis, const char *key, const char *group,
+                 const char *consumer, const struct timeval *block)
+{
+  REDIS_STREAM *s;
+  redisReply *reply;
+  struct redis_hostent *ent;
+  int i;
+
+  if (!key || !group || !consumer) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  s = calloc(1, sizeof(*s));
+  if (!s)
+    return NULL;
+
+  s->key = strdup(key);
+  s->group = strdup(group);
+  s->consumer = strdup(consumer);
+  s->conn = redis_dup(redis);
+  if (!s->key || !s->group || !s->consumer || !s->conn)
+    goto err;
+
+  s->ack_batch = STREAM_ACK_BATCH;
+  if (block)
+    s->block_msec = block->tv_sec * 1000 + block->tv_usec / 1000;
+
+  /* A read may take up to BLOCK longer than other commands.  If it
+   * blocks forever, so may the connection wait; otherwise every idle
+   * read would time out and reconnect. */
+  for (i = 0; i < REDIS_HOSTS_MAX; i++) {
+    ent = s->conn->hosts[i];
+    if (!ent || (ent->o_timeout.tv_sec == 0 && ent->o_timeout.tv_usec == 0))
+      continue;
+    if (s->block_msec == 0) {
+      ent->o_timeout.tv_sec = ent->o_timeout.tv_usec = 0;
+      continue;
+    }
+    ent->o_timeout.tv_sec += block->tv_sec;
+    ent->o_timeout.tv_usec += block->tv_usec;
+    if (ent->o_timeout.tv_usec >= 1000000) {
+      ent->o_timeout.tv_sec++;
+      ent->o_timeout.tv_usec -= 1000000;
+    }
+  }
+
+  reply = redis_command(s->conn, "XGROUP CREATE %s %s $ MKSTREAM",
+                        key, group);
+  if (!reply || (reply->type == REDIS_REPLY_ERROR &&
+                 strncmp(reply->str, "BUSYGROUP", 9) != 0)) {
+    xerror(0, 0, "stream: can't create group %s of %s: %s", group, key,
+           reply ? reply->str : "connection failed");
+    redis_free(reply);
+    goto err;
+  }
+  redis_free(reply);
+
+  return s;
+
+ err:
+  redis_stream_close(s);
+  return NULL;
+}
+
+
+void
+redis_stream_close(REDIS_STREAM *s)
+{
+  if (!s)
+    return;
+
+  if (s->conn && redis_stream_flush(s) != 0)
+    xerror(0, 0, "stream: %zu acknowledgement(s) were not sent", s->nacks);
+
+  stream_release(s);
+  free(s->entries);
+  free(s->fields);
+  free(s->acks);
+
+  if (s->conn)
+    redis_close(s->conn);
+  free(s->consumer);
+  free(s->group);
+  free(s->key);
+  free(s);
+}
+
+#endif  /* _PTHREAD */
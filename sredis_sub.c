@@ -0,0 +1,737 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sredis.h"
+
+#ifdef _PTHREAD
+
+/*
+ * Pub/Sub subscriber.
+ *
+ * A subscriber has two threads.  The reader thread owns the
+ * connection (a redis_dup() of the REDIS given to redis_sub_new()):
+ * it sends (P)SUBSCRIBE/(P)UNSUBSCRIBE, reads the messages, and
+ * pushes them to a single-producer/single-consumer ring.  The
+ * dispatcher thread pops the messages from the ring and calls the
+ * handlers.  So slow handlers never block the socket, and the
+ * application threads never touch the socket at all; they just
+ * update the subscription table and wake up the reader.
+ */
+
+#define SUB_BUCKETS     256             /* must be a power of 2 */
+#define SUB_QUEUE_MAX   65536           /* must be a power of 2 */
+
+#define SUB_POLL_MSEC   1000
+#define SUB_BACKOFF_MIN 100             /* reconnect backoff, msec */
+#define SUB_BACKOFF_MAX 2000
+
+enum { SUB_OP_SUBSCRIBE, SUB_OP_UNSUBSCRIBE };
+
+struct sub_entry {
+  struct sub_entry *next;
+  char *name;
+  int pattern;
+  redis_sub_handler handler;
+  void *data;
+};
+
+struct sub_op {
+  struct sub_op *next;
+  int op;
+  int pattern;
+  char name[];
+};
+
+struct redis_sub {
+  REDIS *conn;
+
+  /* subscription table, keyed by (name, pattern) */
+  pthread_rwlock_t lock;
+  struct sub_entry *buckets[SUB_BUCKETS];
+
+  /* pending (un)subscription requests for the reader */
+  pthread_mutex_t op_mutex;
+  struct sub_op *ops;
+  struct sub_op **ops_tail;
+  int wakefd[2];
+
+  /* SPSC ring: the reader produces, the dispatcher consumes */
+  redisReply **queue;
+  volatile unsigned long head;          /* next slot to pop */
+  volatile unsigned long tail;          /* next slot to push */
+
+  pthread_mutex_t wait_mutex;
+  pthread_cond_t wait_cond;
+  volatile int sleeping;
+
+  volatile int stop;
+  pthread_t reader;
+  pthread_t dispatcher;
+
+  struct redis_sub_stats stats;
+};
+
+
+static unsigned
+sub_hash(const char *name, int pattern)
+{
+  /* FNV-1a */
+  unsigned h = 2166136261u;
+
+  while (*name) {
+    h ^= (unsigned char)*name++;
+    h *= 16777619u;
+  }
+  return (h ^ (unsigned)pattern) & (SUB_BUCKETS - 1);
+}
+
+
+static struct sub_entry **
+sub_find(REDIS_SUB *sub, const char *name, int pattern)
+{
+  struct sub_entry **pp = &sub->buckets[sub_hash(name, pattern)];
+
+  for (; *pp; pp = &(*pp)->next) {
+    if ((*pp)->pattern == pattern && strcmp((*pp)->name, name) == 0)
+      break;
+  }
+  return pp;
+}
+
+
+static void
+sub_wake(REDIS_SUB *sub)
+{
+  char c = 0;
+
+  if (write(sub->wakefd[1], &c, 1) == -1 && errno != EAGAIN)
+    xdebug(errno, "write(2) to the wake pipe failed");
+}
+
+
+static int
+sub_op_push(REDIS_SUB *sub, int op, int pattern, const char *name)
+{
+  struct sub_op *p;
+  size_t len = strlen(name);
+
+  p = malloc(sizeof(*p) + len + 1);
+  if (!p)
+    return -1;
+
+  p->next = NULL;
+  p->op = op;
+  p->pattern = pattern;
+  memcpy(p->name, name, len + 1);
+
+  pthread_mutex_lock(&sub->op_mutex);
+  *sub->ops_tail = p;
+  sub->ops_tail = &p->next;
+  pthread_mutex_unlock(&sub->op_mutex);
+
+  sub_wake(sub);
+  return 0;
+}
+
+
+static struct sub_op *
+sub_op_take(REDIS_SUB *sub)
+{
+  struct sub_op *ops;
+
+  pthread_mutex_lock(&sub->op_mutex);
+  ops = sub->ops;
+  sub->ops = NULL;
+  sub->ops_tail = &sub->ops;
+  pthread_mutex_unlock(&sub->op_mutex);
+
+  return ops;
+}
+
+
+static void
+sub_op_free(struct sub_op *ops)
+{
+  struct sub_op *next;
+
+  for (; ops; ops = next) {
+    next = ops->next;
+    free(ops);
+  }
+}
+
+
+/*
+ * Push REPLY to the ring.  Returns -1 if the subscriber is stopping;
+ * the caller still owns REPLY in that case.
+ */
+static int
+sub_queue_push(REDIS_SUB *sub, redisReply *reply)
+{
+  unsigned long tail = sub->tail;
+
+  while (tail - sub->head >= SUB_QUEUE_MAX) {
+    /* The dispatcher is behind; leave the messages in the socket
+     * buffer rather than dropping them. */
+    if (sub->stop)
+      return -1;
+    usleep(50);
+  }
+
+  sub->queue[tail & (SUB_QUEUE_MAX - 1)] = reply;
+  __sync_synchronize();
+  sub->tail = tail + 1;
+
+  __sync_synchronize();
+  if (sub->sleeping) {
+    pthread_mutex_lock(&sub->wait_mutex);
+    pthread_cond_signal(&sub->wait_cond);
+    pthread_mutex_unlock(&sub->wait_mutex);
+  }
+  return 0;
+}
+
+
+static redisReply *
+sub_queue_pop(REDIS_SUB *sub)
+{
+  unsigned long head = sub->head;
+  redisReply *reply;
+
+  if (head == sub->tail)
+    return NULL;
+
+  __sync_synchronize();
+  reply = sub->queue[head & (SUB_QUEUE_MAX - 1)];
+  __sync_synchronize();
+  sub->head = head + 1;
+
+  return reply;
+}
+
+
+static int
+sub_append(redisContext *ctx, int op, int pattern, const char *name)
+{
+  const char *cmd;
+
+  if (op == SUB_OP_SUBSCRIBE)
+    cmd = pattern ? "PSUBSCRIBE" : "SUBSCRIBE";
+  else
+    cmd = pattern ? "PUNSUBSCRIBE" : "UNSUBSCRIBE";
+
+  return redisAppendCommand(ctx, "%s %s", cmd, name);
+}
+
+
+static int
+sub_flush(redisContext *ctx)
+{
+  int done = 0;
+
+  while (!done) {
+    if (redisBufferWrite(ctx, &done) == REDIS_ERR) {
+      xerror(0, 0, "subscriber: write failed: %s", ctx->errstr);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+
+/*
+ * Send SUBSCRIBE/PSUBSCRIBE for every entry in the table.  Called by
+ * the reader right after (re)connection.
+ */
+static int
+sub_resubscribe(REDIS_SUB *sub)
+{
+  struct sub_entry *p;
+  int i, n = 0;
+
+  /* Every pending request is already reflected in the table. */
+  sub_op_free(sub_op_take(sub));
+
+  pthread_rwlock_rdlock(&sub->lock);
+  for (i = 0; i < SUB_BUCKETS; i++) {
+    for (p = sub->buckets[i]; p; p = p->next) {
+      sub_append(sub->conn->ctx, SUB_OP_SUBSCRIBE, p->pattern, p->name);
+      n++;
+    }
+  }
+  pthread_rwlock_unlock(&sub->lock);
+
+  xdebug(0, "subscriber: resubscribing %d channel(s)/pattern(s)", n);
+  return sub_flush(sub->conn->ctx);
+}
+
+
+static int
+sub_apply_ops(REDIS_SUB *sub)
+{
+  struct sub_op *ops, *p;
+
+  ops = sub_op_take(sub);
+  if (!ops)
+    return 0;
+
+  for (p = ops; p; p = p->next)
+    sub_append(sub->conn->ctx, p->op, p->pattern, p->name);
+
+  sub_op_free(ops);
+  return sub_flush(sub->conn->ctx);
+}
+
+
+/*
+ * Return nonzero if REPLY is a published message, i.e. either
+ * "message" or "pmessage" frame.
+ */
+static int
+sub_is_message(const redisReply *reply)
+{
+  const redisReply *kind;
+
+  if (reply->type != REDIS_REPLY_ARRAY
+#ifdef SREDIS_HAVE_RESP3
+      && reply->type != REDIS_REPLY_PUSH
+#endif
+      )
+    return 0;
+
+  if (reply->elements < 3 || reply->element[0]->type != REDIS_REPLY_STRING)
+    return 0;
+
+  kind = reply->element[0];
+  if (strcmp(kind->str, "message") == 0)
+    return reply->elements == 3;
+  if (strcmp(kind->str, "pmessage") == 0)
+    return reply->elements == 4;
+  return 0;
+}
+
+
+static void
+sub_sleep_msec(REDIS_SUB *sub, int msec)
+{
+  struct pollfd pfd;
+
+  pfd.fd = sub->wakefd[0];
+  pfd.events = POLLIN;
+  poll(&pfd, 1, msec);
+}
+
+
+static void
+sub_drain_wake(REDIS_SUB *sub)
+{
+  char buf[64];
+
+  while (read(sub->wakefd[0], buf, sizeof(buf)) > 0)
+    ;
+}
+
+
+static void
+sub_disconnect(REDIS_SUB *sub)
+{
+  if (sub->conn->ctx) {
+    redisFree(sub->conn->ctx);
+    sub->conn->ctx = NULL;
+  }
+}
+
+
+static void *
+sub_reader_main(void *arg)
+{
+  REDIS_SUB *sub = (REDIS_SUB *)arg;
+  struct pollfd pfd[2];
+  redisReply *reply;
+  int backoff = SUB_BACKOFF_MIN;
+  int connected_once = 0;
+
+  xthread_set_name("sredis-sub-rd");
+
+  while (!sub->stop) {
+    if (!sub->conn->ctx) {
+      if (redis_reopen(sub->conn) != 0) {
+        xdebug(0, "subscriber: reconnection failed, retry in %d ms",
+               backoff);
+        sub_sleep_msec(sub, backoff);
+        backoff = (backoff * 2 > SUB_BACKOFF_MAX) ? SUB_BACKOFF_MAX
+          : backoff * 2;
+        continue;
+      }
+      backoff = SUB_BACKOFF_MIN;
+      if (connected_once)
+        __sync_fetch_and_add(&sub->stats.reconnects, 1);
+      connected_once = 1;
+
+      if (sub_resubscribe(sub) != 0) {
+        sub_disconnect(sub);
+        continue;
+      }
+    }
+
+    pfd[0].fd = sub->conn->ctx->fd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = sub->wakefd[0];
+    pfd[1].events = POLLIN;
+
+    if (poll(pfd, 2, SUB_POLL_MSEC) == -1) {
+      if (errno != EINTR)
+        xerror(0, errno, "subscriber: poll(2) failed");
+      continue;
+    }
+
+    if (pfd[1].revents & POLLIN) {
+      sub_drain_wake(sub);
+      if (sub_apply_ops(sub) != 0) {
+        sub_disconnect(sub);
+        continue;
+      }
+    }
+
+    if (!(pfd[0].revents & (POLLIN | POLLERR | POLLHUP)))
+      continue;
+
+    if (redisBufferRead(sub->conn->ctx) == REDIS_ERR) {
+      xerror(0, 0, "subscriber: connection lost: %s",
+             sub->conn->ctx->errstr);
+      sub_disconnect(sub);
+      continue;
+    }
+
+    while (1) {
+      if (redisGetReplyFromReader(sub->conn->ctx,
+                                  (void **)&reply) == REDIS_ERR) {
+        xerror(0, 0, "subscriber: protocol error: %s",
+               sub->conn->ctx->errstr);
+        sub_disconnect(sub);
+        break;
+      }
+      if (!reply)
+        break;
+
+      if (!sub_is_message(reply)) {
+        /* (un)subscribe confirmations and the like */
+        redis_free(reply);
+        continue;
+      }
+
+      __sync_fetch_and_add(&sub->stats.received, 1);
+      if (sub_queue_push(sub, reply) != 0) {
+        redis_free(reply);
+        break;
+      }
+    }
+  }
+
+  return NULL;
+}
+
+
+static void
+sub_dispatch(REDIS_SUB *sub, redisReply *reply)
+{
+  struct sub_entry *p;
+  redis_sub_handler handler = NULL;
+  void *data = NULL;
+  const char *channel, *pattern;
+  redisReply *msg;
+  int is_pattern = (reply->elements == 4);
+
+  if (is_pattern) {
+    pattern = reply->element[1]->str;
+    channel = reply->element[2]->str;
+    msg = reply->element[3];
+  }
+  else {
+    pattern = NULL;
+    channel = reply->element[1]->str;
+    msg = reply->element[2];
+  }
+
+  pthread_rwlock_rdlock(&sub->lock);
+  p = *sub_find(sub, is_pattern ? pattern : channel, is_pattern);
+  if (p) {
+    handler = p->handler;
+    data = p->data;
+  }
+  pthread_rwlock_unlock(&sub->lock);
+
+  if (!handler) {
+    /* unsubscribed while the message was in flight */
+    __sync_fetch_and_add(&sub->stats.unmatched, 1);
+    return;
+  }
+
+  handler(sub, channel, pattern, msg->str, msg->len, data);
+  __sync_fetch_and_add(&sub->stats.dispatched, 1);
+}
+
+
+static void *
+sub_dispatcher_main(void *arg)
+{
+  REDIS_SUB *sub = (REDIS_SUB *)arg;
+  redisReply *reply;
+  struct timespec ts;
+
+  xthread_set_name("sredis-sub-dp");
+
+  while (1) {
+    reply = sub_queue_pop(sub);
+    if (reply) {
+      sub_dispatch(sub, reply);
+      redis_free(reply);
+      continue;
+    }
+
+    if (sub->stop)
+      break;
+
+    pthread_mutex_lock(&sub->wait_mutex);
+    sub->sleeping = 1;
+    __sync_synchronize();
+    if (sub->head == sub->tail && !sub->stop) {
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_nsec += 10 * 1000000;
+      if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+      }
+      pthread_cond_timedwait(&sub->wait_cond, &sub->wait_mutex, &ts);
+    }
+    sub->sleeping = 0;
+    pthread_mutex_unlock(&sub->wait_mutex);
+  }
+
+  return NULL;
+}
+
+
+REDIS_SUB *
+redis_sub_new(REDIS *redis)
+{
+  REDIS_SUB *sub;
+  int ret;
+
+  sub = calloc(1, sizeof(*sub));
+  if (!sub)
+    return NULL;
+
+  sub->wakefd[0] = sub->wakefd[1] = -1;
+
+  sub->queue = malloc(sizeof(redisReply *) * SUB_QUEUE_MAX);
+  if (!sub->queue)
+    goto err_free;
+
+  sub->conn = redis_dup(redis);
+  if (!sub->conn)
+    goto err_free;
+
+  if (pipe(sub->wakefd) == -1) {
+    xerror(0, errno, "pipe(2) failed");
+    goto err_free;
+  }
+  fcntl(sub->wakefd[0], F_SETFL, O_NONBLOCK);
+  fcntl(sub->wakefd[1], F_SETFL, O_NONBLOCK);
+  fcntl(sub->wakefd[0], F_SETFD, FD_CLOEXEC);
+  fcntl(sub->wakefd[1], F_SETFD, FD_CLOEXEC);
+
+  pthread_rwlock_init(&sub->lock, NULL);
+  pthread_mutex_init(&sub->op_mutex, NULL);
+  pthread_mutex_init(&sub->wait_mutex, NULL);
+  pthread_cond_init(&sub->wait_cond, NULL);
+  sub->ops_tail = &sub->ops;
+
+  ret = pthread_create(&sub->dispatcher, NULL, sub_dispatcher_main, sub);
+  if (ret) {
+    xerror(0, ret, "pthread_create() failed");
+    goto err_sync;
+  }
+
+  ret = pthread_create(&sub->reader, NULL, sub_reader_main, sub);
+  if (ret) {
+    xerror(0, ret, "pthread_create() failed");
+    sub->stop = 1;
+    pthread_join(sub->dispatcher, NULL);
+    goto err_sync;
+  }
+
+  return sub;
+
+ err_sync:
+  pthread_cond_destroy(&sub->wait_cond);
+  pthread_mutex_destroy(&sub->wait_mutex);
+  pthread_mutex_destroy(&sub->op_mutex);
+  pthread_rwlock_destroy(&sub->lock);
+ err_free:
+  if (sub->wakefd[0] != -1) {
+    close(sub->wakefd[0]);
+    close(sub->wakefd[1]);
+  }
+  redis_close(sub->conn);
+  free(sub->queue);
+  free(sub);
+  return NULL;
+}
+
+
+void
+redis_sub_close(REDIS_SUB *sub)
+{
+  struct sub_entry *p, *next;
+  redisReply *reply;
+  int i;
+
+  if (!sub)
+    return;
+
+  sub->stop = 1;
+  sub_wake(sub);
+  pthread_join(sub->reader, NULL);
+
+  pthread_mutex_lock(&sub->wait_mutex);
+  pthread_cond_signal(&sub->wait_cond);
+  pthread_mutex_unlock(&sub->wait_mutex);
+  pthread_join(sub->dispatcher, NULL);
+
+  while ((reply = sub_queue_pop(sub)) != NULL)
+    redis_free(reply);
+
+  for (i = 0; i < SUB_BUCKETS; i++) {
+    for (p = sub->buckets[i]; p; p = next) {
+      next = p->next;
+      free(p->name);
+      free(p);
+    }
+  }
+  sub_op_free(sub->ops);
+
+  pthread_cond_destroy(&sub->wait_cond);
+  pthread_mutex_destroy(&sub->wait_mutex);
+  pthread_mutex_destroy(&sub->op_mutex);
+  pthread_rwlock_destroy(&sub->lock);
+
+  close(sub->wakefd[0]);
+  close(sub->wakefd[1]);
+
+  redis_close(sub->conn);
+  free(sub->queue);
+  free(sub);
+}
+
+
+static int
+sub_add(REDIS_SUB *sub, const char *name, int pattern,
+        redis_sub_handler handler, void *data)
+{
+  struct sub_entry **pp, *p;
+  int created = 0;
+
+  if (!name || !handler) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  pthread_rwlock_wrlock(&sub->lock);
+  pp = sub_find(sub, name, pattern);
+  if (*pp) {
+    /* already subscribed; just replace the handler */
+    (*pp)->handler = handler;
+    (*pp)->data = data;
+  }
+  else {
+    p = malloc(sizeof(*p));
+    if (!p || !(p->name = strdup(name))) {
+      free(p);
+      pthread_rwlock_unlock(&sub->lock);
+      return -1;
+    }
+    p->next = NULL;
+    p->pattern = pattern;
+    p->handler = handler;
+    p->data = data;
+    *pp = p;
+    created = 1;
+  }
+  pthread_rwlock_unlock(&sub->lock);
+
+  if (created)
+    return sub_op_push(sub, SUB_OP_SUBSCRIBE, pattern, name);
+  return 0;
+}
+
+
+static int
+sub_del(REDIS_SUB *sub, const char *name, int pattern)
+{
+  struct sub_entry **pp, *p;
+
+  pthread_rwlock_wrlock(&sub->lock);
+  pp = sub_find(sub, name, pattern);
+  p = *pp;
+  if (p)
+    *pp = p->next;
+  pthread_rwlock_unlock(&sub->lock);
+
+  if (!p) {
+    errno = ENOENT;
+    return -1;
+  }
+
+  free(p->name);
+  free(p);
+  return sub_op_push(sub, SUB_OP_UNSUBSCRIBE, pattern, name);
+}
+
+
+int
+redis_subscribe(REDIS_SUB *sub, const char *channel,
+                redis_sub_handler handler, void *data)
+{
+  return sub_add(sub, channel, 0, handler, data);
+}
+
+
+int
+redis_psubscribe(REDIS_SUB *sub, const char *pattern,
+                 redis_sub_handler handler, void *data)
+{
+  return sub_add(sub, pattern, 1, handler, data);
+}
+
+
+int
+redis_unsubscribe(REDIS_SUB *sub, const char *channel)
+{
+  return sub_del(sub, channel, 0);
+}
+
+
+int
+redis_punsubscribe(REDIS_SUB *sub, const char *pattern)
+{
+  return sub_del(sub, pattern, 1);
+}
+
+
+void
+redis_sub_get_stats(REDIS_SUB *sub, struct redis_sub_stats *stats)
+{
+  stats->received = __sync_fetch_and_add(&sub->stats.received, 0);
+  stats->dispatched = __sync_fetch_and_add(&sub->stats.dispatched, 0);
+  stats->unmatched = __sync_fetch_and_add(&sub->stats.unmatched, 0);
+  stats->reconnects = __sync_fetch_and_add(&sub->stats.reconnects, 0);
+}
+
+#endif  /* _PTHREAD */
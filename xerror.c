@@ -15,8 +15,11 @@
 #include <fcntl.h>
 #include <fnmatch.h>
 
+#include <time.h>
+
 #ifdef _PTHREAD
 #include <pthread.h>
+#include <sched.h>
 #endif
 
 #ifndef NO_MCONTEXT
@@ -56,6 +59,18 @@
 #define BACKTRACE_MAX   16
 #define IGNORE_ENVNAME  "XERROR_IGNORES"
 #define IGNORE_FILENAME ".xerrignore"
+#define ASYNC_ENVNAME   "XERROR_ASYNC"
+#define RATE_ENVNAME    "XDEBUG_RATE"
+#define FORMAT_ENVNAME  "XERROR_FORMAT"
+
+#define DEBUG_PREFIX    "%s:%d: "       /* see xdebug() */
+#define RECORD_MAX      ASYNC_MSG_MAX   /* of an encoded record */
+#define RECORD_MSG_MAX  512             /* of the message in a record */
+#define RECORD_NAME_MAX 32              /* of the thread name */
+
+#define ASYNC_MSG_MAX   1024    /* longer messages are truncated */
+#define ASYNC_BATCH_MAX 65536   /* bytes written at once by the writer */
+#define ASYNC_IDLE_MSEC 100
 
 const char *xbacktrace_executable __attribute__((weak)) = "backtrace";
 
@@ -66,6 +81,15 @@ int debug_mode __attribute__((weak));
 int backtrace_mode __attribute__((weak)) = 1;
 int printtid_mode __attribute__((weak)) = 0;
 
+/* Bumped whenever the ignore patterns change; see struct xdebug_site.
+ * Starts from one, so that zero never matches. */
+volatile unsigned xdebug_generation = 1;
+
+static int record_format = XERROR_FORMAT_TEXT;
+
+static double xdebug_rate = 0;  /* messages per second, per site */
+static double xdebug_burst = 0;
+
 static void set_program_name(void) __attribute__((constructor));
 
 static FILE *xerror_stream = (FILE *)-1;
@@ -95,6 +119,19 @@ static int ign_match(const char *src);
 static void ign_free(void);
 
 static void xerror_finalize(void) __attribute__((destructor));
+
+static void xerror_write(const char *buf, size_t len);
+static void xrecord(int level, const char *file, int line, int code,
+                    const char *format, va_list ap);
+static void xdebug_record(int code, int ignore, const char *format,
+                          va_list ap);
+static const char *error_string(int code, char *buf, size_t size);
+
+#ifdef _PTHREAD
+static int async_push(int progname, int code, int show_tid,
+                      const char *format, va_list ap);
+static int async_enqueue(const char *buf, size_t len);
+#endif
 static char *find_executable(const char *exe);
 
 
@@ -286,11 +323,16 @@ xerror(int status, int code, const char *format, ...)
   va_list ap;
 
   va_start(ap, format);
-  xmessage(!printtid_mode, code, 0, printtid_mode, format, ap);
+  if (record_format != XERROR_FORMAT_TEXT)
+    xrecord(XERROR_LEVEL_ERROR, NULL, 0, code, format, ap);
+  else
+    xmessage(!printtid_mode, code, 0, printtid_mode, format, ap);
   va_end(ap);
 
-  if (status)
+  if (status) {
+    xerror_async_stop();        /* flush the pending messages */
     exit(status);
+  }
 }
 
 
@@ -310,11 +352,126 @@ xdebug_(int code, const char *format, ...)
     return;
 
   va_start(ap, format);
-  xmessage(0, code, 1, printtid_mode, format, ap);
+  if (record_format != XERROR_FORMAT_TEXT)
+    xdebug_record(code, 1, format, ap);
+  else
+    xmessage(0, code, 1, printtid_mode, format, ap);
+  va_end(ap);
+}
+
+
+static void
+xmessage_(int progname, int code, int show_tid, const char *format, ...)
+{
+  va_list ap;
+
+  va_start(ap, format);
+  if (record_format != XERROR_FORMAT_TEXT)
+    xdebug_record(code, 0, format, ap);
+  else
+    xmessage(progname, code, 0, show_tid, format, ap);
   va_end(ap);
 }
 
 
+static unsigned long long
+coarse_ns(void)
+{
+  struct timespec ts;
+
+#ifdef CLOCK_MONOTONIC_COARSE
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+  return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/*
+ * Take a token from the bucket of SITE.  Returns -1 if the message
+ * should be suppressed, otherwise the number of the messages
+ * suppressed since the last one.
+ */
+static long
+site_admit(struct xdebug_site *site)
+{
+  unsigned long long now = coarse_ns();
+  long ret;
+
+  while (__sync_lock_test_and_set(&site->lock, 1))
+    ;
+
+  if (site->last_ns == 0)
+    site->tokens = xdebug_burst;
+  else {
+    site->tokens += (now - site->last_ns) * xdebug_rate / 1e9;
+    if (site->tokens > xdebug_burst)
+      site->tokens = xdebug_burst;
+  }
+  site->last_ns = now;
+
+  if (site->tokens < 1.0) {
+    site->suppressed++;
+    ret = -1;
+  }
+  else {
+    site->tokens -= 1.0;
+    ret = site->suppressed;
+    site->suppressed = 0;
+  }
+
+  __sync_lock_release(&site->lock);
+  return ret;
+}
+
+
+void
+xdebug_site_(struct xdebug_site *site, int code, const char *format, ...)
+{
+  unsigned generation = xdebug_generation;
+  va_list ap;
+  long suppressed = 0;
+
+  if (!debug_mode)
+    return;
+
+  if (site->checked != generation) {
+    int pred = ign_match(site->file);
+
+    site->ignored = pred ? generation : 0;
+    __sync_synchronize();
+    site->checked = generation;
+    if (pred)
+      return;
+  }
+  else if (site->ignored == generation)
+    return;
+
+  if (xdebug_rate > 0 && (suppressed = site_admit(site)) < 0)
+    return;
+
+  if (suppressed > 0)
+    xmessage_(0, 0, printtid_mode, "%s:%d: %ld messages suppressed",
+              site->file, site->line, suppressed);
+
+  va_start(ap, format);
+  if (record_format != XERROR_FORMAT_TEXT)
+    xdebug_record(code, 0, format, ap);
+  else
+    xmessage(0, code, 0, printtid_mode, format, ap);
+  va_end(ap);
+}
+
+
+void
+xdebug_set_rate_limit(double rate, unsigned burst)
+{
+  xdebug_burst = burst > 0 ? burst : 1;
+  xdebug_rate = rate > 0 ? rate : 0;
+}
+
+
 void
 xmessage(int progname, int code, int ignore, int show_tid,
          const char *format, va_list ap)
@@ -337,6 +494,13 @@ xmessage(int progname, int code, int ignore, int show_tid,
       return;
   }
 
+#ifdef _PTHREAD
+  if (async_push(progname, code, show_tid, format, ap) == 0) {
+    errno = saved_errno;
+    return;
+  }
+#endif
+
   LOCK();
 
 #ifdef _PTHREAD
@@ -403,6 +567,599 @@ xmessage(int progname, int code, int ignore, int show_tid,
 }
 
 
+/*
+ * Structured records
+ *
+ * Every field is encoded into a buffer on the stack, and the record
+ * goes through the asynchronous backend if it is running.
+ */
+
+int
+xerror_set_format(int format)
+{
+  if (format != XERROR_FORMAT_TEXT && format != XERROR_FORMAT_JSON &&
+      format != XERROR_FORMAT_BINARY) {
+    errno = EINVAL;
+    return -1;
+  }
+  record_format = format;
+  return 0;
+}
+
+
+static const char *
+error_string(int code, char *buf, size_t size)
+{
+#if defined(_GNU_SOURCE) && !defined(__APPLE__)
+  return strerror_r(code, buf, size);
+#else
+  if (strerror_r(code, buf, size) == 0)
+    return buf;
+  return "[xerror] invalid error code";
+#endif
+}
+
+
+/*
+ * Write SRC as a JSON string, or null if SRC is NULL, to DST in at
+ * most SIZE bytes; SRC is truncated if needed.  Returns the length.
+ */
+static size_t
+json_string(char *dst, size_t size, const char *src)
+{
+  static const char hex[] = "0123456789abcdef";
+  size_t len = 0;
+  unsigned char c;
+
+  if (!src) {
+    if (size < 4)
+      return 0;
+    memcpy(dst, "null", 4);
+    return 4;
+  }
+  if (size < 2)
+    return 0;
+
+  dst[len++] = '"';
+  for (; (c = (unsigned char)*src) != '\0'; src++) {
+    if (c == '"' || c == '\\') {
+      if (len + 3 > size)
+        break;
+      dst[len++] = '\\';
+      dst[len++] = c;
+    }
+    else if (c < 0x20) {
+      if (len + 7 > size)
+        break;
+      memcpy(dst + len, "\\u00", 4);
+      dst[len + 4] = hex[c >> 4];
+      dst[len + 5] = hex[c & 0xf];
+      len += 6;
+    }
+    else {
+      if (len + 2 > size)
+        break;
+      dst[len++] = c;
+    }
+  }
+  dst[len++] = '"';
+  return len;
+}
+
+
+/* Copy SRC to DST if it fits in SIZE bytes; returns the length copied. */
+static size_t
+json_raw(char *dst, size_t size, const char *src)
+{
+  size_t n = strlen(src);
+
+  if (n > size)
+    return 0;
+  memcpy(dst, src, n);
+  return n;
+}
+
+
+static size_t
+encode_json(char *buf, size_t size, const struct xerror_record *rec,
+            const char *thread, const char *file, const char *errstr,
+            const char *msg)
+{
+  size_t len;
+  int n;
+
+  /* "}\n" is always written at the end. */
+  size -= 2;
+
+  n = snprintf(buf, size,
+               "{\"ts\":%llu.%09llu,\"level\":\"%s\",\"tid\":%d,"
+               "\"program\":",
+               (unsigned long long)(rec->timestamp / 1000000000ULL),
+               (unsigned long long)(rec->timestamp % 1000000000ULL),
+               rec->level == XERROR_LEVEL_ERROR ? "error" : "debug",
+               (int)rec->tid);
+  len = (n > 0 && (size_t)n < size) ? (size_t)n : 0;
+
+  len += json_string(buf + len, size - len, program_name);
+  len += json_raw(buf + len, size - len, ",\"thread\":");
+  len += json_string(buf + len, size - len, thread);
+  len += json_raw(buf + len, size - len, ",\"file\":");
+  len += json_string(buf + len, size - len, file);
+  n = snprintf(buf + len, size - len, ",\"line\":%d,\"code\":%d,\"error\":",
+               (int)rec->line, (int)rec->code);
+  if (n > 0 && len + n < size)
+    len += n;
+  len += json_string(buf + len, size - len, errstr);
+  n = json_raw(buf + len, size - len, ",\"msg\":");
+  if (n > 0) {
+    len += n;
+    len += json_string(buf + len, size - len, msg);
+  }
+
+  buf[len++] = '}';
+  buf[len++] = '\n';
+  return len;
+}
+
+
+static size_t
+encode_binary(char *buf, size_t size, struct xerror_record *rec,
+              const char *thread, const char *file, const char *msg)
+{
+  const char *fields[] = { program_name, thread, file, msg };
+  uint16_t *lens[] = { &rec->program_len, &rec->thread_len,
+                       &rec->file_len, &rec->message_len };
+  size_t len = sizeof(*rec), n;
+  int i;
+
+  for (i = 0; i < 4; i++) {
+    n = fields[i] ? strlen(fields[i]) : 0;
+    if (n > size - len)
+      n = size - len;
+    if (n)
+      memcpy(buf + len, fields[i], n);
+    *lens[i] = (uint16_t)n;
+    len += n;
+  }
+  rec->size = (uint32_t)len;
+  memcpy(buf, rec, sizeof(*rec));
+  return len;
+}
+
+
+static __thread int record_busy;        /* xrecord() is on the stack */
+
+static void
+xrecord(int level, const char *file, int line, int code,
+        const char *format, va_list ap)
+{
+  char buf[RECORD_MAX];
+  char msg[RECORD_MSG_MAX];
+  char thread[RECORD_NAME_MAX];
+  char errbuf[BUFSIZ];
+  const char *errstr = NULL;
+  struct xerror_record rec;
+  struct timespec ts;
+  int saved_errno = errno;
+  size_t len;
+
+  if (record_busy)
+    return;
+  record_busy = 1;
+
+  vsnprintf(msg, sizeof(msg), format, ap);
+  if (code)
+    errstr = error_string(code, errbuf, sizeof(errbuf));
+
+  thread[0] = '\0';
+#ifdef _PTHREAD
+  xthread_get_name(thread, sizeof(thread));
+#endif
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+
+  memset(&rec, 0, sizeof(rec));
+  rec.version = XERROR_RECORD_VERSION;
+  rec.level = level;
+  rec.timestamp = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  rec.tid = get_tid();
+  rec.code = code;
+  rec.line = line;
+
+  if (record_format == XERROR_FORMAT_BINARY)
+    len = encode_binary(buf, sizeof(buf), &rec, thread, file, msg);
+  else
+    len = encode_json(buf, sizeof(buf), &rec,
+                      thread[0] ? thread : NULL, file, errstr, msg);
+
+#ifdef _PTHREAD
+  if (async_enqueue(buf, len) != 0)
+#endif
+    xerror_write(buf, len);
+
+  record_busy = 0;
+  errno = saved_errno;
+}
+
+
+/*
+ * Record a message of xdebug(), whose FORMAT starts with DEBUG_PREFIX
+ * for the file name and the line number.  If IGNORE is nonzero, the
+ * ignore patterns are consulted.
+ */
+static void
+xdebug_record(int code, int ignore, const char *format, va_list ap)
+{
+  const char *file = NULL;
+  int line = 0;
+
+  if (strncmp(format, DEBUG_PREFIX, sizeof(DEBUG_PREFIX) - 1) == 0) {
+    file = va_arg(ap, const char *);
+    line = va_arg(ap, int);
+    format += sizeof(DEBUG_PREFIX) - 1;
+    if (ignore && ign_match(file))
+      return;
+  }
+  xrecord(XERROR_LEVEL_DEBUG, file, line, code, format, ap);
+}
+
+
+/*
+ * Write BUF of LEN bytes, which is already formatted, to the stream.
+ */
+static void
+xerror_write(const char *buf, size_t len)
+{
+  LOCK();
+  if (xerror_stream == (FILE *)-1 && stderr != NULL)
+    xerror_redirect_unlocked(stderr);
+  if (xerror_stream && xerror_stream != (FILE *)-1 && len > 0) {
+    flockfile(xerror_stream);
+    fwrite(buf, 1, len, xerror_stream);
+    funlockfile(xerror_stream);
+  }
+  UNLOCK();
+}
+
+
+#ifdef _PTHREAD
+/*
+ * Asynchronous backend
+ *
+ * The callers format the message into a per-thread buffer, and push
+ * it to a bounded lock-free ring (multiple producers, one consumer).
+ * The writer thread pops the messages and writes them in batches.  If
+ * the ring is full, the message is dropped and counted; the writer
+ * reports the number of dropped messages.
+ */
+
+struct async_slot {
+  volatile size_t seq;
+  size_t len;
+  char msg[ASYNC_MSG_MAX];
+};
+
+static struct {
+  struct async_slot *slots;
+  size_t mask;
+  volatile size_t head;         /* next position to push */
+  size_t tail;                  /* next position to pop; writer only */
+
+  volatile int running;
+  volatile int users;           /* producers in async_push() */
+  volatile int sleeping;        /* the writer waits for COND */
+  unsigned long dropped;
+  unsigned long reported;       /* writer only */
+
+  pthread_t writer;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+} async = {
+  .mutex = PTHREAD_MUTEX_INITIALIZER,
+  .cond = PTHREAD_COND_INITIALIZER,
+};
+
+static __thread char async_buf[ASYNC_MSG_MAX];
+static __thread int async_busy;  /* async_push() is on the stack */
+
+
+/*
+ * Format the message in the same way as xmessage() does.  Returns the
+ * length of the message, including the trailing newline.
+ */
+static size_t
+async_format(char *buf, size_t size, int progname, int code, int show_tid,
+             const char *format, va_list ap)
+{
+  char errbuf[BUFSIZ];
+  const char *errstr = NULL;
+  size_t len = 0;
+  int n;
+
+  if (progname) {
+    if (program_name)
+      len = snprintf(buf, size, "%s: ", program_name);
+  }
+  else if (show_tid) {
+    const char *tname = xthread_get_name(errbuf, BUFSIZ);
+    if (!tname || tname[0] == '\0')
+      tname = "T";
+    len = snprintf(buf, size, "%s-%u: ", tname, get_tid());
+  }
+  if (len >= size)
+    len = size - 1;
+
+  n = vsnprintf(buf + len, size - len, format, ap);
+  if (n > 0)
+    len += n;
+  if (len >= size)
+    len = size - 1;
+
+  if (code && len + 3 < size) {
+    errstr = error_string(code, errbuf, BUFSIZ);
+    n = snprintf(buf + len, size - len, ": %s", errstr);
+    if (n > 0)
+      len += n;
+    if (len >= size)
+      len = size - 1;
+  }
+
+  if (len == size - 1)
+    len--;                      /* truncated; keep room for newline */
+  buf[len++] = '\n';
+  return len;
+}
+
+
+/*
+ * Returns zero if the message is queued or dropped, and -1 if the
+ * asynchronous backend is not running.
+ */
+static int
+async_push(int progname, int code, int show_tid,
+           const char *format, va_list ap)
+{
+
+  size_t len;
+
+  if (!async.running || async_busy)
+    return -1;
+
+  async_busy = 1;
+  len = async_format(async_buf, sizeof(async_buf), progname, code, show_tid,
+                     format, ap);
+  async_busy = 0;
+
+  return async_enqueue(async_buf, len);
+}
+
+
+/*
+ * Queue BUF of LEN bytes (at most ASYNC_MSG_MAX).  Returns zero if it
+ * is queued or dropped, and -1 if the asynchronous backend is not
+ * running.
+ */
+static int
+async_enqueue(const char *buf, size_t len)
+{
+  struct async_slot *slot;
+  size_t pos;
+  long diff;
+
+  if (!async.running)
+    return -1;
+
+  __sync_fetch_and_add(&async.users, 1);
+  if (!async.running) {         /* xerror_async_stop() is in progress */
+    __sync_fetch_and_sub(&async.users, 1);
+    return -1;
+  }
+
+  pos = async.head;
+  while (1) {
+    slot = &async.slots[pos & async.mask];
+    diff = (long)slot->seq - (long)pos;
+    if (diff == 0) {
+      if (__sync_bool_compare_and_swap(&async.head, pos, pos + 1))
+        break;
+      pos = async.head;
+    }
+    else if (diff < 0) {        /* full */
+      __sync_fetch_and_add(&async.dropped, 1);
+      __sync_fetch_and_sub(&async.users, 1);
+      return 0;
+    }
+    else
+      pos = async.head;
+  }
+
+  memcpy(slot->msg, buf, len);
+  slot->len = len;
+  __sync_synchronize();
+  slot->seq = pos + 1;
+
+  if (async.sleeping) {
+    pthread_mutex_lock(&async.mutex);
+    pthread_cond_signal(&async.cond);
+    pthread_mutex_unlock(&async.mutex);
+  }
+
+  __sync_fetch_and_sub(&async.users, 1);
+  return 0;
+}
+
+
+/*
+ * Write every queued message.  Returns the number of the messages.
+ */
+static size_t
+async_drain(char *batch)
+{
+  struct async_slot *slot;
+  unsigned long dropped;
+  size_t len = 0, count = 0;
+
+  while (1) {
+    slot = &async.slots[async.tail & async.mask];
+    if (slot->seq != async.tail + 1)
+      break;
+    __sync_synchronize();
+
+    if (len + slot->len > ASYNC_BATCH_MAX) {
+      xerror_write(batch, len);
+      len = 0;
+    }
+    memcpy(batch + len, slot->msg, slot->len);
+    len += slot->len;
+
+    __sync_synchronize();
+    slot->seq = async.tail + async.mask + 1;
+    async.tail++;
+    count++;
+  }
+
+  dropped = __sync_fetch_and_add(&async.dropped, 0);
+  if (dropped != async.reported) {
+    int n = snprintf(batch + len, ASYNC_BATCH_MAX + ASYNC_MSG_MAX - len,
+                     "%s%s%lu messages dropped\n",
+                     program_name ? program_name : "",
+                     program_name ? ": " : "",
+                     dropped - async.reported);
+    if (n > 0)
+      len += n;
+    async.reported = dropped;
+  }
+
+  xerror_write(batch, len);
+  return count;
+}
+
+
+static void *
+async_main(void *arg)
+{
+  char *batch = (char *)arg;
+  struct timespec ts;
+
+  xthread_set_name("xerror-writer");
+
+  while (async.running) {
+    if (async_drain(batch) > 0)
+      continue;
+
+    pthread_mutex_lock(&async.mutex);
+    async.sleeping = 1;
+    __sync_synchronize();
+    /* A producer may have pushed before it saw SLEEPING; the timeout
+     * bounds the delay in that case. */
+    if (async.running &&
+        async.slots[async.tail & async.mask].seq != async.tail + 1) {
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_nsec += ASYNC_IDLE_MSEC * 1000000L;
+      if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+      }
+      pthread_cond_timedwait(&async.cond, &async.mutex, &ts);
+    }
+    async.sleeping = 0;
+    pthread_mutex_unlock(&async.mutex);
+  }
+
+  async_drain(batch);
+  free(batch);
+  return NULL;
+}
+#endif  /* _PTHREAD */
+
+
+int
+xerror_async_start(size_t slots)
+{
+#ifdef _PTHREAD
+  char *batch;
+  size_t i, n;
+  int ret;
+
+  if (async.running || async.slots) {
+    errno = EBUSY;
+    return -1;
+  }
+
+  for (n = 2; n < slots; n *= 2)
+    ;
+  async.slots = malloc(n * sizeof(*async.slots));
+  batch = malloc(ASYNC_BATCH_MAX + ASYNC_MSG_MAX);
+  if (!async.slots || !batch) {
+    free(async.slots);
+    free(batch);
+    async.slots = NULL;
+    errno = ENOMEM;
+    return -1;
+  }
+  for (i = 0; i < n; i++)
+    async.slots[i].seq = i;
+  async.mask = n - 1;
+  async.head = async.tail = 0;
+  async.dropped = async.reported = 0;
+  async.running = 1;
+
+  ret = pthread_create(&async.writer, NULL, async_main, batch);
+  if (ret) {
+    async.running = 0;
+    free(async.slots);
+    async.slots = NULL;
+    free(batch);
+    errno = ret;
+    return -1;
+  }
+  return 0;
+#else
+  (void)slots;
+  errno = ENOSYS;
+  return -1;
+#endif  /* _PTHREAD */
+}
+
+
+void
+xerror_async_stop(void)
+{
+#ifdef _PTHREAD
+  if (!async.running || pthread_equal(async.writer, pthread_self()))
+    return;
+
+  /* Only one caller (e.g. exit(3) racing a fatal xerror()) stops it. */
+  if (!__sync_bool_compare_and_swap(&async.running, 1, 0))
+    return;
+  __sync_synchronize();
+  /* Wait for the producers that saw RUNNING, so that their messages
+   * are written by the last async_drain(). */
+  while (async.users > 0)
+    sched_yield();
+
+  pthread_mutex_lock(&async.mutex);
+  pthread_cond_signal(&async.cond);
+  pthread_mutex_unlock(&async.mutex);
+  pthread_join(async.writer, NULL);
+
+  free(async.slots);
+  async.slots = NULL;
+#endif  /* _PTHREAD */
+}
+
+
+unsigned long
+xerror_async_dropped(void)
+{
+#ifdef _PTHREAD
+  return __sync_fetch_and_add(&async.dropped, 0);
+#else
+  return 0;
+#endif
+}
+
+
 static char *
 long2str(char *buf, size_t bufsize, long l, int base)
 {
@@ -665,6 +1422,8 @@ ign_load_file(const char *pathname)
   free(line);
   fclose(fp);
 
+  __sync_fetch_and_add(&xdebug_generation, 1);
+
   return 0;
 }
 
@@ -725,6 +1484,8 @@ ign_free(void)
   ignore.pat = 0;
   ignore.cap = 0;
 
+  __sync_fetch_and_add(&xdebug_generation, 1);
+
   for (i = 0; i < cur; i++)
     free(pat[i]);
 
@@ -735,6 +1496,7 @@ ign_free(void)
 static void
 xerror_finalize(void)
 {
+  xerror_async_stop();
   ign_free();
   free(xerror_bt_filename);
   free(xerror_bt_command);
@@ -762,6 +1524,9 @@ xerror_init(const char *prog_name, const char *ignore_search_dir)
 {
   char *debug = getenv("XDEBUG");
   char *thread = getenv("XDEBUG_THREAD");
+  char *async_slots = getenv(ASYNC_ENVNAME);
+  char *rate = getenv(RATE_ENVNAME);
+  char *format = getenv(FORMAT_ENVNAME);
 
   if (prog_name)
     program_name = prog_name;
@@ -780,6 +1545,20 @@ xerror_init(const char *prog_name, const char *ignore_search_dir)
       printtid_mode = 0;
   }
 
+  if (format) {
+    if (strcmp(format, "json") == 0)
+      record_format = XERROR_FORMAT_JSON;
+    else if (strcmp(format, "binary") == 0)
+      record_format = XERROR_FORMAT_BINARY;
+    else
+      record_format = XERROR_FORMAT_TEXT;
+  }
+
+  if (rate) {
+    char *colon = strchr(rate, ':');
+    xdebug_set_rate_limit(atof(rate), colon ? atoi(colon + 1) : 1);
+  }
+
   ign_load(ignore_search_dir);
 
 #ifdef _PTHREAD
@@ -794,6 +1573,10 @@ xerror_init(const char *prog_name, const char *ignore_search_dir)
 
   xerror_redirect(stderr);
 
+  if (async_slots && atol(async_slots) > 0 &&
+      xerror_async_start(atol(async_slots)) == -1)
+    xerror(0, errno, "can't start the asynchronous logging");
+
   return 0;
 }
 
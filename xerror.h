@@ -14,6 +14,7 @@
 
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdint.h>
 
 /* This indirect using of extern "C" { ... } makes Emacs happy */
 #ifndef BEGIN_C_DECLS
@@ -55,6 +56,11 @@ extern const char *xbacktrace_executable;
  *                    The actual filename will be $XBACKTRACE_FILE.PID,
  *                    where PID is the pid of the process.
  * - XERROR_IGNORES: filename for the ignore patterns.
+ * - XERROR_ASYNC: if set to N > 0, xerror_init() calls
+ *                 xerror_async_start(N).
+ * - XDEBUG_RATE: "RATE[:BURST]", see xdebug_set_rate_limit().
+ * - XERROR_FORMAT: "text" (default), "json" or "binary"; see
+ *                  xerror_set_format().
  */
 
 /*
@@ -81,9 +87,53 @@ extern void xerror(int status, int code, const char *format, ...)
  * not be generated if the application defined 'debug_mode' to zero.
  *
  * By default, 'debug_mode' is set to zero.
+ *
+ * Each xdebug() call site has its own static descriptor, which caches
+ * whether the site matches the ignore patterns.  So a call costs one
+ * branch if 'debug_mode' is zero, and one more if the site is
+ * ignored.  See also xdebug_set_rate_limit().
  */
 #define xdebug(code, fmt, ...)                                          \
-    xdebug_((code), ("%s:%d: " fmt), __FILE__, __LINE__, ## __VA_ARGS__)
+  do {                                                                  \
+    static struct xdebug_site xdebug_site__ = {                         \
+      .file = __FILE__, .line = __LINE__,                               \
+    };                                                                  \
+    if (__builtin_expect(debug_mode, 0) &&                              \
+        xdebug_site__.ignored != xdebug_generation)                     \
+      xdebug_site_(&xdebug_site__, (code), ("%s:%d: " fmt),             \
+                   __FILE__, __LINE__, ## __VA_ARGS__);                 \
+  } while (0)
+
+/* For xdebug() only; do not use these directly. */
+struct xdebug_site {
+  const char *file;
+  int line;
+  volatile unsigned ignored;    /* xdebug_generation if ignored */
+  volatile unsigned checked;    /* xdebug_generation when checked */
+  volatile int lock;
+  double tokens;                /* see xdebug_set_rate_limit() */
+  unsigned long long last_ns;
+  unsigned long suppressed;
+};
+
+extern int debug_mode;
+extern volatile unsigned xdebug_generation;
+
+extern void xdebug_site_(struct xdebug_site *site, int code,
+                         const char *format, ...)
+  __attribute__((format (printf, 3, 4)));
+
+/*
+ * Limit every xdebug() call site to RATE messages per second, with
+ * bursts of up to BURST messages (token bucket).  The messages over
+ * the limit are counted, and the next message from the site is
+ * preceded by "N messages suppressed".  Zero RATE removes the limit,
+ * which is the default.
+ *
+ * xerror_init() sets the limit from the environment variable
+ * XDEBUG_RATE, in the form "RATE[:BURST]".
+ */
+extern void xdebug_set_rate_limit(double rate, unsigned burst);
 
 /*
  * Return nonzero if 'debug_mode' is nonzero.
@@ -111,6 +161,84 @@ extern void xmessage(int progname, int code, int ignore, int show_tid,
  */
 extern FILE *xerror_redirect(FILE *fp);
 
+/*
+ * Start the asynchronous backend.  After this, x*() functions format
+ * the message into a per-thread buffer and queue it in a lock-free
+ * ring of SLOTS messages (rounded up to a power of two), which is
+ * written by a background thread.  Messages longer than 1023 bytes are
+ * truncated.  If the ring is full, the message is dropped; the writer
+ * reports how many were dropped.
+ *
+ * xerror() with nonzero STATUS, and the program exit flush the
+ * pending messages.
+ *
+ * Returns zero on success, -1 on failure with errno set (ENOSYS if
+ * built without _PTHREAD).
+ */
+extern int xerror_async_start(size_t slots);
+
+/*
+ * Write the pending messages, and stop the asynchronous backend.
+ * Messages are written synchronously again after this.
+ */
+extern void xerror_async_stop(void);
+
+/*
+ * Return the number of messages dropped since xerror_async_start().
+ */
+extern unsigned long xerror_async_dropped(void);
+
+enum {
+  XERROR_FORMAT_TEXT,           /* lines of free-form text */
+  XERROR_FORMAT_JSON,           /* one JSON object per line */
+  XERROR_FORMAT_BINARY,         /* struct xerror_record, and strings */
+};
+
+enum {
+  XERROR_LEVEL_ERROR = 1,       /* xerror() */
+  XERROR_LEVEL_DEBUG = 2,       /* xdebug() */
+};
+
+#define XERROR_RECORD_VERSION   1
+
+/*
+ * A record of XERROR_FORMAT_BINARY, in host byte order.  It is
+ * followed by the program name, the thread name, the file name and
+ * the message, of the lengths given here, without NUL.
+ *
+ * XERROR_FORMAT_JSON has the same fields:
+ *
+ *   {"ts":1760000000.123456789,"level":"debug","tid":4242,
+ *    "program":"app","thread":"sredis-sub-rd","file":"sredis.c",
+ *    "line":712,"code":111,"error":"Connection refused",
+ *    "msg":"can't connect to the redis server"}
+ *
+ * where "ts" is the time in seconds since the Epoch, and the absent
+ * strings are null.  A message is truncated to 511 bytes.
+ */
+struct xerror_record {
+  uint32_t size;                /* of the record, including the strings */
+  uint16_t version;             /* XERROR_RECORD_VERSION */
+  uint8_t level;                /* XERROR_LEVEL_* */
+  uint8_t reserved;
+  uint64_t timestamp;           /* CLOCK_REALTIME in nanoseconds */
+  int32_t tid;
+  int32_t code;                 /* errno value, or zero */
+  int32_t line;                 /* zero if unknown */
+  uint16_t program_len;
+  uint16_t thread_len;
+  uint16_t file_len;
+  uint16_t message_len;
+  uint32_t reserved2;
+};
+
+/*
+ * Select the output format of xerror() and xdebug().  xmessage()
+ * always writes text.  Returns zero on success, -1 if FORMAT is
+ * unknown.
+ */
+extern int xerror_set_format(int format);
+
 /*
  * Register one or more signals to generate backtrace if the program
  * receives signals.  Note that the last argument should be zero.